@@ -3,11 +3,28 @@
         {
             "target_name": "jpeg",
             "sources": [
+                "src/buffer_compat.cpp",
                 "src/common.cpp",
+                "src/pixel_kernels.cpp",
+                "src/jpeg_destination.cpp",
                 "src/jpeg_encoder.cpp",
+                "src/jpeg_segments.cpp",
+                "src/jpeg_probe.cpp",
+                "src/jpeg_row_cache.cpp",
+                "src/jpeg_pyramid.cpp",
+                "src/jpeg_coef_canvas.cpp",
+                "src/parallel.cpp",
                 "src/jpeg.cpp",
+                "src/jpeg_errors.cpp",
+                "src/jpeg_decompressor.cpp",
+                "src/jpeg_decoder.cpp",
+                "src/jpeg_transformer.cpp",
+                "src/jpeg_transform.cpp",
                 "src/fixed_jpeg_stack.cpp",
+                "src/dirty_region.cpp",
                 "src/dynamic_jpeg_stack.cpp",
+                "src/mjpeg_container.cpp",
+                "src/mjpeg_stream.cpp",
                 "src/module.cpp",
             ],
             "conditions" : [
@@ -39,6 +56,15 @@
                     }
                 ]
             ]
+        },
+        {
+            "target_name": "test_pixel_kernels",
+            "type": "executable",
+            "include_dirs": [ "src" ],
+            "sources": [
+                "test/pixel_kernels.cpp",
+                "src/pixel_kernels.cpp"
+            ]
         }
     ]
 }
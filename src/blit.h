@@ -0,0 +1,97 @@
+#ifndef BLIT_H
+#define BLIT_H
+
+#include <cstring>
+
+#include "common.h"
+
+// Compile-time description of each source pixel format: its size and how a
+// row of it becomes packed RGB. The swizzles go to the SIMD row kernels in
+// pixel_kernels.cpp, plain RGB rows are memcpy'd.
+template <buffer_type T> struct pixel_format;
+
+template <> struct pixel_format<BUF_RGB> {
+    enum { bpp = 3 };
+    static void to_rgb(const unsigned char *src, unsigned char *rgb, int pixels) {
+        memcpy(rgb, src, pixels*3);
+    }
+};
+
+template <> struct pixel_format<BUF_BGR> {
+    enum { bpp = 3 };
+    static void to_rgb(const unsigned char *src, unsigned char *rgb, int pixels) {
+        bgr_to_rgb_row(src, rgb, pixels);
+    }
+};
+
+template <> struct pixel_format<BUF_RGBA> {
+    enum { bpp = 4 };
+    static void to_rgb(const unsigned char *src, unsigned char *rgb, int pixels) {
+        rgba_to_rgb_row(src, rgb, pixels);
+    }
+};
+
+template <> struct pixel_format<BUF_BGRA> {
+    enum { bpp = 4 };
+    static void to_rgb(const unsigned char *src, unsigned char *rgb, int pixels) {
+        bgra_to_rgb_row(src, rgb, pixels);
+    }
+};
+
+// Copies a w x h block of T pixels into an RGB canvas. Strides are in bytes.
+template <buffer_type T>
+void blit_to_rgb(unsigned char *dst, int dst_stride,
+    const unsigned char *src, int src_stride, int w, int h)
+{
+    if (dst_stride == w*3 && src_stride == w*pixel_format<T>::bpp) {
+        // rows are contiguous on both sides, convert in one go
+        pixel_format<T>::to_rgb(src, dst, w*h);
+        return;
+    }
+    for (int i = 0; i < h; i++, dst += dst_stride, src += src_stride)
+        pixel_format<T>::to_rgb(src, dst, w);
+}
+
+// Converts a w x h I420, NV12 or YUYV image into an RGB canvas. src_stride
+// is the distance between luma rows, see yuv_layout.
+inline void blit_yuv_to_rgb(unsigned char *dst, int dst_stride,
+    const unsigned char *src, int src_stride, int w, int h, buffer_type buf_type)
+{
+    yuv_layout yuv(src, h, src_stride, buf_type);
+    for (int i = 0; i < h; i++, dst += dst_stride)
+        yuv_to_rgb_row(yuv.y_row(i), yuv.y_step, yuv.u_row(i), yuv.v_row(i), yuv.uv_step, dst, w);
+}
+
+// Picks the specialization once per blit rather than once per pixel.
+inline void blit_to_rgb(unsigned char *dst, int dst_stride,
+    const unsigned char *src, int src_stride, int w, int h, buffer_type buf_type)
+{
+    switch (buf_type) {
+    case BUF_RGB:
+        blit_to_rgb<BUF_RGB>(dst, dst_stride, src, src_stride, w, h);
+        break;
+
+    case BUF_BGR:
+        blit_to_rgb<BUF_BGR>(dst, dst_stride, src, src_stride, w, h);
+        break;
+
+    case BUF_RGBA:
+        blit_to_rgb<BUF_RGBA>(dst, dst_stride, src, src_stride, w, h);
+        break;
+
+    case BUF_BGRA:
+        blit_to_rgb<BUF_BGRA>(dst, dst_stride, src, src_stride, w, h);
+        break;
+
+    case BUF_I420:
+    case BUF_NV12:
+    case BUF_YUYV:
+        blit_yuv_to_rgb(dst, dst_stride, src, src_stride, w, h, buf_type);
+        break;
+
+    default:
+        throw "Unexpected buf_type in blit_to_rgb";
+    }
+}
+
+#endif
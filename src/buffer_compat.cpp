@@ -1,3 +1,4 @@
+#include <cstdlib>
 #include <node.h>
 #include <node_buffer.h>
 #include <node_version.h>
@@ -12,3 +13,14 @@ char *BufferData(v8::Local<v8::Object> buf_obj) {
 size_t BufferLength(v8::Local<v8::Object> buf_obj) {
     return node::Buffer::Length(buf_obj);
 }
+
+
+static void FreeMallocBuffer(char *data, void *hint) {
+    free(data);
+}
+
+// Wraps a malloc'd block in a Buffer without copying it. The Buffer takes
+// ownership and free()s the block when it is garbage collected.
+v8::Local<v8::Object> BufferFromMalloc(v8::Isolate *isolate, char *data, size_t length) {
+    return node::Buffer::New(isolate, data, length, FreeMallocBuffer, NULL).ToLocalChecked();
+}
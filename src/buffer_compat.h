@@ -7,5 +7,6 @@
 
 char * BufferData(v8::Local<v8::Object> buf_obj);
 size_t BufferLength(v8::Local<v8::Object> buf_obj);
+v8::Local<v8::Object> BufferFromMalloc(v8::Isolate *isolate, char *data, size_t length);
 
 #endif  // buffer_compat_h
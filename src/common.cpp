@@ -1,6 +1,7 @@
 #include <cstdlib>
 #include <cassert>
 #include <string>
+#include <algorithm>
 #include "common.h"
 
 using namespace std;
@@ -15,15 +16,171 @@ Handle<Value> ErrorException(Isolate * isolate, const char *msg) {
 }
 
 Handle<Value> VException(Isolate * isolate, const char *msg) {
-    isolate->ThrowException(
+    return isolate->ThrowException(
         ErrorException( isolate, msg )
     );
 }
 
+Rect Rect::united(const Rect &r) const {
+    int x1 = min(x, r.x), y1 = min(y, r.y);
+    int x2 = max(x+w, r.x+r.w), y2 = max(y+h, r.y+r.h);
+    return Rect(x1, y1, x2-x1, y2-y1);
+}
+
 bool str_eq(const char *s1, const char *s2) {
     return strcmp(s1, s2) == 0;
 }
 
+// Maps 'rgb', 'bgr', 'rgba', 'bgra', 'i420', 'nv12' or 'yuyv' to its
+// buffer_type, returns false for anything else.
+bool parse_buffer_type(const char *str, buffer_type *buf_type) {
+    if (str_eq(str, "rgb")) {
+        *buf_type = BUF_RGB;
+    } else if (str_eq(str, "bgr")) {
+        *buf_type = BUF_BGR;
+    } else if (str_eq(str, "rgba")) {
+        *buf_type = BUF_RGBA;
+    } else if (str_eq(str, "bgra")) {
+        *buf_type = BUF_BGRA;
+    } else if (str_eq(str, "i420")) {
+        *buf_type = BUF_I420;
+    } else if (str_eq(str, "nv12")) {
+        *buf_type = BUF_NV12;
+    } else if (str_eq(str, "yuyv")) {
+        *buf_type = BUF_YUYV;
+    } else {
+        return false;
+    }
+    return true;
+}
+
+bool parse_subsampling(const char *str, chroma_subsampling *subsampling) {
+    if (str_eq(str, "4:2:0")) {
+        *subsampling = SUBSAMPLE_420;
+    } else if (str_eq(str, "4:2:2")) {
+        *subsampling = SUBSAMPLE_422;
+    } else if (str_eq(str, "4:4:4")) {
+        *subsampling = SUBSAMPLE_444;
+    } else if (str_eq(str, "gray")) {
+        *subsampling = SUBSAMPLE_GRAY;
+    } else {
+        return false;
+    }
+    return true;
+}
+
+// Bytes per pixel of the packed RGB formats. YUV formats don't have a
+// whole number of them, see row_bytes() and image_bytes().
+int bytes_per_pixel(buffer_type buf_type) {
+    switch (buf_type) {
+    case BUF_RGBA:
+    case BUF_BGRA:
+        return 4;
+    default:
+        return 3;
+    }
+}
+
+bool is_yuv(buffer_type buf_type) {
+    return buf_type == BUF_I420 || buf_type == BUF_NV12 || buf_type == BUF_YUYV;
+}
+
+// Bytes in a tightly packed row of w pixels; for I420 and NV12, in a row of
+// the luma plane.
+int row_bytes(buffer_type buf_type, int w) {
+    switch (buf_type) {
+    case BUF_I420:
+    case BUF_NV12:
+        return w;
+    case BUF_YUYV:
+        return (w + 1)/2*4;
+    default:
+        return w*bytes_per_pixel(buf_type);
+    }
+}
+
+// Bytes a w x h image takes up when its rows, luma rows for I420 and NV12,
+// start 'stride' bytes apart. Chroma planes are laid out as in yuv_layout.
+size_t image_bytes(buffer_type buf_type, int w, int h, int stride) {
+    if (h == 0)
+        return 0;
+    switch (buf_type) {
+    case BUF_I420:
+        return (size_t)h*stride + 2*(size_t)((stride + 1)/2)*((h + 1)/2);
+    case BUF_NV12:
+        return (size_t)h*stride + (size_t)((stride + 1)/2*2)*((h + 1)/2);
+    default:
+        return (size_t)(h - 1)*stride + row_bytes(buf_type, w);
+    }
+}
+
+yuv_layout::yuv_layout(const unsigned char *data, int height, int stride,
+    buffer_type buf_type)
+{
+    y = data;
+    y_stride = stride;
+    switch (buf_type) {
+    case BUF_I420:
+        y_step = 1;
+        uv_stride = (stride + 1)/2;
+        uv_step = 1;
+        uv_shift = 1;
+        u = data + (size_t)height*stride;
+        v = u + (size_t)uv_stride*((height + 1)/2);
+        break;
+    case BUF_NV12:
+        y_step = 1;
+        uv_stride = (stride + 1)/2*2;
+        uv_step = 2;
+        uv_shift = 1;
+        u = data + (size_t)height*stride;
+        v = u + 1;
+        break;
+    default: // BUF_YUYV
+        y_step = 2;
+        uv_stride = stride;
+        uv_step = 4;
+        uv_shift = 0;
+        u = data + 1;
+        v = data + 3;
+        break;
+    }
+}
+
+// Returns the row converter that turns buf_type pixels into RGB, or NULL for
+// BUF_RGB, whose rows can be used as they are.
+row_converter rgb_row_converter(buffer_type buf_type) {
+    switch (buf_type) {
+    case BUF_RGBA:
+        return active_pixel_kernels().rgba_to_rgb;
+    case BUF_BGRA:
+        return active_pixel_kernels().bgra_to_rgb;
+    case BUF_BGR:
+        return active_pixel_kernels().bgr_to_rgb;
+    default:
+        return NULL;
+    }
+}
+
+// Converts a row of full range (JFIF) YCbCr to RGB the way libjpeg's
+// decoder does, in 16 bit fixed point. Pixel i takes chroma sample i/2.
+void yuv_to_rgb_row(const unsigned char *y, int y_step,
+    const unsigned char *u, const unsigned char *v, int uv_step,
+    unsigned char *rgb, int pixels)
+{
+    for (int i = 0; i < pixels; i++, y += y_step, rgb += 3) {
+        int cb = u[(i >> 1)*uv_step] - 128;
+        int cr = v[(i >> 1)*uv_step] - 128;
+        int l = *y;
+        int r = l + ((91881*cr + 32768) >> 16);
+        int g = l + ((-22554*cb - 46802*cr + 32768) >> 16);
+        int b = l + ((116130*cb + 32768) >> 16);
+        rgb[0] = r < 0 ? 0 : r > 255 ? 255 : r;
+        rgb[1] = g < 0 ? 0 : g > 255 ? 255 : g;
+        rgb[2] = b < 0 ? 0 : b > 255 ? 255 : b;
+    }
+}
+
 unsigned char * rgba_to_rgb(const unsigned char *rgba, int rgba_size) {
 
     assert(rgba_size%4==0);
@@ -32,11 +189,7 @@ unsigned char * rgba_to_rgb(const unsigned char *rgba, int rgba_size) {
     unsigned char *rgb = (unsigned char *)malloc(sizeof(*rgb)*rgb_size);
     if (!rgb) return NULL;
 
-    for (int i=0,j=0; i<rgba_size; i+=4,j+=3) {
-        rgb[j] = rgba[i];
-        rgb[j+1] = rgba[i+1];
-        rgb[j+2] = rgba[i+2];
-    }
+    rgba_to_rgb_row(rgba, rgb, rgba_size/4);
 
     return rgb;
 
@@ -50,11 +203,7 @@ unsigned char * bgra_to_rgb(const unsigned char *bgra, int bgra_size) {
     unsigned char *rgb = (unsigned char *)malloc(sizeof(*rgb)*rgb_size);
     if (!rgb) return NULL;
 
-    for (int i=0,j=0; i<bgra_size; i+=4,j+=3) {
-        rgb[j] = bgra[i+2];
-        rgb[j+1] = bgra[i+1];
-        rgb[j+2] = bgra[i];
-    }
+    bgra_to_rgb_row(bgra, rgb, bgra_size/4);
     return rgb;
 }
 
@@ -65,11 +214,6 @@ unsigned char * bgr_to_rgb(const unsigned char *bgr, int bgr_size) {
     unsigned char *rgb = (unsigned char *)malloc(sizeof(*rgb)*bgr_size);
     if (!rgb) return NULL;
 
-    for (int i=0; i<bgr_size; i+=3) {
-        rgb[i] = bgr[i+2];
-        rgb[i+1] = bgr[i+1];
-        rgb[i+2] = bgr[i];
-    }
+    bgr_to_rgb_row(bgr, rgb, bgr_size/3);
     return rgb;
 }
-
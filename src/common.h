@@ -2,8 +2,12 @@
 #define COMMON_H
 
 #include <node.h>
+
+#include <vector>
 #include <cstring>
 
+#include "pixel_kernels.h"
+
 using v8::Exception;
 using v8::Isolate;
 
@@ -21,6 +25,11 @@ struct Rect {
     Rect() {}
     Rect(int xx, int yy, int ww, int hh) : x(xx), y(yy), w(ww), h(hh) {}
     bool isNull() { return x == 0 && y == 0 && w == 0 && h == 0; }
+    long area() const { return (long)w*h; }
+    bool intersects(const Rect &r) const {
+        return x < r.x+r.w && r.x < x+w && y < r.y+r.h && r.y < y+h;
+    }
+    Rect united(const Rect &r) const; // bounding rect of both
 };
 
 bool str_eq(const char *s1, const char *s2);
@@ -28,16 +37,69 @@ unsigned char *rgba_to_rgb(const unsigned char *rgba, int rgba_size);
 unsigned char *bgra_to_rgb(const unsigned char *rgba, int bgra_size);
 unsigned char *bgr_to_rgb(const unsigned char *rgb, int rgb_size);
 
-typedef enum { BUF_RGB, BUF_BGR, BUF_RGBA, BUF_BGRA } buffer_type;
+typedef enum { BUF_RGB, BUF_BGR, BUF_RGBA, BUF_BGRA, BUF_I420, BUF_NV12, BUF_YUYV } buffer_type;
+
+// Chroma subsampling of encoded jpegs. SUBSAMPLE_GRAY drops chroma and
+// encodes luma only.
+typedef enum { SUBSAMPLE_420, SUBSAMPLE_422, SUBSAMPLE_444, SUBSAMPLE_GRAY } chroma_subsampling;
+
+bool parse_buffer_type(const char *str, buffer_type *buf_type);
+bool parse_subsampling(const char *str, chroma_subsampling *subsampling);
+int bytes_per_pixel(buffer_type buf_type);
+bool is_yuv(buffer_type buf_type);
+int row_bytes(buffer_type buf_type, int w);
+size_t image_bytes(buffer_type buf_type, int w, int h, int stride);
+row_converter rgb_row_converter(buffer_type buf_type);
+void yuv_to_rgb_row(const unsigned char *y, int y_step,
+    const unsigned char *u, const unsigned char *v, int uv_step,
+    unsigned char *rgb, int pixels);
+
+// Where the samples of an I420, NV12 or YUYV image are. Luma rows are
+// 'stride' bytes apart; the chroma planes of I420 and NV12 follow the
+// luma plane, with I420's rows half as long (rounded up) and NV12's
+// interleaved UV rows as long, rounded up to a whole UV pair. Chroma is
+// always halved horizontally, and vertically for I420 and NV12. Steps are
+// the bytes between neighbouring samples of a row.
+struct yuv_layout {
+    const unsigned char *y, *u, *v;
+    int y_stride, uv_stride;
+    int y_step, uv_step;
+    int uv_shift; // chroma row of luma row r is r >> uv_shift
+
+    yuv_layout(const unsigned char *data, int height, int stride, buffer_type buf_type);
+
+    const unsigned char *y_row(int row) const { return y + (size_t)row*y_stride; }
+    const unsigned char *u_row(int row) const { return u + (size_t)(row >> uv_shift)*uv_stride; }
+    const unsigned char *v_row(int row) const { return v + (size_t)(row >> uv_shift)*uv_stride; }
+};
 
 struct encode_request {
-    v8::Local<v8::Function> callback;
+    v8::Persistent<v8::Function> callback;
     v8::Isolate * isolate;
     void *jpeg_obj;
+    unsigned char *canvas; // pixels the job reads, if the object snapshots them
     char *jpeg;
     int jpeg_len;
     char *error;
 };
 
+// Settings of a stack encode, fixed when it starts so that setters called
+// while it runs only affect later encodes. size_hint goes back to the stack
+// once the encode is done.
+struct stack_encode_settings {
+    int quality, threads;
+    chroma_subsampling subsampling;
+    double size_hint;
+};
+
+// encode_request of the stacks, with the change serials of the canvas
+// snapshot it encodes (see JpegRowCache and JpegCoefCanvas).
+struct stack_encode_request : encode_request {
+    std::vector<unsigned long> row_serials;
+    std::vector<unsigned long> mcu_serials;
+    bool coefficients; // encode from the coefficient cache
+    stack_encode_settings settings;
+};
+
 #endif
 
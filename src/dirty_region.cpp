@@ -0,0 +1,67 @@
+#include <climits>
+
+#include "dirty_region.h"
+
+DirtyRegion::DirtyRegion() :
+    overhead(DEFAULT_OVERHEAD), max_rects(DEFAULT_MAX_RECTS) {}
+
+// How much more it costs to encode a and b as one rect than separately.
+// Negative or zero means merging pays off.
+long DirtyRegion::merge_cost(const Rect &a, const Rect &b, long overhead) {
+    return a.united(b).area() - a.area() - b.area() - overhead;
+}
+
+void DirtyRegion::add(const Rect &rect) {
+
+    if (rect.w <= 0 || rect.h <= 0)
+        return;
+
+    // Absorb every rect that overlaps the new one or is cheaper to encode
+    // together with it. The grown rect can reach rects it missed before, so
+    // keep going until a full pass merges nothing. The remaining rects were
+    // already disjoint from each other, so the set stays disjoint.
+    Rect r = rect;
+    bool merged = true;
+    while (merged) {
+        merged = false;
+        for (size_t i = 0; i < rects.size(); i++) {
+            if (r.intersects(rects[i]) || merge_cost(r, rects[i], overhead) <= 0) {
+                r = r.united(rects[i]);
+                rects.erase(rects.begin() + i);
+                merged = true;
+                break;
+            }
+        }
+    }
+    rects.push_back(r);
+
+    while ((int)rects.size() > max_rects)
+        merge_cheapest();
+}
+
+// Merges the pair with the smallest cost increase, then absorbs whatever the
+// merged rect now overlaps.
+void DirtyRegion::merge_cheapest() {
+
+    size_t best_i = 0, best_j = 1;
+    long best = LONG_MAX;
+    for (size_t i = 0; i < rects.size(); i++) {
+        for (size_t j = i+1; j < rects.size(); j++) {
+            long cost = merge_cost(rects[i], rects[j], overhead);
+            if (cost < best) {
+                best = cost;
+                best_i = i;
+                best_j = j;
+            }
+        }
+    }
+
+    Rect r = rects[best_i].united(rects[best_j]);
+    rects.erase(rects.begin() + best_j);
+    rects.erase(rects.begin() + best_i);
+    add(r);
+}
+
+void DirtyRegion::clear() {
+    rects.clear();
+}
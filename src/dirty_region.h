@@ -0,0 +1,40 @@
+#ifndef DIRTY_REGION_H
+#define DIRTY_REGION_H
+
+#include <vector>
+
+#include "common.h"
+
+/*
+ * A set of disjoint dirty rectangles, each of which is encoded as its own
+ * JPEG. Rectangles are merged when that is cheaper by a simple cost model:
+ * encoding a rect costs its area plus a fixed per-JPEG overhead (headers,
+ * tables, compressor setup, one more buffer handed to JS), all in pixels.
+ */
+class DirtyRegion {
+    std::vector<Rect> rects;
+    long overhead;
+    int max_rects;
+
+    static long merge_cost(const Rect &a, const Rect &b, long overhead);
+    void merge_cheapest();
+
+public:
+    // ~64x64 pixels is about what a JPEG header costs at screen-content rates.
+    static const long DEFAULT_OVERHEAD = 4096;
+    static const int DEFAULT_MAX_RECTS = 32;
+
+    DirtyRegion();
+
+    void add(const Rect &rect);
+    void clear();
+
+    const std::vector<Rect> &get() const { return rects; }
+    bool empty() const { return rects.empty(); }
+
+    void set_overhead(long pixels) { overhead = pixels; }
+    void set_max_rects(int n) { max_rects = n; }
+};
+
+#endif
+
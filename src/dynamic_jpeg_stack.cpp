@@ -8,6 +8,9 @@
 #include "dynamic_jpeg_stack.h"
 #include "jpeg_encoder.h"
 #include "buffer_compat.h"
+#include "blit.h"
+#include "parallel.h"
+#include "jpeg_decompressor.h"
 
 using namespace v8;
 using namespace node;
@@ -22,28 +25,42 @@ DynamicJpegStack::Initialize(v8::Handle<v8::Object> target)
     tpl->SetClassName(String::NewFromUtf8(isolate, "DynamicJpegStack"));
     tpl->InstanceTemplate()->SetInternalFieldCount(1);
 
-    Local<FunctionTemplate> t = FunctionTemplate::New(New);
-    t->InstanceTemplate()->SetInternalFieldCount(1);
     NODE_SET_PROTOTYPE_METHOD(tpl, "encode", JpegEncodeAsync);
     NODE_SET_PROTOTYPE_METHOD(tpl, "encodeSync", JpegEncodeSync);
+    NODE_SET_PROTOTYPE_METHOD(tpl, "encodeRegions", JpegEncodeRegionsAsync);
+    NODE_SET_PROTOTYPE_METHOD(tpl, "encodeRegionsSync", JpegEncodeRegionsSync);
+    NODE_SET_PROTOTYPE_METHOD(tpl, "setRegionOverhead", SetRegionOverhead);
     NODE_SET_PROTOTYPE_METHOD(tpl, "push", Push);
+    NODE_SET_PROTOTYPE_METHOD(tpl, "pushJpeg", PushJpeg);
     NODE_SET_PROTOTYPE_METHOD(tpl, "reset", Reset);
     NODE_SET_PROTOTYPE_METHOD(tpl, "setBackground", SetBackground);
     NODE_SET_PROTOTYPE_METHOD(tpl, "setQuality", SetQuality);
+    NODE_SET_PROTOTYPE_METHOD(tpl, "setSubsampling", SetSubsampling);
+    NODE_SET_PROTOTYPE_METHOD(tpl, "setThreads", SetThreads);
+    NODE_SET_PROTOTYPE_METHOD(tpl, "setCoefficientCache", SetCoefficientCache);
     NODE_SET_PROTOTYPE_METHOD(tpl, "dimensions", Dimensions);
 
-    target->Set(String::NewSymbol("DynamicJpegStack"), t->GetFunction());
+    target->Set(String::NewFromUtf8(isolate, "DynamicJpegStack"), tpl->GetFunction());
 
 }
 
 DynamicJpegStack::DynamicJpegStack(buffer_type bbuf_type) :
-    quality(60), buf_type(bbuf_type),
+    quality(60), threads(1), subsampling(SUBSAMPLE_420), buf_type(bbuf_type), size_hint(0),
     dyn_rect(-1, -1, 0, 0),
-    bg_width(0), bg_height(0), data(NULL) {}
+    bg_width(0), bg_height(0), data(NULL),
+    coef_canvas(NULL), use_coefficients(false), encodes_pending(0) {}
 
 DynamicJpegStack::~DynamicJpegStack()
 {
     free(data);
+    delete coef_canvas;
+}
+
+void DynamicJpegStack::drop_coef_canvas() {
+    if (!use_coefficients && encodes_pending == 0) {
+        delete coef_canvas;
+        coef_canvas = NULL;
+    }
 }
 
 void DynamicJpegStack::update_optimal_dimension(int x, int y, int w, int h) {
@@ -67,134 +84,208 @@ void DynamicJpegStack::update_optimal_dimension(int x, int y, int w, int h) {
         dyn_rect.h += hh;
 }
 
-void DynamicJpegStack::JpegEncodeSync() {
+Local<Value> DynamicJpegStack::JpegEncodeSync( Isolate * isolate ) {
 
     try {
+        if (use_coefficients && coef_canvas) {
+            // Only whole MCUs come from the cache, report what was encoded.
+            dyn_rect = coef_canvas->align(dyn_rect);
+
+            unsigned char *jpeg;
+            unsigned long jpeg_len;
+            coef_canvas->encode(data, coef_canvas->get_serials(), quality, dyn_rect,
+                &size_hint, jpeg_margins(), &jpeg, &jpeg_len);
+            return BufferFromMalloc(isolate, (char *)jpeg, jpeg_len);
+        }
+
         JpegEncoder jpeg_encoder(data, bg_width, bg_height, quality, BUF_RGB);
+        jpeg_encoder.set_subsampling(subsampling);
+        jpeg_encoder.set_threads(threads);
+        jpeg_encoder.set_size_hint(size_hint);
         jpeg_encoder.setRect(Rect(dyn_rect.x, dyn_rect.y, dyn_rect.w, dyn_rect.h));
         jpeg_encoder.encode();
+        size_hint = jpeg_encoder.get_size_hint();
+
+        //Buffer send, handing libjpeg's output over without a copy
         int jpeg_len = jpeg_encoder.get_jpeg_len();
-        Buffer *retbuf = Buffer::New(jpeg_len);
-        memcpy(Buffer::Data(retbuf), jpeg_encoder.get_jpeg(), jpeg_len);
-        //return scope.Close(retbuf->handle_);
+        return BufferFromMalloc(
+            isolate,
+            (char *)jpeg_encoder.release_jpeg(),
+            jpeg_len
+        );
     }
     catch (const char *err) {
-        return VException(err);
+        VException( isolate, err );
     }
+
+    return Local<Value>();
 }
 
-void DynamicJpegStack::Push(unsigned char *data_buf, int x, int y, int w, int h) {
+// Encodes one dirty rect on its own. Runs on worker threads for
+// encodeRegions, so it reports errors in the frame instead of throwing.
+void DynamicJpegStack::encode_region(region_frame &region) {
+
+    try {
+        JpegEncoder encoder(data, bg_width, bg_height, quality, BUF_RGB);
+        encoder.set_subsampling(subsampling);
+        encoder.set_size_hint(size_hint);
+        encoder.setRect(region.rect);
+        encoder.encode();
+        region.jpeg_len = encoder.get_jpeg_len();
+        region.jpeg = (char *)encoder.release_jpeg();
+    }
+    catch (const char *err) {
+        strncpy(region.error, err, sizeof(region.error) - 1);
+    }
+}
+
+Local<Object> DynamicJpegStack::RegionObject(Isolate *isolate, const Rect &rect,
+    Local<Value> image)
+{
+    Local<Object> region = Object::New(isolate);
+    region->Set(String::NewFromUtf8(isolate, "image"), image);
+    region->Set(String::NewFromUtf8(isolate, "x"), Integer::New(isolate, rect.x));
+    region->Set(String::NewFromUtf8(isolate, "y"), Integer::New(isolate, rect.y));
+    region->Set(String::NewFromUtf8(isolate, "width"), Integer::New(isolate, rect.w));
+    region->Set(String::NewFromUtf8(isolate, "height"), Integer::New(isolate, rect.h));
+    return region;
+}
 
+Local<Value> DynamicJpegStack::JpegEncodeRegionsSync( Isolate * isolate ) {
+
+    const std::vector<Rect> &rects = dirty.get();
+    Local<Array> regions = Array::New(isolate, rects.size());
+
+    for (size_t i = 0; i < rects.size(); i++) {
+        region_frame region = { rects[i], NULL, 0, "" };
+        encode_region(region);
+        if (region.error[0]) {
+            VException(isolate, region.error);
+            return Local<Value>();
+        }
+        regions->Set(i, RegionObject(
+            isolate,
+            region.rect,
+            BufferFromMalloc(isolate, region.jpeg, region.jpeg_len)
+        ));
+    }
+
+    return regions;
+}
+
+// Adds a changed rect of the canvas to the encoded area and caches.
+void DynamicJpegStack::touch(int x, int y, int w, int h) {
     update_optimal_dimension(x, y, w, h);
+    dirty.add(Rect(x, y, w, h));
+    if (coef_canvas)
+        coef_canvas->stamp(Rect(x, y, w, h));
+}
+
+// Copies a w x h fragment whose rows are 'stride' bytes apart to (x, y).
+void DynamicJpegStack::Push(unsigned char *data_buf, int x, int y, int w, int h, int stride) {
+
+    touch(x, y, w, h);
 
     int start = y*bg_width*3 + x*3;
 
-    switch (buf_type) {
-    case BUF_RGB:
-        for (int i = 0; i < h; i++) {
-            unsigned char *datap = &data[start + i*bg_width*3];
-            for (int j = 0; j < w; j++) {
-                *datap++ = *data_buf++;
-                *datap++ = *data_buf++;
-                *datap++ = *data_buf++;
-            }
-        }
-        break;
-
-    case BUF_BGR:
-        for (int i = 0; i < h; i++) {
-            unsigned char *datap = &data[start + i*bg_width*3];
-            for (int j = 0; j < w; j++) {
-                *datap++ = *(data_buf+2);
-                *datap++ = *(data_buf+1);
-                *datap++ = *data_buf;
-                data_buf+=3;
-            }
-        }
-        break;
-
-    case BUF_RGBA:
-        for (int i = 0; i < h; i++) {
-            unsigned char *datap = &data[start + i*bg_width*3];
-            for (int j = 0; j < w; j++) {
-                *datap++ = *data_buf++;
-                *datap++ = *data_buf++;
-                *datap++ = *data_buf++;
-                data_buf++;
-            }
-        }
-        break;
-
-    case BUF_BGRA:
-        for (int i = 0; i < h; i++) {
-            unsigned char *datap = &data[start + i*bg_width*3];
-            for (int j = 0; j < w; j++) {
-                *datap++ = *(data_buf+2);
-                *datap++ = *(data_buf+1);
-                *datap++ = *data_buf;
-                data_buf += 4;
-            }
-        }
-        break;
+    blit_to_rgb(&data[start], bg_width*3, data_buf, stride, w, h, buf_type);
+}
 
-    default:
-        throw "Unexpected buf_type in DynamicJpegStack::Push";
-    }
+// Decodes a jpeg straight into the background rows at (x, y).
+void DynamicJpegStack::PushJpeg(const unsigned char *jpeg, size_t jpeg_len, int x, int y) {
+
+    JpegDecompressor decompressor(jpeg, jpeg_len, BUF_RGB);
+    decompressor.read_header();
+
+    int w = decompressor.get_output_width();
+    int h = decompressor.get_output_height();
+    if (x + w > bg_width)
+        throw "Pushed jpeg exceeds DynamicJpegStack's width.";
+    if (y + h > bg_height)
+        throw "Pushed jpeg exceeds DynamicJpegStack's height.";
+
+    // Stamped first, a corrupt jpeg can fail halfway with rows already written.
+    touch(x, y, w, h);
+
+    decompressor.decode_rows(&data[y*bg_width*3 + x*3], bg_width*3);
 }
 
-void DynamicJpegStack::SetBackground(unsigned char *data_buf, int w, int h) {
+void DynamicJpegStack::SetBackground(unsigned char *data_buf, int w, int h, int stride) {
+
+    // Async encodes and encodeRegions read the background on worker threads.
+    if (encodes_pending > 0)
+        throw "Can't set the background while an encode is pending.";
+
+    if (coef_canvas && (w != bg_width || h != bg_height)) {
+        delete coef_canvas;
+        coef_canvas = NULL;
+    }
 
     if (data) {
         free(data);
         data = NULL;
     }
 
-    switch (buf_type) {
-    case BUF_RGB:
-        data = (unsigned char *)malloc(sizeof(*data)*w*h*3);
-        if (!data) throw "malloc failed in DynamicJpegStack::SetBackground";
-        memcpy(data, data_buf, w*h*3);
-        break;
-
-    case BUF_BGR:
-        data = bgr_to_rgb(data_buf, w*h*3);
-        if (!data) throw "malloc failed in DynamicJpegStack::SetBackground";
-        break;
-
-    case BUF_RGBA:
-        data = rgba_to_rgb(data_buf, w*h*4);
-        if (!data) throw "malloc failed in DynamicJpegStack::SetBackground";
-        break;
-
-    case BUF_BGRA:
-        data = bgra_to_rgb(data_buf, w*h*4);
-        if (!data) throw "malloc failed in DynamicJpegStack::SetBackground";
-        break;
+    data = (unsigned char *)malloc(sizeof(*data)*w*h*3);
+    if (!data) throw "malloc failed in DynamicJpegStack::SetBackground";
 
-    default:
-        throw "Unexpected buf_type in DynamicJpegStack::SetBackground";
-    }
+    blit_to_rgb(data, w*3, data_buf, stride, w, h, buf_type);
     bg_width = w;
     bg_height = h;
+
+    if (coef_canvas)
+        coef_canvas->stamp(Rect(0, 0, w, h));
+    else if (use_coefficients)
+        coef_canvas = new JpegCoefCanvas(w, h, subsampling);
 }
 
 void DynamicJpegStack::SetQuality(int q) {
     quality = q;
 }
 
+// The coefficient cache is laid out for one MCU size, so it's started over.
+void DynamicJpegStack::SetSubsampling(chroma_subsampling s) {
+    if (s == subsampling)
+        return;
+    if (coef_canvas && encodes_pending > 0)
+        throw "Can't change subsampling while an encode uses the coefficient cache.";
+
+    subsampling = s;
+    if (coef_canvas) {
+        delete coef_canvas;
+        coef_canvas = new JpegCoefCanvas(bg_width, bg_height, subsampling);
+    }
+}
+
+void DynamicJpegStack::SetThreads(int t) {
+    threads = t;
+}
+
+void DynamicJpegStack::SetCoefficientCache(bool enabled) {
+    use_coefficients = enabled;
+    if (enabled && !coef_canvas && data)
+        coef_canvas = new JpegCoefCanvas(bg_width, bg_height, subsampling);
+    drop_coef_canvas();
+}
+
+void DynamicJpegStack::SetRegionOverhead(int pixels) {
+    dirty.set_overhead(pixels);
+}
+
 void DynamicJpegStack::Reset() {
     dyn_rect = Rect(-1, -1, 0, 0);
+    dirty.clear();
 }
 
-v8::Handle<v8::Value> DynamicJpegStack::Dimensions() {
+Local<Value> DynamicJpegStack::Dimensions( Isolate * isolate ) {
 
-    Local<Object> dim = Object::New();
-    dim->Set(String::NewSymbol("x"), Integer::New(dyn_rect.x));
-    dim->Set(String::NewSymbol("y"), Integer::New(dyn_rect.y));
-    dim->Set(String::NewSymbol("width"), Integer::New(dyn_rect.w));
-    dim->Set(String::NewSymbol("height"), Integer::New(dyn_rect.h));
+    Local<Object> dim = Object::New(isolate);
+    dim->Set(String::NewFromUtf8(isolate, "x"), Integer::New(isolate, dyn_rect.x));
+    dim->Set(String::NewFromUtf8(isolate, "y"), Integer::New(isolate, dyn_rect.y));
+    dim->Set(String::NewFromUtf8(isolate, "width"), Integer::New(isolate, dyn_rect.w));
+    dim->Set(String::NewFromUtf8(isolate, "height"), Integer::New(isolate, dyn_rect.h));
 
-    //return scope.Close(dim);
+    return dim;
 }
 
 void DynamicJpegStack::New(const FunctionCallbackInfo<Value>& args) {
@@ -209,32 +300,13 @@ void DynamicJpegStack::New(const FunctionCallbackInfo<Value>& args) {
     buffer_type buf_type = BUF_RGB;
     if (args.Length() == 1) {
         if (!args[0]->IsString()) {
-            VException(isolate, "First argument must be a string. Either 'rgb', 'bgr', 'rgba' or 'bgra'.");
+            VException(isolate, "First argument must be a string. Either 'rgb', 'bgr', 'rgba', 'bgra', 'i420', 'nv12' or 'yuyv'.");
             return;
         }
 
-        String::Utf8Value str(args[3]);
-        const char * bt = * str;
-
-        if (!(str_eq(bt, "rgb")
-            || str_eq(bt, "bgr")
-            || str_eq(bt, "rgba")
-            || str_eq(bt, "bgra"))
-        ) {
-            VException( isolate, "Buffer type must be 'rgb', 'bgr', 'rgba' or 'bgra'." );
-            return;
-        }
-
-        if (str_eq(bt, "rgb")) {
-            buf_type = BUF_RGB;
-        } else if (str_eq(bt, "bgr")) {
-            buf_type = BUF_BGR;
-        } else if (str_eq(bt, "rgba")) {
-            buf_type = BUF_RGBA;
-        } else if (str_eq(bt, "bgra")) {
-            buf_type = BUF_BGRA;
-        } else {
-            VException( isolate, "Buffer type wasn't 'rgb', 'bgr', 'rgba' or 'bgra'." );
+        String::Utf8Value str(args[0]);
+        if (!parse_buffer_type(*str, &buf_type)) {
+            VException( isolate, "Buffer type must be 'rgb', 'bgr', 'rgba', 'bgra', 'i420', 'nv12' or 'yuyv'." );
             return;
         }
 
@@ -250,15 +322,24 @@ void DynamicJpegStack::New(const FunctionCallbackInfo<Value>& args) {
 
 void DynamicJpegStack::JpegEncodeSync(const FunctionCallbackInfo<Value>& args) {
     DynamicJpegStack *jpeg = ObjectWrap::Unwrap<DynamicJpegStack>(args.This());
-    //return scope.Close(jpeg->JpegEncodeSync());
+    Local<Value> image = jpeg->JpegEncodeSync( args.GetIsolate() );
+    if (!image.IsEmpty())
+        args.GetReturnValue().Set(image);
+}
+
+void DynamicJpegStack::JpegEncodeRegionsSync(const FunctionCallbackInfo<Value>& args) {
+    DynamicJpegStack *jpeg = ObjectWrap::Unwrap<DynamicJpegStack>(args.This());
+    Local<Value> regions = jpeg->JpegEncodeRegionsSync( args.GetIsolate() );
+    if (!regions.IsEmpty())
+        args.GetReturnValue().Set(regions);
 }
 
 void DynamicJpegStack::Push(const FunctionCallbackInfo<Value>& args) {
 
     Isolate* isolate = args.GetIsolate();
 
-    if (args.Length() != 5) {
-        VException(isolate, "Five arguments required - buffer, x, y, width, height.");
+    if (args.Length() != 5 && args.Length() != 6) {
+        VException(isolate, "Five arguments required - buffer, x, y, width, height, [and stride].");
         return;
     }
 
@@ -342,17 +423,99 @@ void DynamicJpegStack::Push(const FunctionCallbackInfo<Value>& args) {
         return;
     }
 
-    jpeg->Push((unsigned char *)Buffer::Data(data_buf), x, y, w, h);
+    int stride = row_bytes(jpeg->buf_type, w);
+
+    if (args.Length() == 6) {
+        if (!args[5]->IsInt32()) {
+            VException(isolate, "Sixth argument must be integer stride.");
+            return;
+        }
+        if (args[5]->Int32Value() < stride) {
+            VException(isolate, "Stride is smaller than a row of pixels.");
+            return;
+        }
+        stride = args[5]->Int32Value();
+    }
+
+    if (Buffer::Length(data_buf) < image_bytes(jpeg->buf_type, w, h, stride)) {
+        VException(isolate, "Buffer is smaller than width*height pixels.");
+        return;
+    }
+
+    jpeg->Push((unsigned char *)Buffer::Data(data_buf), x, y, w, h, stride);
 
     Undefined( isolate );
 }
 
-void DynamicJpegStack::SetBackground(const FunctionCallbackInfo<Value>& args) {
+void DynamicJpegStack::PushJpeg(const FunctionCallbackInfo<Value>& args) {
 
     Isolate* isolate = args.GetIsolate();
 
     if (args.Length() != 3) {
-        VException(isolate, "Four arguments required - buffer, width, height");
+        VException(isolate, "Three arguments required - jpeg buffer, x, y.");
+        return;
+    }
+
+    if (!Buffer::HasInstance(args[0])) {
+        VException(isolate, "First argument must be Buffer.");
+        return;
+    }
+
+    if (!args[1]->IsInt32()) {
+        VException(isolate, "Second argument must be integer x.");
+        return;
+    }
+
+    if (!args[2]->IsInt32()) {
+        VException(isolate, "Third argument must be integer y.");
+        return;
+    }
+
+    DynamicJpegStack *jpeg = ObjectWrap::Unwrap<DynamicJpegStack>(args.This());
+
+    if (!jpeg->data) {
+        VException(
+            isolate,
+            "No background has been set, use setBackground or setSolidBackground to set."
+        );
+        return;
+    }
+
+    Local<Object> jpeg_buf = args[0]->ToObject();
+    int x = args[1]->Int32Value();
+    int y = args[2]->Int32Value();
+
+    if (x < 0) {
+        VException(isolate, "Coordinate x smaller than 0.");
+        return;
+    }
+
+    if (y < 0) {
+        VException(isolate, "Coordinate y smaller than 0.");
+        return;
+    }
+
+    try {
+        jpeg->PushJpeg(
+            (unsigned char *)Buffer::Data(jpeg_buf),
+            Buffer::Length(jpeg_buf),
+            x, y
+        );
+    }
+    catch (const char *err) {
+        VException(isolate, err);
+        return;
+    }
+
+    Undefined( isolate );
+}
+
+void DynamicJpegStack::SetBackground(const FunctionCallbackInfo<Value>& args) {
+
+    Isolate* isolate = args.GetIsolate();
+
+    if (args.Length() != 3 && args.Length() != 4) {
+        VException(isolate, "Three arguments required - buffer, width, height, [and stride]");
         return;
     }
 
@@ -385,8 +548,27 @@ void DynamicJpegStack::SetBackground(const FunctionCallbackInfo<Value>& args) {
         VException(isolate, "Coordinate y smaller than 0.");
     }
 
+    int stride = row_bytes(jpeg->buf_type, w);
+
+    if (args.Length() == 4) {
+        if (!args[3]->IsInt32()) {
+            VException(isolate, "Fourth argument must be integer stride.");
+            return;
+        }
+        if (args[3]->Int32Value() < stride) {
+            VException(isolate, "Stride is smaller than a row of pixels.");
+            return;
+        }
+        stride = args[3]->Int32Value();
+    }
+
+    if (Buffer::Length(data_buf) < image_bytes(jpeg->buf_type, w, h, stride)) {
+        VException(isolate, "Buffer is smaller than width*height pixels.");
+        return;
+    }
+
     try {
-        jpeg->SetBackground((unsigned char *)Buffer::Data(data_buf), w, h);
+        jpeg->SetBackground((unsigned char *)Buffer::Data(data_buf), w, h, stride);
     }
     catch (const char *err) {
         VException(isolate, err);
@@ -411,7 +593,7 @@ void DynamicJpegStack::Reset(const FunctionCallbackInfo<Value>& args) {
 void DynamicJpegStack::Dimensions(const FunctionCallbackInfo<Value>& args) {
 
     DynamicJpegStack *jpeg = ObjectWrap::Unwrap<DynamicJpegStack>(args.This());
-    //return scope.Close(jpeg->Dimensions());
+    args.GetReturnValue().Set(jpeg->Dimensions( args.GetIsolate() ));
 
 }
 
@@ -446,25 +628,149 @@ void DynamicJpegStack::SetQuality(const FunctionCallbackInfo<Value>& args) {
     Undefined( isolate );
 }
 
+void DynamicJpegStack::SetSubsampling(const FunctionCallbackInfo<Value>& args) {
+
+    Isolate* isolate = args.GetIsolate();
+
+    if (args.Length() != 1) {
+        VException(isolate, "One argument required - subsampling");
+        return;
+    }
+
+    chroma_subsampling s;
+    String::Utf8Value str(args[0]);
+    if (!args[0]->IsString() || !parse_subsampling(*str, &s)) {
+        VException(isolate, "Subsampling must be '4:4:4', '4:2:2', '4:2:0' or 'gray'.");
+        return;
+    }
+
+    DynamicJpegStack *jpeg = ObjectWrap::Unwrap<DynamicJpegStack>(args.This());
+
+    try {
+        jpeg->SetSubsampling(s);
+    }
+    catch (const char *err) {
+        VException(isolate, err);
+        return;
+    }
+
+    Undefined( isolate );
+}
+
+void DynamicJpegStack::SetThreads(const FunctionCallbackInfo<Value>& args) {
+
+    Isolate* isolate = args.GetIsolate();
+
+    if (args.Length() != 1) {
+        VException(isolate, "One argument required - threads");
+        return;
+    }
+
+    if (!args[0]->IsInt32()) {
+        VException(isolate, "First argument must be integer threads");
+        return;
+    }
+
+    int t = args[0]->Int32Value();
+
+    if (t < 1) {
+        VException(isolate, "Threads must be greater or equal to 1.");
+        return;
+    }
+    if (t > 64) {
+        VException(isolate, "Threads must be less than or equal to 64.");
+        return;
+    }
+
+    DynamicJpegStack *jpeg = ObjectWrap::Unwrap<DynamicJpegStack>(args.This());
+    jpeg->SetThreads(t);
+
+    Undefined(isolate);
+
+}
+
+void DynamicJpegStack::SetRegionOverhead(const FunctionCallbackInfo<Value>& args) {
+
+    Isolate* isolate = args.GetIsolate();
+
+    if (args.Length() != 1) {
+        VException(isolate, "One argument required - overhead in pixels");
+        return;
+    }
+
+    if (!args[0]->IsInt32()) {
+        VException(isolate, "First argument must be integer overhead");
+        return;
+    }
+
+    int o = args[0]->Int32Value();
+
+    if (o < 0) {
+        VException(isolate, "Overhead must be greater or equal to 0.");
+        return;
+    }
+
+    DynamicJpegStack *jpeg = ObjectWrap::Unwrap<DynamicJpegStack>(args.This());
+    jpeg->SetRegionOverhead(o);
+
+    Undefined(isolate);
+
+}
+
+void DynamicJpegStack::SetCoefficientCache(const FunctionCallbackInfo<Value>& args) {
+
+    Isolate* isolate = args.GetIsolate();
+
+    if (args.Length() != 1) {
+        VException(isolate, "One argument required - enabled");
+        return;
+    }
+
+    if (!args[0]->IsBoolean()) {
+        VException(isolate, "First argument must be boolean enabled");
+        return;
+    }
+
+    DynamicJpegStack *jpeg = ObjectWrap::Unwrap<DynamicJpegStack>(args.This());
+
+    try {
+        jpeg->SetCoefficientCache(args[0]->BooleanValue());
+    }
+    catch (const char *err) {
+        VException(isolate, err);
+        return;
+    }
+
+    Undefined(isolate);
+
+}
+
 void DynamicJpegStack::UV_JpegEncode(uv_work_t *req) {
 
-    encode_request *enc_req = (encode_request *)req->data;
+    stack_encode_request *enc_req = (stack_encode_request *)req->data;
     DynamicJpegStack *jpeg = (DynamicJpegStack *)enc_req->jpeg_obj;
 
     try {
         Rect &dyn_rect = jpeg->dyn_rect;
+        if (enc_req->coefficients) {
+            unsigned char *out;
+            unsigned long out_len;
+            jpeg->coef_canvas->encode(jpeg->data, enc_req->mcu_serials, jpeg->quality,
+                dyn_rect, &jpeg->size_hint, jpeg_margins(), &out, &out_len);
+            enc_req->jpeg_len = out_len;
+            enc_req->jpeg = (char *)out;
+            return;
+        }
+
         JpegEncoder encoder(jpeg->data, jpeg->bg_width, jpeg->bg_height, jpeg->quality, BUF_RGB);
+        encoder.set_subsampling(jpeg->subsampling);
+        encoder.set_threads(jpeg->threads);
+        encoder.set_size_hint(jpeg->size_hint);
         encoder.setRect(Rect(dyn_rect.x, dyn_rect.y, dyn_rect.w, dyn_rect.h));
         encoder.encode();
+        jpeg->size_hint = encoder.get_size_hint();
         enc_req->jpeg_len = encoder.get_jpeg_len();
-        enc_req->jpeg = (char *)malloc(sizeof(*enc_req->jpeg)*enc_req->jpeg_len);
-        if (!enc_req->jpeg) {
-            enc_req->error = strdup("malloc in DynamicJpegStack::UV_JpegEncode failed.");
-            return;
-        }
-        else {
-            memcpy(enc_req->jpeg, encoder.get_jpeg(), enc_req->jpeg_len);
-        }
+        enc_req->jpeg = (char *)encoder.release_jpeg();
     }
     catch (const char *err) {
         enc_req->error = strdup(err);
@@ -473,7 +779,8 @@ void DynamicJpegStack::UV_JpegEncode(uv_work_t *req) {
 
 void DynamicJpegStack::UV_JpegEncodeAfter(uv_work_t *req) {
 
-    encode_request *enc_req = (encode_request *)req->data;
+    stack_encode_request *enc_req = (stack_encode_request *)req->data;
+    HandleScope scope(enc_req->isolate);
     delete req;
     DynamicJpegStack *jpeg = (DynamicJpegStack *)enc_req->jpeg_obj;
 
@@ -485,27 +792,31 @@ void DynamicJpegStack::UV_JpegEncodeAfter(uv_work_t *req) {
         argv[2] = ErrorException(enc_req->isolate, enc_req->error);
     }
     else {
-        Buffer *buf = Buffer::New(enc_req->jpeg_len);
-        memcpy(Buffer::Data(buf), enc_req->jpeg, enc_req->jpeg_len);
-        argv[0] = buf->handle_;
-        argv[1] = jpeg->Dimensions();
+        // the Buffer takes ownership of the encoder's output
+        argv[0] = BufferFromMalloc(enc_req->isolate, enc_req->jpeg, enc_req->jpeg_len);
+        argv[1] = jpeg->Dimensions( enc_req->isolate );
         argv[2] = Undefined( enc_req->isolate );
+        enc_req->jpeg = NULL;
     }
 
+    // The worker is done with the background, the callback may replace it.
+    jpeg->encodes_pending--;
+    jpeg->drop_coef_canvas();
+
     TryCatch try_catch( enc_req->isolate ); // don't quite see the necessity of this
 
-    enc_req->callback->Call( Null( enc_req->isolate ), 2, argv );
+    Local<Function>::New(enc_req->isolate, enc_req->callback)->Call( Null( enc_req->isolate ), 3, argv );
 
     if (try_catch.HasCaught()) {
         FatalException( enc_req->isolate, try_catch );
     }
 
-    //enc_req->callback.Dispose();
+    enc_req->callback.Reset();
     free(enc_req->jpeg);
     free(enc_req->error);
 
     jpeg->Unref();
-    free(enc_req);
+    delete enc_req;
 }
 
 void DynamicJpegStack::JpegEncodeAsync(const FunctionCallbackInfo<Value>& args) {
@@ -525,23 +836,129 @@ void DynamicJpegStack::JpegEncodeAsync(const FunctionCallbackInfo<Value>& args)
     Local<Function> callback = Local<Function>::Cast(args[0]);
     DynamicJpegStack *jpeg = ObjectWrap::Unwrap<DynamicJpegStack>(args.This());
 
-    encode_request *enc_req = (encode_request *)malloc(sizeof(*enc_req));
-
-    if (!enc_req) {
-        VException(isolate, "malloc in DynamicJpegStack::JpegEncodeAsync failed.");
-        return;
-    }
+    stack_encode_request *enc_req = new stack_encode_request;
 
-    enc_req->callback = Persistent<Function>::New(callback);
+    enc_req->callback.Reset(isolate, callback);
+    enc_req->isolate = isolate;
     enc_req->jpeg_obj = jpeg;
     enc_req->jpeg = NULL;
     enc_req->jpeg_len = 0;
     enc_req->error = NULL;
+    enc_req->coefficients = jpeg->use_coefficients && jpeg->coef_canvas;
+    if (enc_req->coefficients) {
+        jpeg->dyn_rect = jpeg->coef_canvas->align(jpeg->dyn_rect);
+        enc_req->mcu_serials = jpeg->coef_canvas->get_serials();
+    }
 
     uv_work_t* req = new uv_work_t;
     req->data = enc_req;
     uv_queue_work(uv_default_loop(), req, UV_JpegEncode, (uv_after_work_cb)UV_JpegEncodeAfter);
 
+    jpeg->encodes_pending++;
+    jpeg->Ref();
+
+    Undefined( isolate );
+
+}
+
+void DynamicJpegStack::encode_region_job(void *arg, int index) {
+    region_request *reg_req = (region_request *)arg;
+    reg_req->stack->encode_region(reg_req->regions[index]);
+}
+
+void DynamicJpegStack::UV_JpegEncodeRegions(uv_work_t *req) {
+    region_request *reg_req = (region_request *)req->data;
+    parallel_for(reg_req->regions.size(), reg_req->stack->threads, encode_region_job, reg_req);
+}
+
+void DynamicJpegStack::UV_JpegEncodeRegionsAfter(uv_work_t *req) {
+
+    region_request *reg_req = (region_request *)req->data;
+    HandleScope scope(reg_req->isolate);
+    delete req;
+
+    Handle<Value> argv[2];
+
+    const char *error = NULL;
+    for (size_t i = 0; i < reg_req->regions.size(); i++) {
+        if (reg_req->regions[i].error[0]) {
+            error = reg_req->regions[i].error;
+            break;
+        }
+    }
+
+    if (error) {
+        argv[0] = Undefined( reg_req->isolate );
+        argv[1] = ErrorException( reg_req->isolate, error );
+    } else {
+        Local<Array> regions = Array::New(reg_req->isolate, reg_req->regions.size());
+        for (size_t i = 0; i < reg_req->regions.size(); i++) {
+            region_frame &region = reg_req->regions[i];
+            regions->Set(i, RegionObject(
+                reg_req->isolate,
+                region.rect,
+                BufferFromMalloc(reg_req->isolate, region.jpeg, region.jpeg_len)
+            ));
+            region.jpeg = NULL;
+        }
+        argv[0] = regions;
+        argv[1] = Undefined( reg_req->isolate );
+    }
+
+    reg_req->stack->encodes_pending--;
+    reg_req->stack->drop_coef_canvas();
+
+    TryCatch try_catch( reg_req->isolate );
+
+    Local<Function>::New(reg_req->isolate, reg_req->callback)->Call( Null( reg_req->isolate ), 2, argv );
+
+    if (try_catch.HasCaught()) {
+        FatalException( reg_req->isolate, try_catch );
+    }
+
+    for (size_t i = 0; i < reg_req->regions.size(); i++)
+        free(reg_req->regions[i].jpeg);
+
+    reg_req->callback.Reset();
+    reg_req->stack->Unref();
+    delete reg_req;
+}
+
+void DynamicJpegStack::JpegEncodeRegionsAsync(const FunctionCallbackInfo<Value>& args) {
+
+    Isolate* isolate = args.GetIsolate();
+
+    if (args.Length() != 1) {
+        VException(isolate, "One argument required - callback function.");
+        return;
+    }
+
+    if (!args[0]->IsFunction()) {
+        VException(isolate, "First argument must be a function.");
+        return;
+    }
+
+    Local<Function> callback = Local<Function>::Cast(args[0]);
+    DynamicJpegStack *jpeg = ObjectWrap::Unwrap<DynamicJpegStack>(args.This());
+
+    region_request *reg_req = new region_request;
+
+    reg_req->callback.Reset(isolate, callback);
+    reg_req->isolate = isolate;
+    reg_req->stack = jpeg;
+
+    // the rects are taken now, later pushes go to the next encodeRegions
+    const std::vector<Rect> &rects = jpeg->dirty.get();
+    for (size_t i = 0; i < rects.size(); i++) {
+        region_frame region = { rects[i], NULL, 0, "" };
+        reg_req->regions.push_back(region);
+    }
+
+    uv_work_t* req = new uv_work_t;
+    req->data = reg_req;
+    uv_queue_work(uv_default_loop(), req, UV_JpegEncodeRegions, (uv_after_work_cb)UV_JpegEncodeRegionsAfter);
+
+    jpeg->encodes_pending++;
     jpeg->Ref();
 
     Undefined( isolate );
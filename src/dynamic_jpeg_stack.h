@@ -12,6 +12,8 @@
 
 #include "common.h"
 #include "jpeg_encoder.h"
+#include "dirty_region.h"
+#include "jpeg_coef_canvas.h"
 
 using v8::Function;
 using v8::FunctionCallbackInfo;
@@ -19,30 +21,70 @@ using v8::FunctionTemplate;
 using v8::Isolate;
 using v8::Value;
 
+class DynamicJpegStack;
+
+struct region_frame {
+    Rect rect;
+    char *jpeg;
+    unsigned long jpeg_len;
+    char error[JMSG_LENGTH_MAX]; // empty unless the region failed
+};
+
+struct region_request {
+    v8::Persistent<v8::Function> callback;
+    v8::Isolate * isolate;
+    DynamicJpegStack *stack;
+    std::vector<region_frame> regions;
+};
+
 class DynamicJpegStack : public node::ObjectWrap {
-    int quality;
+    int quality, threads;
+    chroma_subsampling subsampling;
     buffer_type buf_type;
+    double size_hint; // bytes per pixel of the last encode
 
     unsigned char *data;
 
     int bg_width, bg_height; // background width and height after setBackground
     Rect dyn_rect; // rect of dynamic push area (updated after each push)
+    DirtyRegion dirty; // the same pushes as disjoint rects, for encodeRegions
+
+    // Set by setCoefficientCache(true) once there is a background. Kept
+    // until disabled and no async encode uses it any more.
+    JpegCoefCanvas *coef_canvas;
+    bool use_coefficients;
+    int encodes_pending; // async encodes and encodeRegions in flight
+
+    void drop_coef_canvas();
 
     void update_optimal_dimension(int x, int y, int w, int h);
+    void touch(int x, int y, int w, int h);
+    void encode_region(region_frame &region);
 
     static void UV_JpegEncode(uv_work_t *req);
     static void UV_JpegEncodeAfter(uv_work_t *req);
+    static void UV_JpegEncodeRegions(uv_work_t *req);
+    static void UV_JpegEncodeRegionsAfter(uv_work_t *req);
+    static void encode_region_job(void *arg, int index);
+    static v8::Local<v8::Object> RegionObject(Isolate *isolate, const Rect &rect,
+        v8::Local<v8::Value> image);
 
 public:
 
     DynamicJpegStack(buffer_type bbuf_type);
     ~DynamicJpegStack();
 
-    void JpegEncodeSync();
-    void Push(unsigned char *data_buf, int x, int y, int w, int h);
-    void SetBackground(unsigned char *data_buf, int w, int h);
+    v8::Local<v8::Value> JpegEncodeSync( Isolate * isolate );
+    v8::Local<v8::Value> JpegEncodeRegionsSync( Isolate * isolate );
+    void Push(unsigned char *data_buf, int x, int y, int w, int h, int stride);
+    void PushJpeg(const unsigned char *jpeg, size_t jpeg_len, int x, int y);
+    void SetBackground(unsigned char *data_buf, int w, int h, int stride);
     void SetQuality(int q);
-    v8::Handle<v8::Value> Dimensions();
+    void SetSubsampling(chroma_subsampling s);
+    void SetThreads(int t);
+    void SetCoefficientCache(bool enabled);
+    void SetRegionOverhead(int pixels);
+    v8::Local<v8::Value> Dimensions( Isolate * isolate );
     void Reset();
 
     static void Initialize(v8::Handle<v8::Object> target);
@@ -50,9 +92,16 @@ public:
     static void New(const FunctionCallbackInfo<Value>& args);
     static void JpegEncodeSync(const FunctionCallbackInfo<Value>& args);
     static void JpegEncodeAsync(const FunctionCallbackInfo<Value>& args);
+    static void JpegEncodeRegionsSync(const FunctionCallbackInfo<Value>& args);
+    static void JpegEncodeRegionsAsync(const FunctionCallbackInfo<Value>& args);
+    static void SetRegionOverhead(const FunctionCallbackInfo<Value>& args);
     static void Push(const FunctionCallbackInfo<Value>& args);
+    static void PushJpeg(const FunctionCallbackInfo<Value>& args);
     static void SetBackground(const FunctionCallbackInfo<Value>& args);
     static void SetQuality(const FunctionCallbackInfo<Value>& args);
+    static void SetSubsampling(const FunctionCallbackInfo<Value>& args);
+    static void SetThreads(const FunctionCallbackInfo<Value>& args);
+    static void SetCoefficientCache(const FunctionCallbackInfo<Value>& args);
     static void Dimensions(const FunctionCallbackInfo<Value>& args);
     static void Reset(const FunctionCallbackInfo<Value>& args);
 };
@@ -8,10 +8,14 @@
 #include "fixed_jpeg_stack.h"
 #include "jpeg_encoder.h"
 #include "buffer_compat.h"
+#include "blit.h"
+#include "jpeg_decompressor.h"
 
 using namespace v8;
 using namespace node;
 
+Persistent<FunctionTemplate> FixedJpegStack::constructor_template;
+
 void FixedJpegStack::Initialize(v8::Handle<v8::Object> target) {
 
     Isolate* isolate = target->GetIsolate();
@@ -19,18 +23,31 @@ void FixedJpegStack::Initialize(v8::Handle<v8::Object> target) {
     Local<FunctionTemplate> tpl = FunctionTemplate::New(isolate, New);
     tpl->SetClassName(String::NewFromUtf8(isolate, "FixedJpegStack"));
     tpl->InstanceTemplate()->SetInternalFieldCount(1);
+    constructor_template.Reset(isolate, tpl);
 
     NODE_SET_PROTOTYPE_METHOD(tpl, "encode", JpegEncodeAsync);
     NODE_SET_PROTOTYPE_METHOD(tpl, "encodeSync", JpegEncodeSync);
     NODE_SET_PROTOTYPE_METHOD(tpl, "setQuality", SetQuality);
+    NODE_SET_PROTOTYPE_METHOD(tpl, "setSubsampling", SetSubsampling);
+    NODE_SET_PROTOTYPE_METHOD(tpl, "setThreads", SetThreads);
+    NODE_SET_PROTOTYPE_METHOD(tpl, "setCoefficientCache", SetCoefficientCache);
     NODE_SET_PROTOTYPE_METHOD(tpl, "push", Push);
+    NODE_SET_PROTOTYPE_METHOD(tpl, "pushJpeg", PushJpeg);
 
     target->Set(String::NewFromUtf8(isolate, "FixedJpegStack"), tpl->GetFunction());
 
 }
 
+bool FixedJpegStack::HasInstance(Isolate *isolate, Local<Value> value) {
+    return Local<FunctionTemplate>::New(isolate, constructor_template)->HasInstance(value);
+}
+
 FixedJpegStack::FixedJpegStack(int wwidth, int hheight, buffer_type bbuf_type) :
-    width(wwidth), height(hheight), quality(60), buf_type(bbuf_type)
+    width(wwidth), height(hheight), quality(60), threads(1), subsampling(SUBSAMPLE_420),
+    buf_type(bbuf_type), size_hint(0),
+    data_readers(0), spare(NULL),
+    row_cache(wwidth, hheight), row_serials(hheight, 0), push_serial(0),
+    coef_canvas(NULL), use_coefficients(false), encodes_pending(0)
 {
 
     data = (unsigned char *)calloc(width*height*3, sizeof(*data));
@@ -38,97 +55,346 @@ FixedJpegStack::FixedJpegStack(int wwidth, int hheight, buffer_type bbuf_type) :
 
 }
 
-void FixedJpegStack::JpegEncodeSync( Isolate * isolate ) {
+FixedJpegStack::~FixedJpegStack() {
+    // Every async encode holds a reference, so nothing is detached by now.
+    free(data);
+    free(spare);
+    delete coef_canvas;
+    for (size_t i = 0; i < pending_tiles.size(); i++)
+        free(pending_tiles[i].jpeg);
+}
+
+stack_encode_settings FixedJpegStack::encode_settings() const {
+    stack_encode_settings settings;
+    settings.quality = quality;
+    settings.threads = threads;
+    settings.subsampling = subsampling;
+    settings.size_hint = size_hint;
+    return settings;
+}
+
+// Encodes a canvas snapshot, only recompressing what changed since an
+// earlier encode: whole MCU rows from the row cache, or single MCUs from the
+// coefficient cache. Uses only 'settings', not the stack's own, and updates
+// its size_hint. May run on a worker thread.
+void FixedJpegStack::encode_canvas(unsigned char *canvas,
+    const std::vector<unsigned long> &rows, const std::vector<unsigned long> &mcus,
+    bool coefficients, stack_encode_settings *settings, const jpeg_margins &margins,
+    unsigned char **jpeg, unsigned long *jpeg_len)
+{
+    if (coefficients) {
+        coef_canvas->encode(canvas, mcus, settings->quality, Rect(0, 0, width, height),
+            &settings->size_hint, margins, jpeg, jpeg_len);
+    }
+    else {
+        row_cache.encode(canvas, rows, settings->quality, settings->subsampling,
+            settings->threads, &settings->size_hint, margins, jpeg, jpeg_len);
+    }
+}
+
+void FixedJpegStack::snapshot(stack_encode_request *req) {
+
+    if (!use_coefficients)
+        flush_tiles();
+
+    req->jpeg_obj = this;
+    req->canvas = acquire_canvas();
+    req->row_serials = row_serials;
+    req->coefficients = use_coefficients;
+    req->settings = encode_settings();
+    if (use_coefficients)
+        req->mcu_serials = coef_canvas->get_serials();
+
+    encodes_pending++;
+    Ref();
+
+}
+
+void FixedJpegStack::encode_snapshot(stack_encode_request *req, const jpeg_margins &margins,
+    unsigned char **jpeg, unsigned long *jpeg_len)
+{
+    encode_canvas(req->canvas, req->row_serials, req->mcu_serials, req->coefficients,
+        &req->settings, margins, jpeg, jpeg_len);
+}
+
+void FixedJpegStack::release_snapshot(stack_encode_request *req) {
+
+    // A failed encode may have dropped the tiles' coefficients. The
+    // encode's error is the one to report.
+    if (req->error) {
+        try {
+            flush_tiles();
+        }
+        catch (const char *err) {}
+    }
+    else {
+        size_hint = req->settings.size_hint;
+    }
+
+    release_canvas(req->canvas);
+    encodes_pending--;
+    drop_coef_canvas();
+    Unref();
+
+}
+
+// Decodes the pixels of tiles placed in the coefficient cache into the
+// canvas, in push order.
+void FixedJpegStack::flush_tiles() {
+
+    if (pending_tiles.empty())
+        return;
+
+    std::vector<pending_tile> tiles;
+    tiles.swap(pending_tiles);
 
     try {
+        unsigned char *canvas = writable_canvas();
+        for (size_t i = 0; i < tiles.size(); i++) {
+            JpegDecompressor decompressor(tiles[i].jpeg, tiles[i].jpeg_len, BUF_RGB);
+            decompressor.read_header();
+            decompressor.decode_rows(&canvas[tiles[i].y*width*3 + tiles[i].x*3], width*3);
+        }
+    }
+    catch (const char *err) {
+        for (size_t i = 0; i < tiles.size(); i++)
+            free(tiles[i].jpeg);
+        throw;
+    }
 
-        JpegEncoder jpeg_encoder(data, width, height, quality, BUF_RGB);
-        jpeg_encoder.encode();
-
-        //Buffer send
-        int jpeg_len = jpeg_encoder.get_jpeg_len();
-        v8::MaybeLocal<v8::Object> retbuf = Buffer::New(isolate, jpeg_len);
-        v8::Local<v8::Object> local;
-        retbuf.ToLocal( &local );
-        memcpy(
-            Buffer::Data(local),
-            jpeg_encoder.get_jpeg(),
-            jpeg_len
-        );
+    for (size_t i = 0; i < tiles.size(); i++)
+        free(tiles[i].jpeg);
+
+}
+
+void FixedJpegStack::drop_coef_canvas() {
+    if (!use_coefficients && encodes_pending == 0) {
+        delete coef_canvas;
+        coef_canvas = NULL;
+    }
+}
 
-        //return scope.Close(retbuf->handle_);
+// Hands the current canvas to an async encode. It stays untouched until
+// the encode calls release_canvas().
+unsigned char *FixedJpegStack::acquire_canvas() {
+    data_readers++;
+    return data;
+}
+
+void FixedJpegStack::release_canvas(unsigned char *canvas) {
+    if (canvas == data) {
+        data_readers--;
+        return;
+    }
+
+    std::map<unsigned char *, int>::iterator it = detached.find(canvas);
+    if (--it->second > 0)
+        return;
+    detached.erase(it);
+
+    if (!spare)
+        spare = canvas;
+    else
+        free(canvas);
+}
+
+// Returns the canvas pushes may write to. If async encodes are still reading
+// the current one, the pushes move to a copy and the encodes keep the old
+// pixels, so pushing and compressing can overlap.
+unsigned char *FixedJpegStack::writable_canvas() {
+    if (data_readers == 0)
+        return data;
+
+    unsigned char *copy = spare;
+    if (!copy) {
+        copy = (unsigned char *)malloc(sizeof(*copy)*width*height*3);
+        if (!copy) throw "malloc in FixedJpegStack::writable_canvas failed!";
+    }
+    spare = NULL;
+    memcpy(copy, data, width*height*3);
+
+    detached[data] = data_readers;
+    data = copy;
+    data_readers = 0;
+    return data;
+}
+
+Local<Value> FixedJpegStack::JpegEncodeSync( Isolate * isolate ) {
+
+    try {
+
+        unsigned char *jpeg;
+        unsigned long jpeg_len;
+        std::vector<unsigned long> none;
+        stack_encode_settings settings = encode_settings();
+        if (!use_coefficients)
+            flush_tiles();
+        try {
+            encode_canvas(data, row_serials, coef_canvas ? coef_canvas->get_serials() : none,
+                use_coefficients, &settings, jpeg_margins(), &jpeg, &jpeg_len);
+            size_hint = settings.size_hint;
+        }
+        catch (const char *err) {
+            // A failed encode may have dropped the tiles' coefficients.
+            flush_tiles();
+            throw;
+        }
+
+        //Buffer send, handing the spliced jpeg over without a copy
+        return BufferFromMalloc(isolate, (char *)jpeg, jpeg_len);
 
     } catch (const char *err) {
         VException( isolate, err );
     }
 
+    return Local<Value>();
+
 }
 
-void FixedJpegStack::Push(unsigned char *data_buf, int x, int y, int w, int h) {
+// Marks a rect of the canvas as changed for the encode caches.
+void FixedJpegStack::touch(int x, int y, int w, int h) {
+
+    touch_rows(y, h);
+    if (coef_canvas)
+        coef_canvas->stamp(Rect(x, y, w, h));
 
+}
+
+void FixedJpegStack::touch_rows(int y, int h) {
+
+    push_serial++;
+    for (int i = y; i < y + h; i++)
+        row_serials[i] = push_serial;
+
+}
+
+// Copies a w x h fragment whose rows are 'stride' bytes apart to (x, y).
+void FixedJpegStack::Push(unsigned char *data_buf, int x, int y, int w, int h, int stride) {
+
+    flush_tiles();
+
+    unsigned char *canvas = writable_canvas();
     int start = y*width*3 + x*3;
 
-    switch (buf_type) {
-    case BUF_RGB:
-        for (int i = 0; i < h; i++) {
-            unsigned char *datap = &data[start + i*width*3];
-            for (int j = 0; j < w; j++) {
-                *datap++ = *data_buf++;
-                *datap++ = *data_buf++;
-                *datap++ = *data_buf++;
-            }
-        }
-        break;
-
-    case BUF_BGR:
-        for (int i = 0; i < h; i++) {
-            unsigned char *datap = &data[start + i*width*3];
-            for (int j = 0; j < w; j++) {
-                *datap++ = *(data_buf+2);
-                *datap++ = *(data_buf+1);
-                *datap++ = *data_buf;
-                data_buf+=3;
-            }
+    touch(x, y, w, h);
+
+    blit_to_rgb(&canvas[start], width*3, data_buf, stride, w, h, buf_type);
+
+}
+
+// Decodes a jpeg straight into the canvas rows at (x, y). With the
+// coefficient cache on, a tile compressed like the canvas (same quality and
+// sampling, on the MCU grid) isn't decoded at all: its blocks are copied
+// into the cache and its pixels wait in pending_tiles.
+void FixedJpegStack::PushJpeg(const unsigned char *jpeg, size_t jpeg_len, int x, int y) {
+
+    JpegDecompressor decompressor(jpeg, jpeg_len, BUF_RGB);
+    decompressor.read_header();
+
+    int w = decompressor.get_output_width();
+    int h = decompressor.get_output_height();
+    if (x + w > width)
+        throw "Pushed jpeg exceeds FixedJpegStack's width.";
+    if (y + h > height)
+        throw "Pushed jpeg exceeds FixedJpegStack's height.";
+
+    // An async encode of an older snapshot could recompute the tile's MCUs
+    // from pixels that aren't there yet, so only place tiles when idle.
+    if (use_coefficients && encodes_pending == 0) {
+        pending_tile tile;
+        tile.jpeg = (unsigned char *)malloc(jpeg_len);
+        if (!tile.jpeg) throw "malloc in FixedJpegStack::PushJpeg failed!";
+        memcpy(tile.jpeg, jpeg, jpeg_len);
+        tile.jpeg_len = jpeg_len;
+        tile.x = x;
+        tile.y = y;
+        tile.w = w;
+        tile.h = h;
+
+        bool placed;
+        try {
+            placed = coef_canvas->place(jpeg, jpeg_len, x, y, quality);
         }
-        break;
-
-    case BUF_RGBA:
-        for (int i = 0; i < h; i++) {
-            unsigned char *datap = &data[start + i*width*3];
-            for (int j = 0; j < w; j++) {
-                *datap++ = *data_buf++;
-                *datap++ = *data_buf++;
-                *datap++ = *data_buf++;
-                data_buf++;
-            }
+        catch (const char *err) {
+            free(tile.jpeg);
+            throw;
         }
-        break;
-
-    case BUF_BGRA:
-        for (int i = 0; i < h; i++) {
-            unsigned char *datap = &data[start + i*width*3];
-            for (int j = 0; j < w; j++) {
-                *datap++ = *(data_buf+2);
-                *datap++ = *(data_buf+1);
-                *datap++ = *data_buf;
-                data_buf += 4;
+
+        if (placed) {
+            touch_rows(y, h);
+
+            // Tiles it covers completely will never show.
+            size_t kept = 0;
+            for (size_t i = 0; i < pending_tiles.size(); i++) {
+                pending_tile &old = pending_tiles[i];
+                if (old.x >= x && old.y >= y && old.x + old.w <= x + w && old.y + old.h <= y + h)
+                    free(old.jpeg);
+                else
+                    pending_tiles[kept++] = old;
             }
-        }
-        break;
+            pending_tiles.resize(kept);
 
-    default:
-        throw "Unexpected buf_type in FixedJpegStack::Push";
+            pending_tiles.push_back(tile);
+            return;
+        }
+        free(tile.jpeg);
     }
 
+    flush_tiles();
+
+    unsigned char *canvas = writable_canvas();
+
+    // Stamped first, a corrupt jpeg can fail halfway with rows already written.
+    touch(x, y, w, h);
+
+    decompressor.decode_rows(&canvas[y*width*3 + x*3], width*3);
+
 }
 
 
 void FixedJpegStack::SetQuality(int q) {
 
+    // Placed tiles' coefficients are only good for the quality they match.
+    if (q != quality)
+        flush_tiles();
     quality = q;
 
 }
 
+// The coefficient cache is laid out for one MCU size, so it's started over.
+void FixedJpegStack::SetSubsampling(chroma_subsampling s) {
+
+    if (s == subsampling)
+        return;
+    if (coef_canvas && encodes_pending)
+        throw "Can't change subsampling while encodes with the coefficient cache are pending.";
+
+    flush_tiles();
+    subsampling = s;
+    if (coef_canvas) {
+        delete coef_canvas;
+        coef_canvas = new JpegCoefCanvas(width, height, subsampling);
+    }
+
+}
+
+void FixedJpegStack::SetThreads(int t) {
+
+    threads = t;
+
+}
+
+void FixedJpegStack::SetCoefficientCache(bool enabled) {
+
+    if (!enabled)
+        flush_tiles();
+    use_coefficients = enabled;
+    if (enabled && !coef_canvas)
+        coef_canvas = new JpegCoefCanvas(width, height, subsampling);
+    drop_coef_canvas();
+
+}
+
 void FixedJpegStack::New(const FunctionCallbackInfo<Value>& args) {
 
     Isolate* isolate = args.GetIsolate();
@@ -164,32 +430,13 @@ void FixedJpegStack::New(const FunctionCallbackInfo<Value>& args) {
     buffer_type buf_type = BUF_RGB;
     if (args.Length() == 3) {
         if (!args[2]->IsString()) {
-            VException( isolate, "Third argument must be a string. Either 'rgb', 'bgr', 'rgba' or 'bgra'." );
+            VException( isolate, "Third argument must be a string. Either 'rgb', 'bgr', 'rgba', 'bgra', 'i420', 'nv12' or 'yuyv'." );
             return;
         }
 
-        String::Utf8Value str(args[3]);
-        const char * bt = * str;
-
-        if (!(str_eq(bt, "rgb")
-            || str_eq(bt, "bgr")
-            || str_eq(bt, "rgba")
-            || str_eq(bt, "bgra"))
-        ) {
-            VException( isolate, "Buffer type must be 'rgb', 'bgr', 'rgba' or 'bgra'." );
-            return;
-        }
-
-        if (str_eq(bt, "rgb")) {
-            buf_type = BUF_RGB;
-        } else if (str_eq(bt, "bgr")) {
-            buf_type = BUF_BGR;
-        } else if (str_eq(bt, "rgba")) {
-            buf_type = BUF_RGBA;
-        } else if (str_eq(bt, "bgra")) {
-            buf_type = BUF_BGRA;
-        } else {
-            VException( isolate, "Buffer type wasn't 'rgb', 'bgr', 'rgba' or 'bgra'." );
+        String::Utf8Value str(args[2]);
+        if (!parse_buffer_type(*str, &buf_type)) {
+            VException( isolate, "Buffer type must be 'rgb', 'bgr', 'rgba', 'bgra', 'i420', 'nv12' or 'yuyv'." );
             return;
         }
 
@@ -210,7 +457,9 @@ void FixedJpegStack::New(const FunctionCallbackInfo<Value>& args) {
 void FixedJpegStack::JpegEncodeSync(const FunctionCallbackInfo<Value>& args) {
 
     FixedJpegStack *jpeg = ObjectWrap::Unwrap<FixedJpegStack>(args.This());
-    jpeg->JpegEncodeSync( args.GetIsolate() );
+    Local<Value> image = jpeg->JpegEncodeSync( args.GetIsolate() );
+    if (!image.IsEmpty())
+        args.GetReturnValue().Set(image);
 
 }
 
@@ -289,7 +538,88 @@ void FixedJpegStack::Push(const FunctionCallbackInfo<Value>& args) {
         return;
     }
 
-    jpeg->Push((unsigned char *)Buffer::Data(data_buf), x, y, w, h);
+    int stride = row_bytes(jpeg->buf_type, w);
+
+    if (args.Length() > 5) {
+        if (!args[5]->IsInt32()) {
+            VException(isolate, "Sixth argument must be integer stride.");
+            return;
+        }
+        if (args[5]->Int32Value() < stride) {
+            VException(isolate, "Stride is smaller than a row of pixels.");
+            return;
+        }
+        stride = args[5]->Int32Value();
+    }
+
+    if (Buffer::Length(data_buf) < image_bytes(jpeg->buf_type, w, h, stride)) {
+        VException(isolate, "Buffer is smaller than width*height pixels.");
+        return;
+    }
+
+    try {
+        jpeg->Push((unsigned char *)Buffer::Data(data_buf), x, y, w, h, stride);
+    }
+    catch (const char *err) {
+        VException(isolate, err);
+        return;
+    }
+
+    Undefined( isolate );
+
+}
+
+void FixedJpegStack::PushJpeg(const FunctionCallbackInfo<Value>& args) {
+
+    Isolate* isolate = args.GetIsolate();
+
+    if (args.Length() != 3) {
+        VException(isolate, "Three arguments required - jpeg buffer, x, y.");
+        return;
+    }
+
+    if (!Buffer::HasInstance(args[0])) {
+        VException(isolate, "First argument must be Buffer.");
+        return;
+    }
+
+    if (!args[1]->IsInt32()) {
+        VException(isolate, "Second argument must be integer x.");
+        return;
+    }
+
+    if (!args[2]->IsInt32()) {
+        VException(isolate, "Third argument must be integer y.");
+        return;
+    }
+
+    FixedJpegStack *jpeg = ObjectWrap::Unwrap<FixedJpegStack>(args.This());
+
+    Local<Object> jpeg_buf = args[0]->ToObject();
+    int x = args[1]->Int32Value();
+    int y = args[2]->Int32Value();
+
+    if (x < 0) {
+        VException(isolate, "Coordinate x smaller than 0.");
+        return;
+    }
+
+    if (y < 0) {
+        VException(isolate, "Coordinate y smaller than 0.");
+        return;
+    }
+
+    try {
+        jpeg->PushJpeg(
+            (unsigned char *)Buffer::Data(jpeg_buf),
+            Buffer::Length(jpeg_buf),
+            x, y
+        );
+    }
+    catch (const char *err) {
+        VException(isolate, err);
+        return;
+    }
 
     Undefined( isolate );
 
@@ -321,7 +651,104 @@ void FixedJpegStack::SetQuality(const FunctionCallbackInfo<Value>& args) {
     }
 
     FixedJpegStack *jpeg = ObjectWrap::Unwrap<FixedJpegStack>(args.This());
-    jpeg->SetQuality(q);
+
+    try {
+        jpeg->SetQuality(q);
+    }
+    catch (const char *err) {
+        VException(isolate, err);
+        return;
+    }
+
+    Undefined(isolate);
+
+}
+
+void FixedJpegStack::SetSubsampling(const FunctionCallbackInfo<Value>& args) {
+
+    Isolate* isolate = args.GetIsolate();
+
+    if (args.Length() != 1) {
+        VException(isolate, "One argument required - subsampling");
+        return;
+    }
+
+    chroma_subsampling s;
+    String::Utf8Value str(args[0]);
+    if (!args[0]->IsString() || !parse_subsampling(*str, &s)) {
+        VException(isolate, "Subsampling must be '4:4:4', '4:2:2', '4:2:0' or 'gray'.");
+        return;
+    }
+
+    FixedJpegStack *jpeg = ObjectWrap::Unwrap<FixedJpegStack>(args.This());
+
+    try {
+        jpeg->SetSubsampling(s);
+    }
+    catch (const char *err) {
+        VException(isolate, err);
+        return;
+    }
+
+    Undefined(isolate);
+
+}
+
+void FixedJpegStack::SetThreads(const FunctionCallbackInfo<Value>& args) {
+
+    Isolate* isolate = args.GetIsolate();
+
+    if (args.Length() != 1) {
+        VException(isolate, "One argument required - threads");
+        return;
+    }
+
+    if (!args[0]->IsInt32()) {
+        VException(isolate, "First argument must be integer threads");
+        return;
+    }
+
+    int t = args[0]->Int32Value();
+
+    if (t < 1) {
+        VException(isolate, "Threads must be greater or equal to 1.");
+        return;
+    }
+    if (t > 64) {
+        VException(isolate, "Threads must be less than or equal to 64.");
+        return;
+    }
+
+    FixedJpegStack *jpeg = ObjectWrap::Unwrap<FixedJpegStack>(args.This());
+    jpeg->SetThreads(t);
+
+    Undefined(isolate);
+
+}
+
+void FixedJpegStack::SetCoefficientCache(const FunctionCallbackInfo<Value>& args) {
+
+    Isolate* isolate = args.GetIsolate();
+
+    if (args.Length() != 1) {
+        VException(isolate, "One argument required - enabled");
+        return;
+    }
+
+    if (!args[0]->IsBoolean()) {
+        VException(isolate, "First argument must be boolean enabled");
+        return;
+    }
+
+    FixedJpegStack *jpeg = ObjectWrap::Unwrap<FixedJpegStack>(args.This());
+
+    try {
+        jpeg->SetCoefficientCache(args[0]->BooleanValue());
+    }
+    catch (const char *err) {
+        VException(isolate, err);
+        return;
+    }
 
     Undefined(isolate);
 
@@ -329,21 +756,15 @@ void FixedJpegStack::SetQuality(const FunctionCallbackInfo<Value>& args) {
 
 void FixedJpegStack::UV_JpegEncode(uv_work_t *req) {
 
-    encode_request *enc_req = (encode_request *)req->data;
+    stack_encode_request *enc_req = (stack_encode_request *)req->data;
     FixedJpegStack *jpeg = (FixedJpegStack *)enc_req->jpeg_obj;
 
     try {
-        JpegEncoder encoder(jpeg->data, jpeg->width, jpeg->height, jpeg->quality, BUF_RGB);
-        encoder.encode();
-        enc_req->jpeg_len = encoder.get_jpeg_len();
-        enc_req->jpeg = (char *)malloc(sizeof(*enc_req->jpeg)*enc_req->jpeg_len);
-        if (!enc_req->jpeg) {
-            enc_req->error = strdup("malloc in FixedJpegStack::UV_JpegEncode failed.");
-            return;
-        }
-        else {
-            memcpy(enc_req->jpeg, encoder.get_jpeg(), enc_req->jpeg_len);
-        }
+        unsigned char *out;
+        unsigned long out_len;
+        jpeg->encode_snapshot(enc_req, jpeg_margins(), &out, &out_len);
+        enc_req->jpeg_len = out_len;
+        enc_req->jpeg = (char *)out;
     }
     catch (const char *err) {
         enc_req->error = strdup(err);
@@ -352,38 +773,41 @@ void FixedJpegStack::UV_JpegEncode(uv_work_t *req) {
 
 void FixedJpegStack::UV_JpegEncodeAfter(uv_work_t *req) {
 
-    encode_request *enc_req = (encode_request *)req->data;
+    stack_encode_request *enc_req = (stack_encode_request *)req->data;
+    HandleScope scope(enc_req->isolate);
     delete req;
 
     Handle<Value> argv[2];
 
+    FixedJpegStack *jpeg = (FixedJpegStack *)enc_req->jpeg_obj;
+
+    // Recovers the tiles of a failed encode before the callback gets to push.
+    jpeg->release_snapshot(enc_req);
+
     if (enc_req->error) {
-        //argv[0] = Undefined();
+        argv[0] = Undefined( enc_req->isolate );
         argv[1] = ErrorException(enc_req->isolate, enc_req->error);
     }
     else {
-        v8::MaybeLocal<v8::Object> bufMaybe = Buffer::New(enc_req->isolate, enc_req->jpeg_len);
-        v8::Local<v8::Object> * buf;
-        bufMaybe.ToLocal<v8::Object>( buf );
-        memcpy(Buffer::Data(*buf), enc_req->jpeg, enc_req->jpeg_len);
-        argv[0] = *buf;
-        //argv[1] = Undefined();
+        // the Buffer takes ownership of the encoder's output
+        argv[0] = BufferFromMalloc(enc_req->isolate, enc_req->jpeg, enc_req->jpeg_len);
+        argv[1] = Undefined( enc_req->isolate );
+        enc_req->jpeg = NULL;
     }
 
     TryCatch try_catch( enc_req->isolate ); // don't quite see the necessity of this
 
-    enc_req->callback->Call( Null( enc_req->isolate ), 2, argv );
+    Local<Function>::New(enc_req->isolate, enc_req->callback)->Call( Null( enc_req->isolate ), 2, argv );
 
     if (try_catch.HasCaught()) {
         FatalException( enc_req->isolate, try_catch );
     }
 
-    //enc_req->callback.Dispose();
+    enc_req->callback.Reset();
     free(enc_req->jpeg);
     free(enc_req->error);
 
-    ((FixedJpegStack *)enc_req->jpeg_obj)->Unref();
-    free(enc_req);
+    delete enc_req;
 }
 
 void FixedJpegStack::JpegEncodeAsync(const FunctionCallbackInfo<Value>& args) {
@@ -403,16 +827,19 @@ void FixedJpegStack::JpegEncodeAsync(const FunctionCallbackInfo<Value>& args) {
     Local<Function> callback = Local<Function>::Cast(args[0]);
     FixedJpegStack *jpeg = ObjectWrap::Unwrap<FixedJpegStack>(args.This());
 
-    encode_request *enc_req = (encode_request *)malloc(sizeof(*enc_req));
+    stack_encode_request *enc_req = new stack_encode_request;
 
-    if (!enc_req) {
-        VException(isolate, "malloc in FixedJpegStack::JpegEncodeAsync failed.");
+    try {
+        jpeg->snapshot(enc_req);
+    }
+    catch (const char *err) {
+        delete enc_req;
+        VException(isolate, err);
         return;
     }
 
-    enc_req->callback = callback;
+    enc_req->callback.Reset(isolate, callback);
     enc_req->isolate = isolate;
-    enc_req->jpeg_obj = jpeg;
     enc_req->jpeg = NULL;
     enc_req->jpeg_len = 0;
     enc_req->error = NULL;
@@ -420,7 +847,6 @@ void FixedJpegStack::JpegEncodeAsync(const FunctionCallbackInfo<Value>& args) {
     uv_work_t* req = new uv_work_t;
     req->data = enc_req;
     uv_queue_work(uv_default_loop(), req, UV_JpegEncode, (uv_after_work_cb)UV_JpegEncodeAfter);
-    jpeg->Ref();
 
     Undefined( isolate );
 
@@ -7,8 +7,13 @@
 
 #include <uv.h>
 
+#include <map>
+#include <vector>
+
 #include "common.h"
 #include "jpeg_encoder.h"
+#include "jpeg_row_cache.h"
+#include "jpeg_coef_canvas.h"
 
 
 using v8::Function;
@@ -18,30 +23,98 @@ using v8::Isolate;
 using v8::Value;
 
 class FixedJpegStack : public node::ObjectWrap {
-    int width, height, quality;
+    int width, height, quality, threads;
+    chroma_subsampling subsampling;
     buffer_type buf_type;
+    double size_hint; // bytes per pixel of the last encode
 
+    // Async encodes read a snapshot of the canvas: 'data' itself until the
+    // next push, which first moves the pushes onto a copy (copy-on-write).
     unsigned char *data;
+    int data_readers; // async encodes reading 'data'
+    std::map<unsigned char *, int> detached; // older canvases still being encoded
+    unsigned char *spare; // idle canvas buffer kept for the next copy
+
+    // Only MCU rows pushed to since the last encode are recompressed. Every
+    // push stamps its pixel rows with a new serial number.
+    JpegRowCache row_cache;
+    std::vector<unsigned long> row_serials;
+    unsigned long push_serial;
+
+    // Set by setCoefficientCache(true). Kept until disabled and no async
+    // encode uses it any more.
+    JpegCoefCanvas *coef_canvas;
+    bool use_coefficients;
+    int encodes_pending;
+
+    // Jpeg tiles whose coefficients went straight into coef_canvas. Their
+    // pixels are only decoded into the canvas once something reads it.
+    struct pending_tile {
+        unsigned char *jpeg;
+        size_t jpeg_len;
+        int x, y, w, h;
+    };
+    std::vector<pending_tile> pending_tiles;
+
+    unsigned char *acquire_canvas();
+    void release_canvas(unsigned char *canvas);
+    unsigned char *writable_canvas();
+    void touch(int x, int y, int w, int h);
+    void touch_rows(int y, int h);
+    void flush_tiles();
+    stack_encode_settings encode_settings() const;
+    void encode_canvas(unsigned char *canvas, const std::vector<unsigned long> &rows,
+        const std::vector<unsigned long> &mcus, bool coefficients,
+        stack_encode_settings *settings, const jpeg_margins &margins,
+        unsigned char **jpeg, unsigned long *jpeg_len);
+    void drop_coef_canvas();
 
     static void UV_JpegEncode(uv_work_t *req);
     static void UV_JpegEncodeAfter(uv_work_t *req);
 
+    static v8::Persistent<v8::FunctionTemplate> constructor_template;
+
 public:
     static void Initialize(v8::Handle<v8::Object> target);
 
+    // Whether a JS value is a FixedJpegStack, for objects that take one.
+    static bool HasInstance(Isolate *isolate, v8::Local<v8::Value> value);
+
+    int get_width() const { return width; }
+    int get_height() const { return height; }
+
     FixedJpegStack(int wwidth, int hheight, buffer_type bbuf_type);
+    ~FixedJpegStack();
+
+    v8::Local<v8::Value> JpegEncodeSync( Isolate * isolate );
 
-    void JpegEncodeSync( Isolate * isolate );
+    // Async encodes of the canvas, by encode() or by other objects such as
+    // MjpegStream, take a snapshot on the main thread, encode it on any
+    // thread and release it on the main thread again. A snapshot keeps the
+    // stack alive; releasing a failed one (req->error set) recovers the
+    // tiles the encode may have dropped.
+    void snapshot(stack_encode_request *req);
+    void encode_snapshot(stack_encode_request *req, const jpeg_margins &margins,
+        unsigned char **jpeg, unsigned long *jpeg_len);
+    void release_snapshot(stack_encode_request *req);
 
-    void Push(unsigned char *data_buf, int x, int y, int w, int h);
+    void Push(unsigned char *data_buf, int x, int y, int w, int h, int stride);
+    void PushJpeg(const unsigned char *jpeg, size_t jpeg_len, int x, int y);
 
     void SetQuality(int q);
+    void SetSubsampling(chroma_subsampling s);
+    void SetThreads(int t);
+    void SetCoefficientCache(bool enabled);
 
     static void New(const FunctionCallbackInfo<Value>& args);
     static void JpegEncodeSync(const FunctionCallbackInfo<Value>& args);
     static void JpegEncodeAsync(const FunctionCallbackInfo<Value>& args);
     static void Push(const FunctionCallbackInfo<Value>& args);
+    static void PushJpeg(const FunctionCallbackInfo<Value>& args);
     static void SetQuality(const FunctionCallbackInfo<Value>& args);
+    static void SetSubsampling(const FunctionCallbackInfo<Value>& args);
+    static void SetThreads(const FunctionCallbackInfo<Value>& args);
+    static void SetCoefficientCache(const FunctionCallbackInfo<Value>& args);
 
 };
 
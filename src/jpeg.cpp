@@ -8,6 +8,7 @@
 #include "jpeg.h"
 #include "jpeg_encoder.h"
 #include "buffer_compat.h"
+#include "parallel.h"
 
 using namespace v8;
 using namespace node;
@@ -31,38 +32,95 @@ void Jpeg::Initialize(v8::Handle<v8::Object> target) {
 
     NODE_SET_PROTOTYPE_METHOD(tpl, "encode", JpegEncodeAsync);
     NODE_SET_PROTOTYPE_METHOD(tpl, "encodeSync", JpegEncodeSync);
+    NODE_SET_PROTOTYPE_METHOD(tpl, "encodeRegion", JpegEncodeRegionAsync);
+    NODE_SET_PROTOTYPE_METHOD(tpl, "encodeRegionSync", JpegEncodeRegionSync);
+    NODE_SET_PROTOTYPE_METHOD(tpl, "encodeMulti", JpegEncodeMultiAsync);
+    NODE_SET_PROTOTYPE_METHOD(tpl, "encodeMultiSync", JpegEncodeMultiSync);
+    NODE_SET_PROTOTYPE_METHOD(tpl, "encodeStream", JpegEncodeStream);
     NODE_SET_PROTOTYPE_METHOD(tpl, "setQuality", SetQuality);
     NODE_SET_PROTOTYPE_METHOD(tpl, "setSmoothing", SetSmoothing);
+    NODE_SET_PROTOTYPE_METHOD(tpl, "setSubsampling", SetSubsampling);
+    NODE_SET_PROTOTYPE_METHOD(tpl, "setThreads", SetThreads);
+    tpl->Set(String::NewFromUtf8(isolate, "encodeBatch"),
+        FunctionTemplate::New(isolate, JpegEncodeBatch));
+    tpl->Set(String::NewFromUtf8(isolate, "encoderStats"),
+        FunctionTemplate::New(isolate, EncoderStats));
 
     target->Set(String::NewFromUtf8(isolate, "Jpeg"), tpl->GetFunction());
 
 };
 
-Jpeg::Jpeg(unsigned char *ddata, int wwidth, int hheight, buffer_type bbuf_type) :
-    jpeg_encoder(ddata, wwidth, hheight, 60, bbuf_type) {}
+Jpeg::Jpeg(unsigned char *ddata, int wwidth, int hheight, int sstride, buffer_type bbuf_type) :
+    jpeg_encoder(ddata, wwidth, hheight, 60, bbuf_type)
+{
+    jpeg_encoder.set_stride(sstride);
+}
+
+Jpeg::~Jpeg() {
+    source.Reset();
+}
 
-void Jpeg::JpegEncodeSync( Isolate * isolate ) {
+Local<Value> Jpeg::JpegEncodeSync( Isolate * isolate ) {
 
     try {
         jpeg_encoder.encode();
     } catch( const char *err ) {
         VException( isolate, err );
-        return;
+        return Local<Value>();
     }
 
-    //Buffer send
+    //Buffer send, handing libjpeg's output over without a copy
     int jpeg_len = jpeg_encoder.get_jpeg_len();
-    v8::MaybeLocal<v8::Object> retbuf = Buffer::New(isolate, jpeg_len);
-    v8::Local<v8::Object> local;
-    retbuf.ToLocal( &local );
-    memcpy(
-        Buffer::Data(local),
-        jpeg_encoder.get_jpeg(),
+    return BufferFromMalloc(
+        isolate,
+        (char *)jpeg_encoder.release_jpeg(),
         jpeg_len
     );
 
 }
 
+// Encodes rect r of the source with the object's settings. Only the pixels
+// inside r are read and converted.
+Local<Value> Jpeg::JpegEncodeRegionSync( Isolate * isolate, const Rect &r ) {
+
+    JpegEncoder encoder(jpeg_encoder);
+    encoder.setRect(r);
+
+    try {
+        encoder.encode();
+    } catch( const char *err ) {
+        VException( isolate, err );
+        return Local<Value>();
+    }
+
+    int jpeg_len = encoder.get_jpeg_len();
+    return BufferFromMalloc(
+        isolate,
+        (char *)encoder.release_jpeg(),
+        jpeg_len
+    );
+
+}
+
+// Encodes the pyramid's outputs and returns them as an array of Buffers.
+Local<Value> Jpeg::JpegEncodeMultiSync( Isolate * isolate, JpegPyramid &pyramid, int threads ) {
+
+    try {
+        pyramid.encode(threads);
+    } catch( const char *err ) {
+        VException( isolate, err );
+        return Local<Value>();
+    }
+
+    Local<Array> images = Array::New(isolate, pyramid.size());
+    for (size_t i = 0; i < pyramid.size(); i++) {
+        unsigned long jpeg_len = pyramid.get_jpeg_len(i);
+        images->Set(i, BufferFromMalloc(isolate, (char *)pyramid.release_jpeg(i), jpeg_len));
+    }
+    return images;
+
+}
+
 void Jpeg::SetQuality(int q) {
 
     jpeg_encoder.set_quality(q);
@@ -75,12 +133,24 @@ void Jpeg::SetSmoothing(int s) {
 
 }
 
+void Jpeg::SetSubsampling(chroma_subsampling s) {
+
+    jpeg_encoder.set_subsampling(s);
+
+}
+
+void Jpeg::SetThreads(int t) {
+
+    jpeg_encoder.set_threads(t);
+
+}
+
 void Jpeg::New(const FunctionCallbackInfo<Value>& args) {
 
     Isolate* isolate = args.GetIsolate();
 
     if (args.Length() < 3) {
-        VException( isolate, "At least three arguments required - buffer, width, height, [and buffer type]" );
+        VException( isolate, "At least three arguments required - buffer, width, height, [buffer type, and stride]" );
         return;
     }
 
@@ -114,42 +184,46 @@ void Jpeg::New(const FunctionCallbackInfo<Value>& args) {
 
     buffer_type buf_type = BUF_RGB;
 
-    if (args.Length() == 4) {
+    if (args.Length() >= 4 && !args[3]->IsUndefined()) {
 
         if (!args[3]->IsString()) {
-            VException( isolate, "Fifth argument must be a string. Either 'rgb', 'bgr', 'rgba' or 'bgra'.");
+            VException( isolate, "Fourth argument must be a string. Either 'rgb', 'bgr', 'rgba', 'bgra', 'i420', 'nv12' or 'yuyv'.");
             return;
         }
 
         String::Utf8Value str(args[3]);
-        const char * bt = * str;
-
-        if (!(str_eq(bt, "rgb")
-            || str_eq(bt, "bgr")
-            || str_eq(bt, "rgba")
-            || str_eq(bt, "bgra"))
-        ) {
-            VException( isolate, "Buffer type must be 'rgb', 'bgr', 'rgba' or 'bgra'." );
+        if (!parse_buffer_type(*str, &buf_type)) {
+            VException( isolate, "Buffer type must be 'rgb', 'bgr', 'rgba', 'bgra', 'i420', 'nv12' or 'yuyv'." );
             return;
         }
 
-        if (str_eq(bt, "rgb")) {
-            buf_type = BUF_RGB;
-        } else if (str_eq(bt, "bgr")) {
-            buf_type = BUF_BGR;
-        } else if (str_eq(bt, "rgba")) {
-            buf_type = BUF_RGBA;
-        } else if (str_eq(bt, "bgra")) {
-            buf_type = BUF_BGRA;
-        } else {
-            VException( isolate, "Buffer type wasn't 'rgb', 'bgr', 'rgba' or 'bgra'." );
+    }
+
+    int stride = row_bytes(buf_type, w);
+
+    if (args.Length() >= 5 && !args[4]->IsUndefined()) {
+        if (!args[4]->IsInt32()) {
+            VException( isolate, "Fifth argument must be integer stride." );
             return;
         }
-
+        if (args[4]->Int32Value() < stride) {
+            VException( isolate, "Stride is smaller than a row of pixels." );
+            return;
+        }
+        stride = args[4]->Int32Value();
     }
 
     Local<Object> buffer = args[0]->ToObject();
-    Jpeg *jpeg = new Jpeg((unsigned char*) Buffer::Data(buffer), w, h, buf_type);
+
+    if (Buffer::Length(buffer) < image_bytes(buf_type, w, h, stride)) {
+        VException( isolate, "Buffer is smaller than width*height pixels." );
+        return;
+    }
+
+    Jpeg *jpeg = new Jpeg((unsigned char*) Buffer::Data(buffer), w, h, stride, buf_type);
+    // Async encodes read the pixels while JS runs, encodeStream's even
+    // while it calls back, so the buffer has to outlive the caller's use.
+    jpeg->source.Reset(isolate, buffer);
     jpeg->Wrap(args.This());
 
 }
@@ -157,7 +231,160 @@ void Jpeg::New(const FunctionCallbackInfo<Value>& args) {
 void Jpeg::JpegEncodeSync(const FunctionCallbackInfo<Value>& args)
 {
     Jpeg *jpeg = ObjectWrap::Unwrap<Jpeg>(args.This());
-    jpeg->JpegEncodeSync( args.GetIsolate() );
+    Local<Value> image = jpeg->JpegEncodeSync( args.GetIsolate() );
+    if (!image.IsEmpty())
+        args.GetReturnValue().Set(image);
+}
+
+// Reads x, y, width, height from the first four arguments into *r, checking
+// that they lie within the source. Throws a JS exception and returns false
+// otherwise.
+bool Jpeg::parse_region(const FunctionCallbackInfo<Value>& args, Rect *r) {
+
+    Isolate* isolate = args.GetIsolate();
+
+    if (!args[0]->IsInt32() || !args[1]->IsInt32()
+        || !args[2]->IsInt32() || !args[3]->IsInt32())
+    {
+        VException( isolate, "x, y, width and height must be integers." );
+        return false;
+    }
+
+    int x = args[0]->Int32Value();
+    int y = args[1]->Int32Value();
+    int w = args[2]->Int32Value();
+    int h = args[3]->Int32Value();
+
+    if (x < 0 || y < 0) {
+        VException( isolate, "Coordinates can't be negative." );
+        return false;
+    }
+
+    if (w <= 0 || h <= 0) {
+        VException( isolate, "Width and height must be greater than 0." );
+        return false;
+    }
+
+    if (x + w > jpeg_encoder.get_width() || y + h > jpeg_encoder.get_height()) {
+        VException( isolate, "Region exceeds the image." );
+        return false;
+    }
+
+    *r = Rect(x, y, w, h);
+    return true;
+
+}
+
+void Jpeg::JpegEncodeRegionSync(const FunctionCallbackInfo<Value>& args)
+{
+    Isolate* isolate = args.GetIsolate();
+
+    if (args.Length() != 4) {
+        VException( isolate, "Four arguments required - x, y, width, height." );
+        return;
+    }
+
+    Jpeg *jpeg = ObjectWrap::Unwrap<Jpeg>(args.This());
+    Rect r;
+    if (!jpeg->parse_region(args, &r))
+        return;
+
+    Local<Value> image = jpeg->JpegEncodeRegionSync( isolate, r );
+    if (!image.IsEmpty())
+        args.GetReturnValue().Set(image);
+}
+
+// Reads the levels array ([{scale, [quality]}, ...]) of encodeMulti into
+// 'pyramid' and, if there are argc arguments before the callback, threads
+// from the second one. Throws a JS exception and returns false if they're
+// malformed.
+bool Jpeg::parse_multi(const FunctionCallbackInfo<Value>& args, int argc,
+    JpegPyramid *pyramid, int *threads)
+{
+    Isolate* isolate = args.GetIsolate();
+
+    if (!args[0]->IsArray()) {
+        VException( isolate, "First argument must be an array of levels." );
+        return false;
+    }
+
+    *threads = 1;
+    if (argc == 2) {
+        if (!args[1]->IsInt32()) {
+            VException( isolate, "Second argument must be integer threads." );
+            return false;
+        }
+        *threads = args[1]->Int32Value();
+        if (*threads < 1 || *threads > 64) {
+            VException( isolate, "Threads must be between 1 and 64." );
+            return false;
+        }
+    }
+
+    Local<Array> levels = Local<Array>::Cast(args[0]);
+    Local<String> scale_key = String::NewFromUtf8(isolate, "scale");
+    Local<String> quality_key = String::NewFromUtf8(isolate, "quality");
+
+    for (uint32_t i = 0; i < levels->Length(); i++) {
+        Local<Value> l = levels->Get(i);
+        if (!l->IsObject()) {
+            VException( isolate, "Every level must be an object - {scale, [quality]}." );
+            return false;
+        }
+        Local<Object> level_obj = l->ToObject();
+        Local<Value> scale = level_obj->Get(scale_key);
+        Local<Value> quality = level_obj->Get(quality_key);
+
+        int shift = -1;
+        if (scale->IsNumber()) {
+            double s = scale->NumberValue();
+            for (int k = 0; k <= MAX_PYRAMID_SHIFT; k++) {
+                if (s == 1.0/(1 << k)) {
+                    shift = k;
+                    break;
+                }
+            }
+        }
+        if (shift < 0) {
+            VException( isolate, "Level scale must be 1, 1/2, 1/4, 1/8, 1/16, 1/32 or 1/64." );
+            return false;
+        }
+
+        int q = -1;
+        if (!quality->IsUndefined()) {
+            if (!quality->IsInt32() || quality->Int32Value() < 0 || quality->Int32Value() > 100) {
+                VException( isolate, "Level quality must be an integer between 0 and 100." );
+                return false;
+            }
+            q = quality->Int32Value();
+        }
+
+        pyramid->add(shift, q);
+    }
+
+    return true;
+
+}
+
+// jpeg.encodeMultiSync([{scale, [quality]}, ...], [threads])
+void Jpeg::JpegEncodeMultiSync(const FunctionCallbackInfo<Value>& args)
+{
+    Isolate* isolate = args.GetIsolate();
+
+    if (args.Length() < 1 || args.Length() > 2) {
+        VException( isolate, "One or two arguments required - array of levels, [threads]." );
+        return;
+    }
+
+    Jpeg *jpeg = ObjectWrap::Unwrap<Jpeg>(args.This());
+    JpegPyramid pyramid(jpeg->jpeg_encoder);
+    int threads;
+    if (!parse_multi(args, args.Length(), &pyramid, &threads))
+        return;
+
+    Local<Value> images = jpeg->JpegEncodeMultiSync( isolate, pyramid, threads );
+    if (!images.IsEmpty())
+        args.GetReturnValue().Set(images);
 }
 
 void Jpeg::SetQuality(const FunctionCallbackInfo<Value>& args) {
@@ -225,6 +452,84 @@ void Jpeg::SetSmoothing(const FunctionCallbackInfo<Value>& args)
     Undefined( isolate );
 }
 
+void Jpeg::SetSubsampling(const FunctionCallbackInfo<Value>& args)
+{
+    Isolate* isolate = args.GetIsolate();
+
+    if (args.Length() != 1) {
+        VException( isolate, "One argument required - subsampling" );
+        return;
+    }
+
+    chroma_subsampling s;
+    String::Utf8Value str(args[0]);
+    if (!args[0]->IsString() || !parse_subsampling(*str, &s)) {
+        VException( isolate, "Subsampling must be '4:4:4', '4:2:2', '4:2:0' or 'gray'." );
+        return;
+    }
+
+    Jpeg *jpeg = node::ObjectWrap::Unwrap<Jpeg>(args.This());
+    jpeg->SetSubsampling(s);
+
+    Undefined( isolate );
+}
+
+void Jpeg::SetThreads(const FunctionCallbackInfo<Value>& args) {
+
+    Isolate* isolate = args.GetIsolate();
+
+    if (args.Length() != 1) {
+        VException(isolate, "One argument required - threads");
+        return;
+    }
+
+    if (!args[0]->IsInt32()) {
+        VException(isolate, "First argument must be integer threads");
+        return;
+    }
+
+    int t = args[0]->Int32Value();
+
+    if (t < 1) {
+        VException(isolate, "Threads must be greater or equal to 1.");
+        return;
+    }
+    if (t > 64) {
+        VException(isolate, "Threads must be less than or equal to 64.");
+        return;
+    }
+
+    Jpeg *jpeg = ObjectWrap::Unwrap<Jpeg>(args.This());
+    jpeg->SetThreads(t);
+
+    Undefined(isolate);
+
+}
+
+// Jpeg.encoderStats() - counters describing how encodes have been served by
+// the per-thread compressor contexts and how often their output buffers had
+// to grow, since the module was loaded.
+void Jpeg::EncoderStats(const FunctionCallbackInfo<Value>& args) {
+
+    Isolate* isolate = args.GetIsolate();
+    encoder_stats st = JpegEncoder::stats();
+
+    Local<Object> stats = Object::New(isolate);
+    stats->Set(String::NewFromUtf8(isolate, "contextsCreated"),
+        Number::New(isolate, st.contexts_created));
+    stats->Set(String::NewFromUtf8(isolate, "contextsReconfigured"),
+        Number::New(isolate, st.contexts_reconfigured));
+    stats->Set(String::NewFromUtf8(isolate, "contextsReused"),
+        Number::New(isolate, st.contexts_reused));
+    stats->Set(String::NewFromUtf8(isolate, "outputBuffers"),
+        Number::New(isolate, st.output_buffers));
+    stats->Set(String::NewFromUtf8(isolate, "outputReallocs"),
+        Number::New(isolate, st.output_reallocs));
+
+    args.GetReturnValue().Set(stats);
+
+}
+
 void Jpeg::UV_JpegEncode(uv_work_t *req) {
     encode_request *enc_req = (encode_request *)req->data;
     Jpeg *jpeg = (Jpeg *)enc_req->jpeg_obj;
@@ -232,14 +537,7 @@ void Jpeg::UV_JpegEncode(uv_work_t *req) {
     try {
         jpeg->jpeg_encoder.encode();
         enc_req->jpeg_len = jpeg->jpeg_encoder.get_jpeg_len();
-        enc_req->jpeg = (char *)malloc(sizeof(*enc_req->jpeg)*enc_req->jpeg_len);
-        if (!enc_req->jpeg) {
-            enc_req->error = strdup("malloc in Jpeg::UV_JpegEncode failed.");
-            return;
-        }
-        else {
-            memcpy(enc_req->jpeg, jpeg->jpeg_encoder.get_jpeg(), enc_req->jpeg_len);
-        }
+        enc_req->jpeg = (char *)jpeg->jpeg_encoder.release_jpeg();
     }
     catch (const char *err) {
         enc_req->error = strdup(err);
@@ -249,36 +547,35 @@ void Jpeg::UV_JpegEncode(uv_work_t *req) {
 void Jpeg::UV_JpegEncodeAfter(uv_work_t *req) {
 
     encode_request *enc_req = (encode_request *)req->data;
+    HandleScope scope(enc_req->isolate);
     delete req;
 
     Handle<Value> argv[2];
 
     if (enc_req->error) {
-        //argv[0] = 0;
-        //argv[1] = ErrorException(enc_req->error);
+        argv[0] = Undefined( enc_req->isolate );
+        argv[1] = ErrorException( enc_req->isolate, enc_req->error );
     } else {
-        v8::MaybeLocal<v8::Object> bufMaybe = Buffer::New(enc_req->isolate, enc_req->jpeg_len);
-        v8::Local<v8::Object> * buf;
-        bufMaybe.ToLocal<v8::Object>( buf );
-        memcpy(Buffer::Data(*buf), enc_req->jpeg, enc_req->jpeg_len);
-        argv[0] = *buf;
-        //argv[1] = 0;
+        // the Buffer takes ownership of the encoder's output
+        argv[0] = BufferFromMalloc(enc_req->isolate, enc_req->jpeg, enc_req->jpeg_len);
+        argv[1] = Undefined( enc_req->isolate );
+        enc_req->jpeg = NULL;
     }
 
     TryCatch try_catch( enc_req->isolate ); // don't quite see the necessity of this
 
-    enc_req->callback->Call( Null( enc_req->isolate ), 2, argv );
+    Local<Function>::New(enc_req->isolate, enc_req->callback)->Call( Null( enc_req->isolate ), 2, argv );
 
     if (try_catch.HasCaught()) {
         FatalException( enc_req->isolate, try_catch );
     }
 
-    //enc_req->callback.Dispose();
+    enc_req->callback.Reset();
     free(enc_req->jpeg);
     free(enc_req->error);
 
     ((Jpeg *)enc_req->jpeg_obj)->Unref();
-    free(enc_req);
+    delete enc_req;
 }
 
 void Jpeg::JpegEncodeAsync(const FunctionCallbackInfo<Value>& args) {
@@ -298,17 +595,99 @@ void Jpeg::JpegEncodeAsync(const FunctionCallbackInfo<Value>& args) {
     Local<Function> callback = Local<Function>::Cast(args[0]);
     Jpeg *jpeg = ObjectWrap::Unwrap<Jpeg>(args.This());
 
-    encode_request  *enc_req = (encode_request *)malloc(sizeof(*enc_req));
+    encode_request *enc_req = new encode_request;
+
+    enc_req->callback.Reset(isolate, callback);
+    enc_req->jpeg_obj = jpeg;
+    enc_req->isolate = isolate;
+    enc_req->jpeg = NULL;
+    enc_req->jpeg_len = 0;
+    enc_req->error = NULL;
+
+    uv_work_t* req = new uv_work_t;
+    req->data = enc_req;
+
+    uv_queue_work(uv_default_loop(), req, UV_JpegEncode, (uv_after_work_cb)UV_JpegEncodeAfter);
 
-    if( ! enc_req ) {
-        VException( isolate, "malloc in Jpeg::JpegEncodeAsync failed." );
+    jpeg->Ref();
+
+    Undefined( isolate );
+
+}
+
+void Jpeg::UV_JpegEncodeRegion(uv_work_t *req) {
+    jpeg_region_request *enc_req = (jpeg_region_request *)req->data;
+
+    try {
+        enc_req->encoder.encode();
+        enc_req->jpeg_len = enc_req->encoder.get_jpeg_len();
+        enc_req->jpeg = (char *)enc_req->encoder.release_jpeg();
+    }
+    catch (const char *err) {
+        enc_req->error = strdup(err);
+    }
+}
+
+void Jpeg::UV_JpegEncodeRegionAfter(uv_work_t *req) {
+
+    jpeg_region_request *enc_req = (jpeg_region_request *)req->data;
+    HandleScope scope(enc_req->isolate);
+    delete req;
+
+    Handle<Value> argv[2];
+
+    if (enc_req->error) {
+        argv[0] = Undefined( enc_req->isolate );
+        argv[1] = ErrorException( enc_req->isolate, enc_req->error );
+    } else {
+        argv[0] = BufferFromMalloc(enc_req->isolate, enc_req->jpeg, enc_req->jpeg_len);
+        argv[1] = Undefined( enc_req->isolate );
+        enc_req->jpeg = NULL;
+    }
+
+    TryCatch try_catch( enc_req->isolate );
+
+    Local<Function>::New(enc_req->isolate, enc_req->callback)->Call( Null( enc_req->isolate ), 2, argv );
+
+    if (try_catch.HasCaught()) {
+        FatalException( enc_req->isolate, try_catch );
+    }
+
+    enc_req->callback.Reset();
+    free(enc_req->jpeg);
+    free(enc_req->error);
+
+    ((Jpeg *)enc_req->jpeg_obj)->Unref();
+    delete enc_req;
+}
+
+// jpeg.encodeRegion(x, y, width, height, callback)
+void Jpeg::JpegEncodeRegionAsync(const FunctionCallbackInfo<Value>& args) {
+
+    Isolate* isolate = args.GetIsolate();
+
+    if (args.Length() != 5) {
+        VException( isolate, "Five arguments required - x, y, width, height, callback." );
+        return;
+    }
+
+    if (!args[4]->IsFunction()) {
+        VException( isolate, "Fifth argument must be a function." );
         return;
     }
 
-    //enc_req->callback = Persistent<Function>::Persistent( isolate, callback );
-    enc_req->callback = callback;
+    Jpeg *jpeg = ObjectWrap::Unwrap<Jpeg>(args.This());
+    Rect r;
+    if (!jpeg->parse_region(args, &r))
+        return;
+
+    jpeg_region_request *enc_req = new jpeg_region_request(jpeg->jpeg_encoder);
+    enc_req->encoder.setRect(r);
+
+    enc_req->callback.Reset(isolate, Local<Function>::Cast(args[4]));
     enc_req->jpeg_obj = jpeg;
     enc_req->isolate = isolate;
+    enc_req->canvas = NULL;
     enc_req->jpeg = NULL;
     enc_req->jpeg_len = 0;
     enc_req->error = NULL;
@@ -316,10 +695,472 @@ void Jpeg::JpegEncodeAsync(const FunctionCallbackInfo<Value>& args) {
     uv_work_t* req = new uv_work_t;
     req->data = enc_req;
 
-    uv_queue_work(uv_default_loop(), req, UV_JpegEncode, (uv_after_work_cb)UV_JpegEncodeAfter);
+    uv_queue_work(uv_default_loop(), req, UV_JpegEncodeRegion, (uv_after_work_cb)UV_JpegEncodeRegionAfter);
 
     jpeg->Ref();
 
     Undefined( isolate );
 
 }
+
+void Jpeg::UV_JpegEncodeMulti(uv_work_t *req) {
+    jpeg_multi_request *enc_req = (jpeg_multi_request *)req->data;
+
+    try {
+        enc_req->pyramid.encode(enc_req->threads);
+    }
+    catch (const char *err) {
+        enc_req->error = strdup(err);
+    }
+}
+
+void Jpeg::UV_JpegEncodeMultiAfter(uv_work_t *req) {
+
+    jpeg_multi_request *enc_req = (jpeg_multi_request *)req->data;
+    HandleScope scope(enc_req->isolate);
+    delete req;
+
+    Handle<Value> argv[2];
+
+    if (enc_req->error) {
+        argv[0] = Undefined( enc_req->isolate );
+        argv[1] = ErrorException( enc_req->isolate, enc_req->error );
+    } else {
+        JpegPyramid &pyramid = enc_req->pyramid;
+        Local<Array> images = Array::New(enc_req->isolate, pyramid.size());
+        for (size_t i = 0; i < pyramid.size(); i++) {
+            unsigned long jpeg_len = pyramid.get_jpeg_len(i);
+            images->Set(i, BufferFromMalloc(enc_req->isolate, (char *)pyramid.release_jpeg(i), jpeg_len));
+        }
+        argv[0] = images;
+        argv[1] = Undefined( enc_req->isolate );
+    }
+
+    TryCatch try_catch( enc_req->isolate );
+
+    Local<Function>::New(enc_req->isolate, enc_req->callback)->Call( Null( enc_req->isolate ), 2, argv );
+
+    if (try_catch.HasCaught()) {
+        FatalException( enc_req->isolate, try_catch );
+    }
+
+    enc_req->callback.Reset();
+    free(enc_req->error);
+
+    ((Jpeg *)enc_req->jpeg_obj)->Unref();
+    delete enc_req;
+}
+
+// jpeg.encodeMulti([{scale, [quality]}, ...], [threads], callback)
+//
+// Encodes the source at every requested scale inside a single threadpool
+// job and calls back with an array of jpeg Buffers in the same order.
+void Jpeg::JpegEncodeMultiAsync(const FunctionCallbackInfo<Value>& args) {
+
+    Isolate* isolate = args.GetIsolate();
+
+    if (args.Length() < 2 || args.Length() > 3) {
+        VException( isolate, "Two or three arguments required - array of levels, [threads], and callback function." );
+        return;
+    }
+
+    if (!args[args.Length() - 1]->IsFunction()) {
+        VException( isolate, "Last argument must be a function." );
+        return;
+    }
+
+    Jpeg *jpeg = ObjectWrap::Unwrap<Jpeg>(args.This());
+    jpeg_multi_request *enc_req = new jpeg_multi_request(jpeg->jpeg_encoder);
+    if (!parse_multi(args, args.Length() - 1, &enc_req->pyramid, &enc_req->threads)) {
+        delete enc_req;
+        return;
+    }
+
+    enc_req->callback.Reset(isolate, Local<Function>::Cast(args[args.Length() - 1]));
+    enc_req->jpeg_obj = jpeg;
+    enc_req->isolate = isolate;
+    enc_req->canvas = NULL;
+    enc_req->jpeg = NULL;
+    enc_req->jpeg_len = 0;
+    enc_req->error = NULL;
+
+    uv_work_t* req = new uv_work_t;
+    req->data = enc_req;
+
+    uv_queue_work(uv_default_loop(), req, UV_JpegEncodeMulti, (uv_after_work_cb)UV_JpegEncodeMultiAfter);
+
+    jpeg->Ref();
+
+    Undefined( isolate );
+
+}
+
+// Chunk sizes encodeStream accepts, and its default.
+#define MIN_STREAM_CHUNK 1024
+#define MAX_STREAM_CHUNK (16*1024*1024)
+#define DEFAULT_STREAM_CHUNK (64*1024)
+
+// jpeg_chunk_sink of encodeStream, called on the worker thread.
+void Jpeg::stream_chunk(void *arg, unsigned char *chunk, size_t len) {
+    jpeg_stream_request *enc_req = (jpeg_stream_request *)arg;
+
+    uv_mutex_lock(&enc_req->lock);
+    enc_req->chunks.push_back(std::make_pair(chunk, len));
+    uv_mutex_unlock(&enc_req->lock);
+
+    uv_async_send(&enc_req->async);
+}
+
+// Passes the chunks queued so far to on_chunk, in order. Main thread only.
+void Jpeg::stream_deliver(jpeg_stream_request *enc_req) {
+    std::vector<std::pair<unsigned char *, size_t> > chunks;
+
+    uv_mutex_lock(&enc_req->lock);
+    chunks.swap(enc_req->chunks);
+    uv_mutex_unlock(&enc_req->lock);
+
+    Isolate *isolate = enc_req->isolate;
+    for (size_t i = 0; i < chunks.size(); i++) {
+        HandleScope scope(isolate);
+        Handle<Value> argv[1];
+        argv[0] = BufferFromMalloc(isolate, (char *)chunks[i].first, chunks[i].second);
+
+        TryCatch try_catch( isolate );
+
+        Local<Function>::New(isolate, enc_req->on_chunk)->Call( Null( isolate ), 1, argv );
+
+        if (try_catch.HasCaught()) {
+            FatalException( isolate, try_catch );
+        }
+    }
+}
+
+void Jpeg::UV_JpegStreamAsync(uv_async_t *handle) {
+    stream_deliver((jpeg_stream_request *)handle->data);
+}
+
+void Jpeg::UV_JpegStreamClosed(uv_handle_t *handle) {
+    jpeg_stream_request *enc_req = (jpeg_stream_request *)handle->data;
+    uv_mutex_destroy(&enc_req->lock);
+    delete enc_req;
+}
+
+void Jpeg::UV_JpegEncodeStream(uv_work_t *req) {
+    jpeg_stream_request *enc_req = (jpeg_stream_request *)req->data;
+
+    try {
+        enc_req->encoder.encode();
+        enc_req->jpeg_len = enc_req->encoder.get_jpeg_len();
+    }
+    catch (const char *err) {
+        enc_req->error = strdup(err);
+    }
+}
+
+void Jpeg::UV_JpegEncodeStreamAfter(uv_work_t *req) {
+
+    jpeg_stream_request *enc_req = (jpeg_stream_request *)req->data;
+    HandleScope scope(enc_req->isolate);
+    delete req;
+
+    // Whatever the last wakeups didn't get to yet goes out before the
+    // final callback.
+    stream_deliver(enc_req);
+
+    Handle<Value> argv[2];
+
+    if (enc_req->error) {
+        argv[0] = Undefined( enc_req->isolate );
+        argv[1] = ErrorException( enc_req->isolate, enc_req->error );
+    } else {
+        argv[0] = Integer::New( enc_req->isolate, enc_req->jpeg_len );
+        argv[1] = Undefined( enc_req->isolate );
+    }
+
+    TryCatch try_catch( enc_req->isolate );
+
+    Local<Function>::New(enc_req->isolate, enc_req->callback)->Call( Null( enc_req->isolate ), 2, argv );
+
+    if (try_catch.HasCaught()) {
+        FatalException( enc_req->isolate, try_catch );
+    }
+
+    enc_req->callback.Reset();
+    enc_req->on_chunk.Reset();
+    free(enc_req->error);
+    enc_req->error = NULL;
+
+    ((Jpeg *)enc_req->jpeg_obj)->Unref();
+
+    // The request goes once libuv is done with the async handle.
+    uv_close((uv_handle_t *)&enc_req->async, UV_JpegStreamClosed);
+}
+
+// jpeg.encodeStream([chunk_size], on_chunk, callback)
+//
+// Encodes like encode(), but hands the jpeg to on_chunk(buffer) piece by
+// piece while it is being compressed, then calls callback(length, error).
+void Jpeg::JpegEncodeStream(const FunctionCallbackInfo<Value>& args) {
+
+    Isolate* isolate = args.GetIsolate();
+
+    if (args.Length() != 2 && args.Length() != 3) {
+        VException( isolate, "Two or three arguments required - [chunk size], chunk callback, callback." );
+        return;
+    }
+
+    int argc = args.Length();
+    size_t chunk_size = DEFAULT_STREAM_CHUNK;
+    if (argc == 3) {
+        if (!args[0]->IsInt32()) {
+            VException( isolate, "Chunk size must be an integer." );
+            return;
+        }
+        int size = args[0]->Int32Value();
+        if (size < MIN_STREAM_CHUNK || size > MAX_STREAM_CHUNK) {
+            VException( isolate, "Chunk size must be from 1024 to 16777216 bytes." );
+            return;
+        }
+        chunk_size = size;
+    }
+
+    if (!args[argc - 2]->IsFunction() || !args[argc - 1]->IsFunction()) {
+        VException( isolate, "Chunk callback and callback must be functions." );
+        return;
+    }
+
+    Jpeg *jpeg = ObjectWrap::Unwrap<Jpeg>(args.This());
+
+    jpeg_stream_request *enc_req = new jpeg_stream_request(jpeg->jpeg_encoder);
+
+    if (uv_mutex_init(&enc_req->lock) != 0) {
+        delete enc_req;
+        VException( isolate, "uv_mutex_init failed in Jpeg::JpegEncodeStream." );
+        return;
+    }
+    uv_async_init(uv_default_loop(), &enc_req->async, UV_JpegStreamAsync);
+    enc_req->async.data = enc_req;
+
+    enc_req->encoder.set_chunk_sink(chunk_size, stream_chunk, enc_req);
+    enc_req->on_chunk.Reset(isolate, Local<Function>::Cast(args[argc - 2]));
+    enc_req->callback.Reset(isolate, Local<Function>::Cast(args[argc - 1]));
+    enc_req->jpeg_obj = jpeg;
+    enc_req->isolate = isolate;
+    enc_req->canvas = NULL;
+    enc_req->jpeg = NULL;
+    enc_req->jpeg_len = 0;
+    enc_req->error = NULL;
+
+    uv_work_t* req = new uv_work_t;
+    req->data = enc_req;
+
+    uv_queue_work(uv_default_loop(), req, UV_JpegEncodeStream, (uv_after_work_cb)UV_JpegEncodeStreamAfter);
+
+    jpeg->Ref();
+
+    Undefined( isolate );
+
+}
+
+void Jpeg::encode_batch_frame(void *arg, int index) {
+    batch_frame &frame = ((batch_request *)arg)->frames[index];
+
+    try {
+        JpegEncoder encoder(frame.data, frame.width, frame.height, frame.quality, frame.buf_type);
+        encoder.set_stride(frame.stride);
+        encoder.encode();
+        frame.jpeg_len = encoder.get_jpeg_len();
+        frame.jpeg = (char *)encoder.release_jpeg();
+    }
+    catch (const char *err) {
+        strncpy(frame.error, err, sizeof(frame.error) - 1);
+    }
+}
+
+void Jpeg::UV_JpegEncodeBatch(uv_work_t *req) {
+    batch_request *batch = (batch_request *)req->data;
+    parallel_for(batch->frames.size(), batch->threads, encode_batch_frame, batch);
+}
+
+void Jpeg::UV_JpegEncodeBatchAfter(uv_work_t *req) {
+
+    batch_request *batch = (batch_request *)req->data;
+    HandleScope scope(batch->isolate);
+    delete req;
+
+    Handle<Value> argv[2];
+
+    const char *error = NULL;
+    for (size_t i = 0; i < batch->frames.size(); i++) {
+        if (batch->frames[i].error[0]) {
+            error = batch->frames[i].error;
+            break;
+        }
+    }
+
+    if (error) {
+        argv[0] = Undefined( batch->isolate );
+        argv[1] = ErrorException( batch->isolate, error );
+    } else {
+        Local<Array> images = Array::New(batch->isolate, batch->frames.size());
+        for (size_t i = 0; i < batch->frames.size(); i++) {
+            batch_frame &frame = batch->frames[i];
+            images->Set(i, BufferFromMalloc(batch->isolate, frame.jpeg, frame.jpeg_len));
+            frame.jpeg = NULL;
+        }
+        argv[0] = images;
+        argv[1] = Undefined( batch->isolate );
+    }
+
+    TryCatch try_catch( batch->isolate );
+
+    Local<Function>::New(batch->isolate, batch->callback)->Call( Null( batch->isolate ), 2, argv );
+
+    if (try_catch.HasCaught()) {
+        FatalException( batch->isolate, try_catch );
+    }
+
+    for (size_t i = 0; i < batch->frames.size(); i++)
+        free(batch->frames[i].jpeg);
+
+    batch->callback.Reset();
+    batch->buffers.Reset();
+    delete batch;
+}
+
+// Jpeg.encodeBatch([{buffer, width, height, [type], [quality], [stride]}, ...], [threads], callback)
+//
+// Encodes every frame inside a single threadpool job and calls back with an
+// array of jpeg Buffers in the same order. With threads > 1 the frames are
+// spread over that many threads within the job.
+void Jpeg::JpegEncodeBatch(const FunctionCallbackInfo<Value>& args) {
+
+    Isolate* isolate = args.GetIsolate();
+
+    if (args.Length() < 2 || args.Length() > 3) {
+        VException( isolate, "Two or three arguments required - array of frames, [threads], and callback function." );
+        return;
+    }
+
+    if (!args[0]->IsArray()) {
+        VException( isolate, "First argument must be an array of frames." );
+        return;
+    }
+
+    int threads = 1;
+    if (args.Length() == 3) {
+        if (!args[1]->IsInt32()) {
+            VException( isolate, "Second argument must be integer threads." );
+            return;
+        }
+        threads = args[1]->Int32Value();
+        if (threads < 1 || threads > 64) {
+            VException( isolate, "Threads must be between 1 and 64." );
+            return;
+        }
+    }
+
+    if (!args[args.Length() - 1]->IsFunction()) {
+        VException( isolate, "Last argument must be a function." );
+        return;
+    }
+
+    Local<Function> callback = Local<Function>::Cast(args[args.Length() - 1]);
+    Local<Array> frames = Local<Array>::Cast(args[0]);
+    Local<Array> buffers = Array::New(isolate, frames->Length());
+
+    Local<String> buffer_key = String::NewFromUtf8(isolate, "buffer");
+    Local<String> width_key = String::NewFromUtf8(isolate, "width");
+    Local<String> height_key = String::NewFromUtf8(isolate, "height");
+    Local<String> type_key = String::NewFromUtf8(isolate, "type");
+    Local<String> quality_key = String::NewFromUtf8(isolate, "quality");
+    Local<String> stride_key = String::NewFromUtf8(isolate, "stride");
+
+    batch_request *batch = new batch_request;
+
+    for (uint32_t i = 0; i < frames->Length(); i++) {
+        Local<Value> f = frames->Get(i);
+        if (!f->IsObject()) {
+            delete batch;
+            VException( isolate, "Every frame must be an object - {buffer, width, height, [type], [quality], [stride]}." );
+            return;
+        }
+        Local<Object> frame_obj = f->ToObject();
+
+        Local<Value> buffer = frame_obj->Get(buffer_key);
+        Local<Value> width = frame_obj->Get(width_key);
+        Local<Value> height = frame_obj->Get(height_key);
+        Local<Value> type = frame_obj->Get(type_key);
+        Local<Value> quality = frame_obj->Get(quality_key);
+        Local<Value> stride = frame_obj->Get(stride_key);
+
+        batch_frame frame;
+        frame.buf_type = BUF_RGB;
+        frame.quality = 60;
+        frame.jpeg = NULL;
+        frame.jpeg_len = 0;
+        memset(frame.error, 0, sizeof(frame.error));
+
+        const char *error = NULL;
+        if (!Buffer::HasInstance(buffer)) {
+            error = "Frame buffer must be Buffer.";
+        } else if (!width->IsInt32() || width->Int32Value() <= 0
+            || width->Int32Value() > JPEG_MAX_DIMENSION) {
+            error = "Frame width must be an integer from 1 to 65500.";
+        } else if (!height->IsInt32() || height->Int32Value() <= 0
+            || height->Int32Value() > JPEG_MAX_DIMENSION) {
+            error = "Frame height must be an integer from 1 to 65500.";
+        } else if (!type->IsUndefined()) {
+            String::Utf8Value str(type);
+            if (!type->IsString() || !parse_buffer_type(*str, &frame.buf_type))
+                error = "Frame type must be 'rgb', 'bgr', 'rgba', 'bgra', 'i420', 'nv12' or 'yuyv'.";
+        }
+        if (!error && !quality->IsUndefined()) {
+            if (!quality->IsInt32() || quality->Int32Value() < 0 || quality->Int32Value() > 100)
+                error = "Frame quality must be an integer between 0 and 100.";
+            else
+                frame.quality = quality->Int32Value();
+        }
+
+        if (!error) {
+            frame.width = width->Int32Value();
+            frame.height = height->Int32Value();
+            frame.stride = row_bytes(frame.buf_type, frame.width);
+            if (!stride->IsUndefined()) {
+                if (!stride->IsInt32() || stride->Int32Value() < frame.stride)
+                    error = "Frame stride must be an integer no smaller than a row of pixels.";
+                else
+                    frame.stride = stride->Int32Value();
+            }
+        }
+
+        if (!error) {
+            Local<Object> buf = buffer->ToObject();
+            if (Buffer::Length(buf) < image_bytes(frame.buf_type, frame.width, frame.height, frame.stride))
+                error = "Frame buffer is smaller than width*height pixels.";
+            frame.data = (unsigned char *)Buffer::Data(buf);
+            buffers->Set(i, buf);
+        }
+
+        if (error) {
+            delete batch;
+            VException( isolate, error );
+            return;
+        }
+
+        batch->frames.push_back(frame);
+    }
+
+    batch->callback.Reset(isolate, callback);
+    batch->buffers.Reset(isolate, buffers);
+    batch->isolate = isolate;
+    batch->threads = threads;
+
+    uv_work_t* req = new uv_work_t;
+    req->data = batch;
+
+    uv_queue_work(uv_default_loop(), req, UV_JpegEncodeBatch, (uv_after_work_cb)UV_JpegEncodeBatchAfter);
+
+    Undefined( isolate );
+
+}
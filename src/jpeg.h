@@ -7,7 +7,11 @@
 
 #include <uv.h>
 
+#include <utility>
+#include <vector>
+
 #include "jpeg_encoder.h"
+#include "jpeg_pyramid.h"
 
 using v8::Function;
 using v8::FunctionCallbackInfo;
@@ -15,23 +19,98 @@ using v8::FunctionTemplate;
 using v8::Isolate;
 using v8::Value;
 
+struct batch_frame {
+    unsigned char *data;
+    int width, height, stride, quality;
+    buffer_type buf_type;
+    char *jpeg;
+    unsigned long jpeg_len;
+    char error[JMSG_LENGTH_MAX]; // empty unless the frame failed
+};
+
+struct batch_request {
+    v8::Persistent<v8::Function> callback;
+    v8::Persistent<v8::Array> buffers; // keeps the frames' pixels alive
+    v8::Isolate * isolate;
+    std::vector<batch_frame> frames;
+    int threads;
+};
+
+// An encode of part of a Jpeg's source, with its own copy of the encoder so
+// it doesn't disturb other encodes of the same object.
+struct jpeg_region_request : encode_request {
+    JpegEncoder encoder;
+    jpeg_region_request(const JpegEncoder &eencoder) : encoder(eencoder) {}
+};
+
+// encodeMulti's outputs, all encoded within one job.
+struct jpeg_multi_request : encode_request {
+    JpegPyramid pyramid;
+    int threads;
+    jpeg_multi_request(const JpegEncoder &eencoder) : pyramid(eencoder) {}
+};
+
+// encodeStream's job. The worker queues each chunk of output under 'lock'
+// and wakes the main thread through 'async', which hands them to on_chunk
+// while the encode goes on.
+struct jpeg_stream_request : encode_request {
+    JpegEncoder encoder;
+    v8::Persistent<v8::Function> on_chunk;
+    uv_async_t async;
+    uv_mutex_t lock;
+    std::vector<std::pair<unsigned char *, size_t> > chunks;
+    jpeg_stream_request(const JpegEncoder &eencoder) : encoder(eencoder) {}
+};
+
 class Jpeg : public node::ObjectWrap {
     JpegEncoder jpeg_encoder;
+    v8::Persistent<v8::Object> source; // keeps the pixels alive
+
+    bool parse_region(const FunctionCallbackInfo<Value>& args, Rect *r);
+    static bool parse_multi(const FunctionCallbackInfo<Value>& args, int argc,
+        JpegPyramid *pyramid, int *threads);
 
     static void UV_JpegEncode(uv_work_t *req);
     static void UV_JpegEncodeAfter(uv_work_t *req);
+    static void UV_JpegEncodeRegion(uv_work_t *req);
+    static void UV_JpegEncodeRegionAfter(uv_work_t *req);
+    static void UV_JpegEncodeMulti(uv_work_t *req);
+    static void UV_JpegEncodeMultiAfter(uv_work_t *req);
+    static void UV_JpegEncodeStream(uv_work_t *req);
+    static void UV_JpegEncodeStreamAfter(uv_work_t *req);
+    static void stream_chunk(void *arg, unsigned char *chunk, size_t len);
+    static void stream_deliver(jpeg_stream_request *enc_req);
+    static void UV_JpegStreamAsync(uv_async_t *handle);
+    static void UV_JpegStreamClosed(uv_handle_t *handle);
+    static void UV_JpegEncodeBatch(uv_work_t *req);
+    static void UV_JpegEncodeBatchAfter(uv_work_t *req);
+    static void encode_batch_frame(void *arg, int index);
 public:
     static void Initialize(v8::Handle<v8::Object> target);
-    Jpeg(unsigned char *ddata, int wwidth, int hheight, buffer_type bbuf_type);
+    Jpeg(unsigned char *ddata, int wwidth, int hheight, int sstride, buffer_type bbuf_type);
+    ~Jpeg();
 
-    void JpegEncodeSync( Isolate * );
+    v8::Local<v8::Value> JpegEncodeSync( Isolate * );
+    v8::Local<v8::Value> JpegEncodeRegionSync( Isolate *, const Rect &r );
+    v8::Local<v8::Value> JpegEncodeMultiSync( Isolate *, JpegPyramid &pyramid, int threads );
 
     void SetQuality(int q);
     void SetSmoothing(int s);
+    void SetSubsampling(chroma_subsampling s);
+    void SetThreads(int t);
 
     static void New(const FunctionCallbackInfo<Value>& args);
     static void JpegEncodeSync(const FunctionCallbackInfo<Value>& args);
     static void JpegEncodeAsync(const FunctionCallbackInfo<Value>& args);
+    static void JpegEncodeRegionSync(const FunctionCallbackInfo<Value>& args);
+    static void JpegEncodeRegionAsync(const FunctionCallbackInfo<Value>& args);
+    static void JpegEncodeMultiSync(const FunctionCallbackInfo<Value>& args);
+    static void JpegEncodeMultiAsync(const FunctionCallbackInfo<Value>& args);
+    static void JpegEncodeStream(const FunctionCallbackInfo<Value>& args);
+    static void JpegEncodeBatch(const FunctionCallbackInfo<Value>& args);
+    static void EncoderStats(const FunctionCallbackInfo<Value>& args);
     static void SetQuality(const FunctionCallbackInfo<Value>& args);
     static void SetSmoothing(const FunctionCallbackInfo<Value>& args);
+    static void SetSubsampling(const FunctionCallbackInfo<Value>& args);
+    static void SetThreads(const FunctionCallbackInfo<Value>& args);
 };
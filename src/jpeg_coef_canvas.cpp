@@ -0,0 +1,363 @@
+#include <cstdlib>
+#include <cstring>
+
+#include "jpeg_coef_canvas.h"
+#include "jpeg_encoder.h"
+#include "jpeg_destination.h"
+#include "dirty_region.h"
+#include "jpeg_errors.h"
+
+// Stale MCUs are gathered into rects before their coefficients are
+// recomputed, each rect costing one small encode and decode. Covering a few
+// clean MCUs is cheaper than an extra round trip.
+#define RECOMPUTE_OVERHEAD_MCUS 4
+
+JpegCoefCanvas::JpegCoefCanvas(int wwidth, int hheight, chroma_subsampling ssubsampling) :
+    width(wwidth), height(hheight), quality(-1), subsampling(ssubsampling), serial(0)
+{
+    JpegEncoder geometry(NULL, width, height, 0, BUF_RGB);
+    geometry.set_subsampling(subsampling);
+    mcu_w = geometry.mcu_width();
+    mcu_h = geometry.mcu_height();
+    mcus_x = (width + mcu_w - 1)/mcu_w;
+    mcus_y = (height + mcu_h - 1)/mcu_h;
+
+    serials.assign(mcus_x*mcus_y, 0);
+    coef_serials.assign(mcus_x*mcus_y, 0);
+    coef_valid.assign(mcus_x*mcus_y, false);
+
+    cinfo.err = jpeg_jump_error(&cerr);
+    dinfo.err = jpeg_jump_error(&derr);
+
+    if (setjmp(cerr.jump))
+        throw jpeg_error_message((j_common_ptr)&cinfo);
+    jpeg_create_compress(&cinfo);
+
+    if (setjmp(derr.jump)) {
+        const char *msg = jpeg_error_message((j_common_ptr)&dinfo);
+        jpeg_destroy_compress(&cinfo);
+        throw msg;
+    }
+    jpeg_create_decompress(&dinfo);
+
+    uv_mutex_init(&lock);
+}
+
+JpegCoefCanvas::~JpegCoefCanvas() {
+    jpeg_destroy_compress(&cinfo);
+    jpeg_destroy_decompress(&dinfo);
+    uv_mutex_destroy(&lock);
+}
+
+void JpegCoefCanvas::stamp(const Rect &r) {
+
+    if (r.w <= 0 || r.h <= 0)
+        return;
+
+    serial++;
+    for (int my = r.y/mcu_h; my <= (r.y + r.h - 1)/mcu_h; my++) {
+        for (int mx = r.x/mcu_w; mx <= (r.x + r.w - 1)/mcu_w; mx++)
+            serials[my*mcus_x + mx] = serial;
+    }
+}
+
+Rect JpegCoefCanvas::align(const Rect &r) const {
+
+    int x0 = r.x/mcu_w*mcu_w;
+    int y0 = r.y/mcu_h*mcu_h;
+    int x1 = (r.x + r.w + mcu_w - 1)/mcu_w*mcu_w;
+    int y1 = (r.y + r.h + mcu_h - 1)/mcu_h*mcu_h;
+    if (x1 > width)
+        x1 = width;
+    if (y1 > height)
+        y1 = height;
+
+    return Rect(x0, y0, x1 - x0, y1 - y0);
+}
+
+// Sets up cinfo for a w x h RGB encode at 'quality', the same parameters
+// JpegEncoder uses, and sizes the cache after its components.
+void JpegCoefCanvas::configure(int w, int h) {
+
+    cinfo.image_width = w;
+    cinfo.image_height = h;
+    cinfo.input_components = 3;
+    cinfo.in_color_space = JCS_RGB;
+    jpeg_set_defaults(&cinfo);
+    jpeg_set_subsampling(&cinfo, subsampling);
+    jpeg_set_quality(&cinfo, quality, TRUE);
+
+    if (comps.empty()) {
+        comps.resize(cinfo.num_components);
+        for (int ci = 0; ci < cinfo.num_components; ci++) {
+            component &c = comps[ci];
+            c.h_samp = cinfo.comp_info[ci].h_samp_factor;
+            c.v_samp = cinfo.comp_info[ci].v_samp_factor;
+            c.blocks_w = mcus_x*c.h_samp;
+            c.blocks_h = mcus_y*c.v_samp;
+            c.blocks.resize(c.blocks_w*c.blocks_h*DCTSIZE2);
+        }
+    }
+}
+
+// Compresses the pixels of MCU rect 'mcus' on their own and reads the
+// quantized coefficients of its stale MCUs back into the cache. An MCU's
+// coefficients only depend on its own pixels, so they come out the same as
+// in a full encode. Fresh MCUs in the rect are left alone, their pixels may
+// not even be in 'rgb' yet (see place()). libjpeg errors are thrown, for
+// encode() to clean up after.
+void JpegCoefCanvas::recompute(unsigned char *rgb, const Rect &mcus,
+    const std::vector<unsigned long> &snapshot, double *size_hint)
+{
+    JpegEncoder encoder(rgb, width, height, quality, BUF_RGB);
+    encoder.set_subsampling(subsampling);
+    encoder.set_size_hint(*size_hint);
+    encoder.setRect(align(Rect(mcus.x*mcu_w, mcus.y*mcu_h, mcus.w*mcu_w, mcus.h*mcu_h)));
+    encoder.encode();
+
+    // Landing here rather than in encode() lets the throw free the encoder.
+    if (setjmp(cerr.jump))
+        throw jpeg_error_message((j_common_ptr)&cinfo);
+    if (setjmp(derr.jump))
+        throw jpeg_error_message((j_common_ptr)&dinfo);
+
+    jpeg_mem_src(&dinfo, (unsigned char *)encoder.get_jpeg(), encoder.get_jpeg_len());
+    jpeg_read_header(&dinfo, TRUE);
+    jvirt_barray_ptr *arrays = jpeg_read_coefficients(&dinfo);
+
+    configure(width, height);
+
+    for (int ci = 0; ci < dinfo.num_components; ci++) {
+        component &c = comps[ci];
+        for (int by = 0; by < mcus.h*c.v_samp; by++) {
+            JBLOCKARRAY row = (*dinfo.mem->access_virt_barray)(
+                (j_common_ptr)&dinfo, arrays[ci], by, 1, FALSE);
+            int my = mcus.y + by/c.v_samp;
+
+            for (int mx = mcus.x; mx < mcus.x + mcus.w; ) {
+                if (is_fresh(my*mcus_x + mx, snapshot)) {
+                    mx++;
+                    continue;
+                }
+                int first = mx;
+                while (mx < mcus.x + mcus.w && !is_fresh(my*mcus_x + mx, snapshot))
+                    mx++;
+                memcpy(
+                    &c.blocks[((mcus.y*c.v_samp + by)*c.blocks_w + first*c.h_samp)*DCTSIZE2],
+                    row[0][(first - mcus.x)*c.h_samp],
+                    (mx - first)*c.h_samp*sizeof(JBLOCK)
+                );
+            }
+        }
+    }
+
+    jpeg_finish_decompress(&dinfo);
+}
+
+// Entropy-codes pixel rect r straight from the cached coefficients.
+void JpegCoefCanvas::write(const Rect &r, double *size_hint, const jpeg_margins &margins,
+    unsigned char **jpeg, unsigned long *jpeg_len)
+{
+    int mx = r.x/mcu_w, my = r.y/mcu_h;
+    int mw = (r.w + mcu_w - 1)/mcu_w, mh = (r.h + mcu_h - 1)/mcu_h;
+
+    if (setjmp(cerr.jump))
+        throw jpeg_error_message((j_common_ptr)&cinfo);
+
+    configure(r.w, r.h);
+
+    if (cinfo.num_components != (int)comps.size())
+        throw "Unexpected component count in JpegCoefCanvas::encode.";
+
+    jvirt_barray_ptr arrays[MAX_COMPONENTS];
+    for (size_t ci = 0; ci < comps.size(); ci++) {
+        arrays[ci] = (*cinfo.mem->request_virt_barray)(
+            (j_common_ptr)&cinfo, JPOOL_IMAGE, FALSE,
+            mw*comps[ci].h_samp, mh*comps[ci].v_samp, comps[ci].v_samp);
+    }
+
+    unsigned long expected = *size_hint > 0
+        ? (unsigned long)(*size_hint*r.w*r.h*1.1) + 1024
+        : jpeg_predict_size(r.w, r.h, quality);
+    jpeg_output_dest_framed(&cinfo, jpeg, jpeg_len, expected, NULL, margins);
+
+    jpeg_write_coefficients(&cinfo, arrays);
+
+    // The arrays are only realized by jpeg_write_coefficients, nothing is
+    // written out before jpeg_finish_compress.
+    for (size_t ci = 0; ci < comps.size(); ci++) {
+        component &c = comps[ci];
+        for (int by = 0; by < mh*c.v_samp; by++) {
+            JBLOCKARRAY row = (*cinfo.mem->access_virt_barray)(
+                (j_common_ptr)&cinfo, arrays[ci], by, 1, TRUE);
+            memcpy(
+                row[0],
+                &c.blocks[((my*c.v_samp + by)*c.blocks_w + mx*c.h_samp)*DCTSIZE2],
+                mw*c.h_samp*sizeof(JBLOCK)
+            );
+        }
+    }
+
+    jpeg_finish_compress(&cinfo);
+
+    *size_hint = (double)*jpeg_len/((double)r.w*r.h);
+}
+
+void JpegCoefCanvas::encode(unsigned char *rgb, const std::vector<unsigned long> &snapshot,
+    int qquality, const Rect &r, double *size_hint, const jpeg_margins &margins,
+    unsigned char **jpeg, unsigned long *jpeg_len)
+{
+    if (r.w <= 0 || r.h <= 0)
+        throw "Nothing to encode in JpegCoefCanvas::encode.";
+
+    uv_mutex_lock(&lock);
+
+    try {
+        if (qquality != quality) {
+            quality = qquality;
+            coef_valid.assign(mcus_x*mcus_y, false);
+        }
+
+        // Gather the stale MCUs of r, a row's worth of runs at a time.
+        DirtyRegion stale;
+        stale.set_overhead(RECOMPUTE_OVERHEAD_MCUS);
+
+        int mx0 = r.x/mcu_w, mx1 = (r.x + r.w + mcu_w - 1)/mcu_w;
+        int my0 = r.y/mcu_h, my1 = (r.y + r.h + mcu_h - 1)/mcu_h;
+        for (int my = my0; my < my1; my++) {
+            for (int mx = mx0; mx < mx1; ) {
+                if (is_fresh(my*mcus_x + mx, snapshot)) {
+                    mx++;
+                    continue;
+                }
+                int first = mx;
+                while (mx < mx1 && !is_fresh(my*mcus_x + mx, snapshot))
+                    mx++;
+                stale.add(Rect(first, my, mx - first, 1));
+            }
+        }
+
+        const std::vector<Rect> &rects = stale.get();
+        for (size_t i = 0; i < rects.size(); i++) {
+            const Rect &mcus = rects[i];
+            recompute(rgb, mcus, snapshot, size_hint);
+            for (int my = mcus.y; my < mcus.y + mcus.h; my++) {
+                for (int mx = mcus.x; mx < mcus.x + mcus.w; mx++) {
+                    coef_serials[my*mcus_x + mx] = snapshot[my*mcus_x + mx];
+                    coef_valid[my*mcus_x + mx] = true;
+                }
+            }
+        }
+
+        write(r, size_hint, margins, jpeg, jpeg_len);
+    }
+    catch (const char *err) {
+        jpeg_abort_decompress(&dinfo);
+        jpeg_abort_compress(&cinfo);
+        coef_valid.assign(mcus_x*mcus_y, false);
+        uv_mutex_unlock(&lock);
+        throw;
+    }
+
+    uv_mutex_unlock(&lock);
+}
+
+bool JpegCoefCanvas::place(const unsigned char *jpeg, size_t jpeg_len,
+    int x, int y, int qquality)
+{
+    if (x % mcu_w || y % mcu_h)
+        return false;
+
+    struct jpeg_decompress_struct tile;
+    jump_error_mgr jerr;
+
+    tile.err = jpeg_jump_error(&jerr);
+
+    if (setjmp(jerr.jump)) {
+        const char *msg = jpeg_error_message((j_common_ptr)&tile);
+        jpeg_destroy_decompress(&tile);
+        uv_mutex_unlock(&lock);
+        throw msg;
+    }
+
+    // From configure(), once the tile exists.
+    if (setjmp(cerr.jump)) {
+        const char *msg = jpeg_error_message((j_common_ptr)&cinfo);
+        jpeg_abort_compress(&cinfo);
+        jpeg_destroy_decompress(&tile);
+        uv_mutex_unlock(&lock);
+        throw msg;
+    }
+
+    uv_mutex_lock(&lock);
+
+    jpeg_create_decompress(&tile);
+    jpeg_mem_src(&tile, (unsigned char *)jpeg, jpeg_len);
+    jpeg_read_header(&tile, TRUE);
+
+    int w = tile.image_width, h = tile.image_height;
+
+    if (qquality != quality) {
+        quality = qquality;
+        coef_valid.assign(mcus_x*mcus_y, false);
+    }
+    configure(width, height);
+
+    // Same color space, sampling and tables as the canvas's own encodes,
+    // and no partial MCU except at the canvas edge, where the canvas pads
+    // the MCU the way the tile did.
+    bool compatible = tile.jpeg_color_space == cinfo.jpeg_color_space
+        && tile.num_components == cinfo.num_components
+        && (w % mcu_w == 0 || x + w == width)
+        && (h % mcu_h == 0 || y + h == height)
+        && x + w <= width && y + h <= height;
+
+    for (int ci = 0; compatible && ci < cinfo.num_components; ci++) {
+        jpeg_component_info *tc = &tile.comp_info[ci];
+        jpeg_component_info *cc = &cinfo.comp_info[ci];
+        JQUANT_TBL *tq = tile.quant_tbl_ptrs[tc->quant_tbl_no];
+        JQUANT_TBL *cq = cinfo.quant_tbl_ptrs[cc->quant_tbl_no];
+        compatible = tc->h_samp_factor == cc->h_samp_factor
+            && tc->v_samp_factor == cc->v_samp_factor
+            && tq && cq
+            && memcmp(tq->quantval, cq->quantval, sizeof(tq->quantval)) == 0;
+    }
+
+    if (!compatible) {
+        jpeg_destroy_decompress(&tile);
+        uv_mutex_unlock(&lock);
+        return false;
+    }
+
+    jvirt_barray_ptr *arrays = jpeg_read_coefficients(&tile);
+
+    int mx = x/mcu_w, my = y/mcu_h;
+    int mw = (w + mcu_w - 1)/mcu_w, mh = (h + mcu_h - 1)/mcu_h;
+
+    for (int ci = 0; ci < tile.num_components; ci++) {
+        component &c = comps[ci];
+        for (int by = 0; by < mh*c.v_samp; by++) {
+            JBLOCKARRAY row = (*tile.mem->access_virt_barray)(
+                (j_common_ptr)&tile, arrays[ci], by, 1, FALSE);
+            memcpy(
+                &c.blocks[((my*c.v_samp + by)*c.blocks_w + mx*c.h_samp)*DCTSIZE2],
+                row[0],
+                mw*c.h_samp*sizeof(JBLOCK)
+            );
+        }
+    }
+
+    jpeg_finish_decompress(&tile);
+    jpeg_destroy_decompress(&tile);
+
+    stamp(Rect(x, y, w, h));
+    for (int j = my; j < my + mh; j++) {
+        for (int i = mx; i < mx + mw; i++) {
+            coef_serials[j*mcus_x + i] = serials[j*mcus_x + i];
+            coef_valid[j*mcus_x + i] = true;
+        }
+    }
+
+    uv_mutex_unlock(&lock);
+    return true;
+}
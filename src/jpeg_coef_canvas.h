@@ -0,0 +1,94 @@
+#ifndef JPEG_COEF_CANVAS_H
+#define JPEG_COEF_CANVAS_H
+
+#include <cstdio>
+#include <jpeglib.h>
+#include <uv.h>
+
+#include <vector>
+
+#include "common.h"
+#include "jpeg_destination.h"
+#include "jpeg_errors.h"
+
+/*
+ * Quantized DCT coefficients of a fixed size RGB canvas.
+ *
+ * Pushes stamp the MCUs they touch with a new serial. An encode recomputes
+ * the coefficients of the MCUs whose serial differs from the cached one
+ * (by compressing just those MCUs and reading the coefficients back) and
+ * then entropy-codes the requested MCU-aligned rect straight from the
+ * cache with jpeg_write_coefficients, skipping color conversion, DCT and
+ * quantization for everything else. The output is the same as a normal
+ * encode of that rect.
+ *
+ * An MCU (16x16 pixels with the default 2x2 chroma subsampling, 8x8 for
+ * 4:4:4 and grayscale) is the smallest unit that can be recomputed, since
+ * its chroma blocks cover all of it. As with JpegRowCache, serials keep
+ * concurrent encodes of different canvas snapshots correct; encodes are
+ * serialized by a mutex.
+ *
+ * place() fills MCUs straight from a JPEG tile that was compressed the way
+ * the canvas would be (same quality tables and sampling, MCU-aligned), so
+ * assembling a mosaic from such tiles only copies blocks.
+ */
+class JpegCoefCanvas {
+    struct component {
+        int h_samp, v_samp;
+        int blocks_w, blocks_h;
+        std::vector<JCOEF> blocks; // DCTSIZE2 per block, row by row
+    };
+
+    int width, height, quality;
+    chroma_subsampling subsampling;
+    int mcu_w, mcu_h, mcus_x, mcus_y;
+
+    std::vector<unsigned long> serials; // per MCU, main thread only
+    unsigned long serial;
+
+    std::vector<unsigned long> coef_serials; // per MCU, serial of the cached blocks
+    std::vector<bool> coef_valid;
+    std::vector<component> comps;
+
+    struct jpeg_compress_struct cinfo;
+    struct jpeg_decompress_struct dinfo;
+    jump_error_mgr cerr, derr; // every user of cinfo/dinfo setjmp()s them
+    uv_mutex_t lock;
+
+    void configure(int w, int h);
+    bool is_fresh(int mcu, const std::vector<unsigned long> &snapshot) const {
+        return coef_valid[mcu] && coef_serials[mcu] == snapshot[mcu];
+    }
+    void recompute(unsigned char *rgb, const Rect &mcus,
+        const std::vector<unsigned long> &snapshot, double *size_hint);
+    void write(const Rect &r, double *size_hint, const jpeg_margins &margins,
+        unsigned char **jpeg, unsigned long *jpeg_len);
+
+public:
+    JpegCoefCanvas(int wwidth, int hheight, chroma_subsampling ssubsampling);
+    ~JpegCoefCanvas();
+
+    // Marks the MCUs overlapped by pixel rect r as changed.
+    void stamp(const Rect &r);
+    const std::vector<unsigned long> &get_serials() const { return serials; }
+
+    // Stamps the MCUs under a jpeg tile pushed at (x, y) and takes their
+    // coefficients from it. Returns false, leaving everything as it was, if
+    // the tile isn't compatible with an encode at 'qquality': the caller
+    // has to push its pixels instead. Must not run during an async encode,
+    // which would recompute and overwrite the tile's blocks.
+    bool place(const unsigned char *jpeg, size_t jpeg_len, int x, int y, int qquality);
+
+    // Grows pixel rect r to MCU boundaries, clipped to the canvas.
+    Rect align(const Rect &r) const;
+
+    // Encodes rect r (as returned by align()) of canvas 'rgb' (width*height*3
+    // bytes) whose MCUs last changed at 'snapshot' serials. Returns a
+    // malloc'd JPEG in *jpeg and *jpeg_len, with 'margins' around it.
+    void encode(unsigned char *rgb, const std::vector<unsigned long> &snapshot,
+        int qquality, const Rect &r, double *size_hint, const jpeg_margins &margins,
+        unsigned char **jpeg, unsigned long *jpeg_len);
+};
+
+#endif
+
@@ -0,0 +1,318 @@
+#include <node.h>
+#include <node_buffer.h>
+#include <cstdlib>
+#include <cstring>
+
+#include "common.h"
+#include "jpeg_decoder.h"
+#include "buffer_compat.h"
+
+using namespace v8;
+using namespace node;
+
+void JpegDecoder::Initialize(v8::Handle<v8::Object> target) {
+
+    Isolate* isolate = target->GetIsolate();
+
+    Local<FunctionTemplate> tpl = FunctionTemplate::New(isolate, New);
+    tpl->SetClassName(String::NewFromUtf8(isolate, "JpegDecoder"));
+    tpl->InstanceTemplate()->SetInternalFieldCount(1);
+
+    NODE_SET_PROTOTYPE_METHOD(tpl, "decode", JpegDecodeAsync);
+    NODE_SET_PROTOTYPE_METHOD(tpl, "decodeSync", JpegDecodeSync);
+    NODE_SET_PROTOTYPE_METHOD(tpl, "setScale", SetScale);
+    NODE_SET_PROTOTYPE_METHOD(tpl, "dimensions", Dimensions);
+
+    target->Set(String::NewFromUtf8(isolate, "JpegDecoder"), tpl->GetFunction());
+
+}
+
+JpegDecoder::JpegDecoder(const unsigned char *jpeg, size_t jpeg_len, buffer_type bbuf_type) :
+    decompressor(jpeg, jpeg_len, bbuf_type) {}
+
+JpegDecoder::~JpegDecoder() {
+    jpeg_buffer.Reset();
+}
+
+// Decodes into 'output' if it's not empty, otherwise into a new Buffer.
+Local<Value> JpegDecoder::JpegDecodeSync( Isolate * isolate, Local<Object> output ) {
+
+    unsigned char *pixels = NULL;
+
+    try {
+        if (!output.IsEmpty()) {
+            decompressor.decode(
+                (unsigned char *)Buffer::Data(output),
+                Buffer::Length(output)
+            );
+            return output;
+        }
+
+        size_t len = decompressor.output_size();
+        pixels = (unsigned char *)malloc(len);
+        if (!pixels) throw "malloc failed in JpegDecoder::JpegDecodeSync.";
+        decompressor.decode(pixels, len);
+
+        return BufferFromMalloc(isolate, (char *)pixels, len);
+    }
+    catch (const char *err) {
+        free(pixels);
+        VException( isolate, err );
+    }
+
+    return Local<Value>();
+}
+
+Local<Value> JpegDecoder::Dimensions( Isolate * isolate ) {
+
+    Local<Object> dim = Object::New(isolate);
+    dim->Set(String::NewFromUtf8(isolate, "width"),
+        Integer::New(isolate, decompressor.get_output_width()));
+    dim->Set(String::NewFromUtf8(isolate, "height"),
+        Integer::New(isolate, decompressor.get_output_height()));
+    dim->Set(String::NewFromUtf8(isolate, "imageWidth"),
+        Integer::New(isolate, decompressor.get_width()));
+    dim->Set(String::NewFromUtf8(isolate, "imageHeight"),
+        Integer::New(isolate, decompressor.get_height()));
+
+    return dim;
+}
+
+// Throws, leaving the old scale in place, if libjpeg can't scale by
+// num/denom.
+void JpegDecoder::SetScale(int num, int denom) {
+
+    JpegDecompressor scaled = decompressor;
+    scaled.set_scale(num, denom);
+    scaled.read_header();
+    decompressor = scaled;
+
+}
+
+void JpegDecoder::New(const FunctionCallbackInfo<Value>& args) {
+
+    Isolate* isolate = args.GetIsolate();
+
+    if (args.Length() < 1 || args.Length() > 2) {
+        VException( isolate, "One or two arguments required - jpeg buffer and [buffer type]" );
+        return;
+    }
+
+    if (!Buffer::HasInstance(args[0])) {
+        VException( isolate, "First argument must be Buffer." );
+        return;
+    }
+
+    buffer_type buf_type = BUF_RGB;
+
+    if (args.Length() == 2) {
+        String::Utf8Value str(args[1]);
+        if (!args[1]->IsString() || !parse_buffer_type(*str, &buf_type) || is_yuv(buf_type)) {
+            VException( isolate, "Buffer type must be 'rgb', 'bgr', 'rgba' or 'bgra'." );
+            return;
+        }
+    }
+
+    Local<Object> buffer = args[0]->ToObject();
+    JpegDecoder *decoder = new JpegDecoder(
+        (unsigned char *)Buffer::Data(buffer),
+        Buffer::Length(buffer),
+        buf_type
+    );
+
+    try {
+        decoder->decompressor.read_header();
+    }
+    catch (const char *err) {
+        delete decoder;
+        VException( isolate, err );
+        return;
+    }
+
+    decoder->jpeg_buffer.Reset(isolate, buffer);
+    decoder->Wrap(args.This());
+
+}
+
+void JpegDecoder::JpegDecodeSync(const FunctionCallbackInfo<Value>& args) {
+
+    Isolate* isolate = args.GetIsolate();
+
+    Local<Object> output;
+    if (args.Length() > 0) {
+        if (!Buffer::HasInstance(args[0])) {
+            VException( isolate, "First argument must be Buffer." );
+            return;
+        }
+        output = args[0]->ToObject();
+    }
+
+    JpegDecoder *decoder = ObjectWrap::Unwrap<JpegDecoder>(args.This());
+    Local<Value> pixels = decoder->JpegDecodeSync( isolate, output );
+    if (!pixels.IsEmpty())
+        args.GetReturnValue().Set(pixels);
+
+}
+
+void JpegDecoder::SetScale(const FunctionCallbackInfo<Value>& args) {
+
+    Isolate* isolate = args.GetIsolate();
+
+    if (args.Length() != 2) {
+        VException( isolate, "Two arguments required - scale numerator and denominator" );
+        return;
+    }
+
+    if (!args[0]->IsInt32() || !args[1]->IsInt32()) {
+        VException( isolate, "Scale numerator and denominator must be integers" );
+        return;
+    }
+
+    int num = args[0]->Int32Value();
+    int denom = args[1]->Int32Value();
+
+    if (num < 1 || denom < 1) {
+        VException( isolate, "Scale numerator and denominator must be greater than 0." );
+        return;
+    }
+
+    JpegDecoder *decoder = ObjectWrap::Unwrap<JpegDecoder>(args.This());
+
+    try {
+        decoder->SetScale(num, denom);
+    }
+    catch (const char *err) {
+        VException( isolate, err );
+        return;
+    }
+
+    Undefined( isolate );
+
+}
+
+void JpegDecoder::Dimensions(const FunctionCallbackInfo<Value>& args) {
+
+    JpegDecoder *decoder = ObjectWrap::Unwrap<JpegDecoder>(args.This());
+    args.GetReturnValue().Set(decoder->Dimensions( args.GetIsolate() ));
+
+}
+
+void JpegDecoder::UV_JpegDecode(uv_work_t *req) {
+
+    decode_request *dec_req = (decode_request *)req->data;
+
+    try {
+        if (!dec_req->pixels) {
+            dec_req->pixels_len = dec_req->decompressor.output_size();
+            dec_req->pixels = (unsigned char *)malloc(dec_req->pixels_len);
+            if (!dec_req->pixels) throw "malloc failed in JpegDecoder::UV_JpegDecode.";
+        }
+        dec_req->decompressor.decode(dec_req->pixels, dec_req->pixels_len);
+    }
+    catch (const char *err) {
+        dec_req->error = strdup(err);
+    }
+}
+
+void JpegDecoder::UV_JpegDecodeAfter(uv_work_t *req) {
+
+    decode_request *dec_req = (decode_request *)req->data;
+    Isolate *isolate = dec_req->isolate;
+    HandleScope scope(isolate);
+    delete req;
+
+    JpegDecoder *decoder = (JpegDecoder *)dec_req->decoder_obj;
+    bool owned = dec_req->output.IsEmpty();
+
+    Handle<Value> argv[3];
+
+    if (dec_req->error) {
+        argv[0] = Undefined( isolate );
+        argv[1] = Undefined( isolate );
+        argv[2] = ErrorException( isolate, dec_req->error );
+    }
+    else {
+        if (owned) {
+            // the Buffer takes ownership of the decoded pixels
+            argv[0] = BufferFromMalloc(isolate, (char *)dec_req->pixels, dec_req->pixels_len);
+            dec_req->pixels = NULL;
+        }
+        else {
+            argv[0] = Local<Object>::New(isolate, dec_req->output);
+        }
+
+        Local<Object> dim = Object::New(isolate);
+        dim->Set(String::NewFromUtf8(isolate, "width"),
+            Integer::New(isolate, dec_req->decompressor.get_output_width()));
+        dim->Set(String::NewFromUtf8(isolate, "height"),
+            Integer::New(isolate, dec_req->decompressor.get_output_height()));
+        argv[1] = dim;
+        argv[2] = Undefined( isolate );
+    }
+
+    TryCatch try_catch( isolate );
+
+    Local<Function>::New(isolate, dec_req->callback)->Call( Null( isolate ), 3, argv );
+
+    if (try_catch.HasCaught()) {
+        FatalException( isolate, try_catch );
+    }
+
+    dec_req->callback.Reset();
+    dec_req->output.Reset();
+    if (owned)
+        free(dec_req->pixels);
+    free(dec_req->error);
+
+    decoder->Unref();
+    delete dec_req;
+}
+
+// decoder.decode([buffer], callback) - callback(pixels, dims, error)
+void JpegDecoder::JpegDecodeAsync(const FunctionCallbackInfo<Value>& args) {
+
+    Isolate* isolate = args.GetIsolate();
+
+    if (args.Length() < 1 || args.Length() > 2) {
+        VException( isolate, "One or two arguments required - [output buffer] and callback function." );
+        return;
+    }
+
+    if (args.Length() == 2 && !Buffer::HasInstance(args[0])) {
+        VException( isolate, "First argument must be Buffer." );
+        return;
+    }
+
+    if (!args[args.Length() - 1]->IsFunction()) {
+        VException( isolate, "Last argument must be a function." );
+        return;
+    }
+
+    Local<Function> callback = Local<Function>::Cast(args[args.Length() - 1]);
+    JpegDecoder *decoder = ObjectWrap::Unwrap<JpegDecoder>(args.This());
+
+    decode_request *dec_req = new decode_request(decoder->decompressor);
+
+    dec_req->callback.Reset(isolate, callback);
+    dec_req->isolate = isolate;
+    dec_req->decoder_obj = decoder;
+    dec_req->pixels = NULL;
+    dec_req->pixels_len = 0;
+    dec_req->error = NULL;
+
+    if (args.Length() == 2) {
+        Local<Object> output = args[0]->ToObject();
+        dec_req->output.Reset(isolate, output);
+        dec_req->pixels = (unsigned char *)Buffer::Data(output);
+        dec_req->pixels_len = Buffer::Length(output);
+    }
+
+    uv_work_t* req = new uv_work_t;
+    req->data = dec_req;
+    uv_queue_work(uv_default_loop(), req, UV_JpegDecode, (uv_after_work_cb)UV_JpegDecodeAfter);
+
+    decoder->Ref();
+
+    Undefined( isolate );
+
+}
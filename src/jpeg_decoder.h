@@ -0,0 +1,57 @@
+#ifndef JPEG_DECODER_H
+#define JPEG_DECODER_H
+
+#include <node.h>
+#include <node_buffer.h>
+#include <node_object_wrap.h>
+
+#include <uv.h>
+
+#include "common.h"
+#include "jpeg_decompressor.h"
+
+using v8::Function;
+using v8::FunctionCallbackInfo;
+using v8::FunctionTemplate;
+using v8::Isolate;
+using v8::Value;
+
+struct decode_request {
+    v8::Persistent<v8::Function> callback;
+    v8::Persistent<v8::Object> output; // caller's buffer, if given
+    v8::Isolate * isolate;
+    void *decoder_obj;
+    JpegDecompressor decompressor; // settings as of the decode call
+    unsigned char *pixels;
+    size_t pixels_len;
+    char *error;
+
+    decode_request(const JpegDecompressor &d) : decompressor(d) {}
+};
+
+class JpegDecoder : public node::ObjectWrap {
+    JpegDecompressor decompressor;
+    v8::Persistent<v8::Object> jpeg_buffer; // keeps the compressed data alive
+
+    static void UV_JpegDecode(uv_work_t *req);
+    static void UV_JpegDecodeAfter(uv_work_t *req);
+
+public:
+    static void Initialize(v8::Handle<v8::Object> target);
+
+    JpegDecoder(const unsigned char *jpeg, size_t jpeg_len, buffer_type bbuf_type);
+    ~JpegDecoder();
+
+    v8::Local<v8::Value> JpegDecodeSync( Isolate * isolate, v8::Local<v8::Object> output );
+    v8::Local<v8::Value> Dimensions( Isolate * isolate );
+    void SetScale(int num, int denom);
+
+    static void New(const FunctionCallbackInfo<Value>& args);
+    static void JpegDecodeSync(const FunctionCallbackInfo<Value>& args);
+    static void JpegDecodeAsync(const FunctionCallbackInfo<Value>& args);
+    static void SetScale(const FunctionCallbackInfo<Value>& args);
+    static void Dimensions(const FunctionCallbackInfo<Value>& args);
+};
+
+#endif
+
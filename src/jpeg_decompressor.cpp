@@ -0,0 +1,179 @@
+#include <cstdlib>
+#include <cstring>
+
+#include "jpeg_decompressor.h"
+#include "jpeg_errors.h"
+
+// Rows handed to jpeg_read_scanlines at a time.
+#define SCANLINE_BATCH 16
+
+#ifndef JCS_EXTENSIONS
+// Turns a row decoded as RGB into buf_type in place. RGBA/BGRA rows are
+// expanded back to front so no pixel is overwritten before it's read.
+static void
+rgb_to_buf_type_row(unsigned char *row, int pixels, buffer_type buf_type)
+{
+    switch (buf_type) {
+    case BUF_BGR:
+        for (int i = 0; i < pixels; i++) {
+            unsigned char r = row[i*3];
+            row[i*3] = row[i*3 + 2];
+            row[i*3 + 2] = r;
+        }
+        break;
+
+    case BUF_RGBA:
+    case BUF_BGRA:
+        for (int i = pixels - 1; i >= 0; i--) {
+            unsigned char r = row[i*3], g = row[i*3 + 1], b = row[i*3 + 2];
+            row[i*4] = buf_type == BUF_RGBA ? r : b;
+            row[i*4 + 1] = g;
+            row[i*4 + 2] = buf_type == BUF_RGBA ? b : r;
+            row[i*4 + 3] = 0xFF;
+        }
+        break;
+
+    default:
+        break;
+    }
+}
+#endif
+
+JpegDecompressor::JpegDecompressor(const unsigned char *jjpeg, size_t jjpeg_len,
+    buffer_type bbuf_type)
+    :
+    jpeg(jjpeg), jpeg_len(jjpeg_len), buf_type(bbuf_type),
+    scale_num(1), scale_denom(1),
+    width(0), height(0), out_width(0), out_height(0) {}
+
+// Applies scaling and output color space to a decompressor that has read
+// the header.
+void
+JpegDecompressor::configure(j_decompress_ptr cinfo) const
+{
+    cinfo->scale_num = scale_num;
+    cinfo->scale_denom = scale_denom;
+
+#ifdef JCS_EXTENSIONS
+    switch (buf_type) {
+    case BUF_RGB: cinfo->out_color_space = JCS_RGB; break;
+    case BUF_BGR: cinfo->out_color_space = JCS_EXT_BGR; break;
+#ifdef JCS_ALPHA_EXTENSIONS
+    case BUF_RGBA: cinfo->out_color_space = JCS_EXT_RGBA; break;
+    case BUF_BGRA: cinfo->out_color_space = JCS_EXT_BGRA; break;
+#else
+    case BUF_RGBA: cinfo->out_color_space = JCS_EXT_RGBX; break;
+    case BUF_BGRA: cinfo->out_color_space = JCS_EXT_BGRX; break;
+#endif
+    // Decoding to YUV isn't offered, callers reject those types.
+    default: break;
+    }
+#else
+    cinfo->out_color_space = JCS_RGB;
+#endif
+}
+
+void
+JpegDecompressor::read_header()
+{
+    struct jpeg_decompress_struct cinfo;
+    jump_error_mgr jerr;
+
+    cinfo.err = jpeg_jump_error(&jerr);
+
+    if (setjmp(jerr.jump)) {
+        const char *msg = jpeg_error_message((j_common_ptr)&cinfo);
+        jpeg_destroy_decompress(&cinfo);
+        throw msg;
+    }
+
+    jpeg_create_decompress(&cinfo);
+    jpeg_mem_src(&cinfo, (unsigned char *)jpeg, jpeg_len);
+    jpeg_read_header(&cinfo, TRUE);
+    configure(&cinfo);
+    jpeg_calc_output_dimensions(&cinfo);
+
+    width = cinfo.image_width;
+    height = cinfo.image_height;
+    out_width = cinfo.output_width;
+    out_height = cinfo.output_height;
+
+    jpeg_destroy_decompress(&cinfo);
+}
+
+// Scales the output by num/denom. libjpeg-turbo supports num/8 for num from
+// 1 to 16, the classic scales being 1/2, 1/4 and 1/8. Call read_header()
+// again to update the output dimensions.
+void
+JpegDecompressor::set_scale(int num, int denom)
+{
+    scale_num = num;
+    scale_denom = denom;
+}
+
+void
+JpegDecompressor::set_buf_type(buffer_type bbuf_type)
+{
+    buf_type = bbuf_type;
+}
+
+size_t
+JpegDecompressor::output_size() const
+{
+    return (size_t)out_width*out_height*bytes_per_pixel(buf_type);
+}
+
+void
+JpegDecompressor::decode(unsigned char *out, size_t out_len)
+{
+    if (out_len < output_size())
+        throw "Output buffer is too small for the decoded image.";
+
+    decode_rows(out, (size_t)out_width*bytes_per_pixel(buf_type));
+}
+
+void
+JpegDecompressor::decode_rows(unsigned char *out, size_t row_stride)
+{
+    struct jpeg_decompress_struct cinfo;
+    jump_error_mgr jerr;
+    JSAMPROW row_pointers[SCANLINE_BATCH];
+
+    cinfo.err = jpeg_jump_error(&jerr);
+
+    if (setjmp(jerr.jump)) {
+        const char *msg = jpeg_error_message((j_common_ptr)&cinfo);
+        jpeg_destroy_decompress(&cinfo);
+        throw msg;
+    }
+
+    jpeg_create_decompress(&cinfo);
+    jpeg_mem_src(&cinfo, (unsigned char *)jpeg, jpeg_len);
+    jpeg_read_header(&cinfo, TRUE);
+    configure(&cinfo);
+    jpeg_start_decompress(&cinfo);
+
+    if ((int)cinfo.output_width != out_width || (int)cinfo.output_height != out_height) {
+        jpeg_destroy_decompress(&cinfo);
+        throw "JPEG dimensions changed since read_header.";
+    }
+
+    while (cinfo.output_scanline < cinfo.output_height) {
+        int rows = cinfo.output_height - cinfo.output_scanline;
+        if (rows > SCANLINE_BATCH)
+            rows = SCANLINE_BATCH;
+        for (int i = 0; i < rows; i++)
+            row_pointers[i] = &out[(cinfo.output_scanline + i)*row_stride];
+        jpeg_read_scanlines(&cinfo, row_pointers, rows);
+    }
+
+    jpeg_finish_decompress(&cinfo);
+    jpeg_destroy_decompress(&cinfo);
+
+#ifndef JCS_EXTENSIONS
+    if (buf_type != BUF_RGB) {
+        for (int y = 0; y < out_height; y++)
+            rgb_to_buf_type_row(&out[y*row_stride], out_width, buf_type);
+    }
+#endif
+}
@@ -0,0 +1,57 @@
+#ifndef JPEG_DECOMPRESSOR_H
+#define JPEG_DECOMPRESSOR_H
+
+#include <cstdio>
+#include <cstddef>
+#include <jpeglib.h>
+#include "common.h"
+
+/*
+ * Decodes a JPEG held in memory into RGB, BGR, RGBA or BGRA pixels.
+ *
+ * set_scale() maps to libjpeg's scale_num/scale_denom, so 1/2, 1/4 and 1/8
+ * decodes run a reduced IDCT instead of decoding at full size and
+ * resampling. libjpeg errors on corrupt input are turned into exceptions;
+ * their message stays valid until the thread's next decoder error.
+ * The object doesn't own the JPEG data; copies of it can decode the same
+ * data concurrently.
+ */
+class JpegDecompressor {
+    const unsigned char *jpeg;
+    size_t jpeg_len;
+    buffer_type buf_type;
+    int scale_num, scale_denom;
+
+    int width, height;         // of the image
+    int out_width, out_height; // of the decoded pixels, after scaling
+
+    void configure(j_decompress_ptr cinfo) const;
+
+public:
+    JpegDecompressor(const unsigned char *jjpeg, size_t jjpeg_len, buffer_type bbuf_type);
+
+    // Reads the header and computes the output dimensions. Throws if the
+    // data isn't a JPEG libjpeg can decode.
+    void read_header();
+
+    void set_scale(int num, int denom);
+    void set_buf_type(buffer_type bbuf_type);
+
+    int get_width() const { return width; }
+    int get_height() const { return height; }
+    int get_output_width() const { return out_width; }
+    int get_output_height() const { return out_height; }
+
+    // Bytes decode() writes: output width * height * bytes per pixel.
+    size_t output_size() const;
+
+    // Decodes into 'out', which must hold at least output_size() bytes.
+    void decode(unsigned char *out, size_t out_len);
+
+    // Decodes output row y to out + y*row_stride, e.g. straight into a
+    // rectangle of a larger canvas. The caller makes sure it fits.
+    void decode_rows(unsigned char *out, size_t row_stride);
+};
+
+#endif
+
@@ -0,0 +1,224 @@
+#include <cstdlib>
+
+#include "jpeg_destination.h"
+
+#define MIN_OUTPUT_SIZE 4096
+#define MIN_GROWTH (64*1024)
+
+typedef struct {
+    struct jpeg_destination_mgr pub; /* public fields */
+
+    unsigned char **outbuffer;  /* target buffer */
+    unsigned long *outsize;
+    int *reallocs;
+    JOCTET *buffer;             /* start of buffer */
+    size_t bufsize;
+    size_t expected_size;
+    jpeg_margins margins;       /* kept free around the jpeg */
+    jpeg_chunk_sink sink;       /* streamed output goes here */
+    void *sink_arg;
+    unsigned long streamed;     /* bytes handed to the sink */
+} output_destination_mgr;
+
+typedef output_destination_mgr *output_dest_ptr;
+
+static void
+init_output_destination(j_compress_ptr cinfo)
+{
+    output_dest_ptr dest = (output_dest_ptr) cinfo->dest;
+
+    dest->bufsize = dest->expected_size;
+    if (dest->bufsize < MIN_OUTPUT_SIZE)
+        dest->bufsize = MIN_OUTPUT_SIZE;
+    dest->bufsize += dest->margins.head;
+
+    dest->buffer = (JOCTET *)malloc(dest->bufsize);
+    if (dest->buffer == NULL)
+        throw "malloc failed in init_output_destination";
+
+    // Owned by the caller from here on, so it's freed even if the encode
+    // is abandoned halfway through.
+    *dest->outbuffer = dest->buffer;
+    *dest->outsize = 0;
+
+    dest->pub.next_output_byte = dest->buffer + dest->margins.head;
+    dest->pub.free_in_buffer = dest->bufsize - dest->margins.head;
+}
+
+static boolean
+empty_output_buffer(j_compress_ptr cinfo)
+{
+    output_dest_ptr dest = (output_dest_ptr) cinfo->dest;
+
+    size_t growth = dest->bufsize/2;
+    if (growth < MIN_GROWTH)
+        growth = MIN_GROWTH;
+    size_t nextsize = dest->bufsize + growth;
+
+    JOCTET *nextbuffer = (JOCTET *)realloc(dest->buffer, nextsize);
+    if (nextbuffer == NULL)
+        throw "realloc failed in empty_output_buffer";
+
+    dest->pub.next_output_byte = nextbuffer + dest->bufsize;
+    dest->pub.free_in_buffer = nextsize - dest->bufsize;
+
+    dest->buffer = nextbuffer;
+    dest->bufsize = nextsize;
+    *dest->outbuffer = nextbuffer;
+
+    if (dest->reallocs)
+        (*dest->reallocs)++;
+
+    return TRUE;
+}
+
+static void
+term_output_destination(j_compress_ptr cinfo)
+{
+    output_dest_ptr dest = (output_dest_ptr) cinfo->dest;
+    size_t used = dest->bufsize - dest->pub.free_in_buffer;
+    size_t wanted = used + dest->margins.tail;
+
+    // The buffer is handed to a Node Buffer as is, so don't let it pin a
+    // generous prediction's worth of unused memory. It also has to make
+    // room for the tail margin if the jpeg ran up to its end.
+    if (used > 0 && (dest->bufsize < wanted || dest->bufsize - wanted > wanted/4)) {
+        JOCTET *trimmed = (JOCTET *)realloc(dest->buffer, wanted);
+        if (trimmed)
+            dest->buffer = trimmed;
+        else if (dest->bufsize < wanted)
+            throw "realloc failed in term_output_destination";
+    }
+
+    *dest->outbuffer = dest->buffer;
+    *dest->outsize = used - dest->margins.head;
+}
+
+static void
+init_chunked_destination(j_compress_ptr cinfo)
+{
+    output_dest_ptr dest = (output_dest_ptr) cinfo->dest;
+
+    dest->buffer = (JOCTET *)malloc(dest->bufsize);
+    if (dest->buffer == NULL)
+        throw "malloc failed in init_chunked_destination";
+    *dest->outbuffer = dest->buffer;
+    dest->streamed = 0;
+
+    dest->pub.next_output_byte = dest->buffer;
+    dest->pub.free_in_buffer = dest->bufsize;
+}
+
+static boolean
+empty_chunked_buffer(j_compress_ptr cinfo)
+{
+    output_dest_ptr dest = (output_dest_ptr) cinfo->dest;
+
+    // libjpeg only asks once the chunk is completely full.
+    JOCTET *full = dest->buffer;
+    dest->buffer = (JOCTET *)malloc(dest->bufsize);
+    if (dest->buffer == NULL) {
+        dest->buffer = full;
+        throw "malloc failed in empty_chunked_buffer";
+    }
+    *dest->outbuffer = dest->buffer;
+
+    dest->sink(dest->sink_arg, full, dest->bufsize);
+    dest->streamed += dest->bufsize;
+
+    dest->pub.next_output_byte = dest->buffer;
+    dest->pub.free_in_buffer = dest->bufsize;
+
+    return TRUE;
+}
+
+static void
+term_chunked_destination(j_compress_ptr cinfo)
+{
+    output_dest_ptr dest = (output_dest_ptr) cinfo->dest;
+    size_t used = dest->bufsize - dest->pub.free_in_buffer;
+
+    *dest->outbuffer = NULL;
+    if (used > 0) {
+        // Not worth trimming, the chunk is short-lived.
+        dest->sink(dest->sink_arg, dest->buffer, used);
+        dest->streamed += used;
+    }
+    else {
+        free(dest->buffer);
+    }
+    dest->buffer = NULL;
+
+    *dest->outsize = dest->streamed;
+}
+
+void
+jpeg_output_dest(j_compress_ptr cinfo, unsigned char **outbuffer,
+    unsigned long *outsize, unsigned long expected_size, int *reallocs)
+{
+    jpeg_output_dest_framed(cinfo, outbuffer, outsize, expected_size, reallocs,
+        jpeg_margins());
+}
+
+void
+jpeg_output_dest_framed(j_compress_ptr cinfo, unsigned char **outbuffer,
+    unsigned long *outsize, unsigned long expected_size, int *reallocs,
+    const jpeg_margins &margins)
+{
+    output_dest_ptr dest;
+
+    /* The destination object is made permanent so that a reused compressor
+     * keeps the same one across images.
+     */
+    if (cinfo->dest == NULL) {
+        cinfo->dest = (struct jpeg_destination_mgr *)
+            (*cinfo->mem->alloc_small) ((j_common_ptr) cinfo, JPOOL_PERMANENT,
+                sizeof(output_destination_mgr));
+    }
+
+    dest = (output_dest_ptr) cinfo->dest;
+    dest->pub.init_destination = init_output_destination;
+    dest->pub.empty_output_buffer = empty_output_buffer;
+    dest->pub.term_destination = term_output_destination;
+    dest->outbuffer = outbuffer;
+    dest->outsize = outsize;
+    dest->reallocs = reallocs;
+    dest->buffer = NULL;
+    dest->bufsize = 0;
+    dest->expected_size = expected_size;
+    dest->margins = margins;
+}
+
+void
+jpeg_chunked_dest(j_compress_ptr cinfo, unsigned char **outbuffer,
+    unsigned long *outsize, size_t chunk_size, jpeg_chunk_sink sink, void *arg)
+{
+    // Shares the permanent destination object with jpeg_output_dest.
+    jpeg_output_dest(cinfo, outbuffer, outsize, 0, NULL);
+
+    output_dest_ptr dest = (output_dest_ptr) cinfo->dest;
+    dest->pub.init_destination = init_chunked_destination;
+    dest->pub.empty_output_buffer = empty_chunked_buffer;
+    dest->pub.term_destination = term_chunked_destination;
+    dest->bufsize = chunk_size;
+    dest->sink = sink;
+    dest->sink_arg = arg;
+}
+
+unsigned long
+jpeg_predict_size(int width, int height, int quality)
+{
+    // Approximate bits per pixel of photographic content with 2x2 chroma
+    // subsampling at quality 0, 10, 20, ..., 100.
+    static const double bpp[] = {
+        0.15, 0.3, 0.45, 0.6, 0.7, 0.8, 0.95, 1.2, 1.6, 2.4, 5.5
+    };
+
+    if (quality < 0) quality = 0;
+    if (quality > 100) quality = 100;
+    int i = quality/10;
+    double frac = (quality%10)/10.0;
+    double b = i < 10 ? bpp[i] + (bpp[i+1] - bpp[i])*frac : bpp[10];
+
+    return (unsigned long)((double)width*height*b/8) + 1024;
+}
@@ -0,0 +1,52 @@
+#ifndef JPEG_DESTINATION_H
+#define JPEG_DESTINATION_H
+
+#include <cstdio>
+#include <jpeglib.h>
+
+// Room a container wants around a jpeg in the same buffer, so it can frame
+// the image in place: 'head' bytes before it and 'tail' bytes after it.
+struct jpeg_margins {
+    size_t head, tail;
+    jpeg_margins() : head(0), tail(0) {}
+    jpeg_margins(size_t hhead, size_t ttail) : head(hhead), tail(ttail) {}
+};
+
+/*
+ * In-memory destination manager.
+ *
+ * Works like libjpeg's jpeg_mem_dest, except that the buffer starts out at
+ * 'expected_size' instead of 4 KB and grows by at least half its size with
+ * realloc, so a well predicted encode never reallocates and a badly predicted
+ * one only a couple of times. The finished buffer is malloc'd, trimmed to
+ * roughly the data written, and belongs to the caller (*outbuffer,
+ * *outsize). Every growth step is counted in *reallocs if it's not NULL.
+ */
+void jpeg_output_dest(j_compress_ptr cinfo, unsigned char **outbuffer,
+    unsigned long *outsize, unsigned long expected_size, int *reallocs);
+
+// Same, but the jpeg starts margins.head bytes into *outbuffer and at least
+// margins.tail bytes are left after it. *outsize counts the jpeg only.
+void jpeg_output_dest_framed(j_compress_ptr cinfo, unsigned char **outbuffer,
+    unsigned long *outsize, unsigned long expected_size, int *reallocs,
+    const jpeg_margins &margins);
+
+// Receives the chunks of a streamed encode, in order. Takes ownership of
+// the malloc'd 'chunk'. Called on the encoding thread.
+typedef void (*jpeg_chunk_sink)(void *arg, unsigned char *chunk, size_t len);
+
+/*
+ * Streaming variant: the output goes into chunk_size byte buffers, each
+ * handed to 'sink' as soon as libjpeg has filled it, and the last, partly
+ * filled one from jpeg_finish_compress. Until then the chunk being filled
+ * is in *outbuffer, owned by the caller in case the encode is abandoned;
+ * afterwards *outbuffer is NULL and *outsize the total length.
+ */
+void jpeg_chunked_dest(j_compress_ptr cinfo, unsigned char **outbuffer,
+    unsigned long *outsize, size_t chunk_size, jpeg_chunk_sink sink, void *arg);
+
+// Rough size of a w x h image compressed at 'quality', from typical bits
+// per pixel at that quality. Used when there's no earlier encode to go by.
+unsigned long jpeg_predict_size(int width, int height, int quality);
+
+#endif
@@ -1,182 +1,583 @@
+#include <atomic>
+
 #include "jpeg_encoder.h"
+#include "jpeg_destination.h"
+#include "jpeg_errors.h"
+#include "jpeg_segments.h"
+#include "parallel.h"
 
 JpegEncoder::JpegEncoder(unsigned char *ddata, int wwidth, int hheight,
     int qquality, buffer_type bbuf_type)
     :
-      data(ddata), width(wwidth), height(hheight), quality(qquality), smoothing(0),
+      data(ddata), width(wwidth), height(hheight), stride(row_bytes(bbuf_type, wwidth)),
+    quality(qquality), smoothing(0),
+    threads(1), restart_rows(false), subsampling(SUBSAMPLE_420), size_hint(0), reallocs(0),
     buf_type(bbuf_type),
     jpeg(NULL), jpeg_len(0),
-    offset(0, 0, 0, 0) {}
+    offset(0, 0, 0, 0),
+    chunk_size(0), chunk_sink(NULL), chunk_arg(NULL) {}
+
+// Copies the source and the settings, not the output.
+JpegEncoder::JpegEncoder(const JpegEncoder &other) :
+    width(other.width), height(other.height), stride(other.stride),
+    quality(other.quality), smoothing(other.smoothing), threads(other.threads),
+    restart_rows(other.restart_rows), subsampling(other.subsampling),
+    size_hint(other.size_hint), reallocs(0), buf_type(other.buf_type), data(other.data),
+    jpeg(NULL), jpeg_len(0),
+    offset(other.offset), margins(other.margins),
+    chunk_size(other.chunk_size), chunk_sink(other.chunk_sink), chunk_arg(other.chunk_arg) {}
 
 JpegEncoder::~JpegEncoder() {
     free(jpeg);
 }
 
-#if JPEG_LIB_VERSION < 80
-// copied over from latest libjpeg
 
-#define OUTPUT_BUF_SIZE 4096
+// Number of scanlines converted and handed to jpeg_write_scanlines at a time
+// when the input has to be converted to RGB. 16 rows is one iMCU row for the
+// default 2x2 chroma subsampling.
+#define SCANLINE_BATCH 16
 
-typedef struct {
-  struct jpeg_destination_mgr pub; /* public fields */
+// Parallel encodes never cut the image into stripes shorter than this many
+// MCU rows; below that the thread start-up costs more than it saves.
+#define MIN_STRIPE_MCU_ROWS 8
 
-  unsigned char ** outbuffer;	/* target buffer */
-  unsigned long * outsize;
-  unsigned char * newbuffer;	/* newly allocated buffer */
-  JOCTET * buffer;		/* start of buffer */
-  size_t bufsize;
-} my_mem_destination_mgr;
-
-typedef my_mem_destination_mgr * my_mem_dest_ptr;
+// YUV input is compressed as it is sampled, only dropping its chroma for
+// grayscale: I420 and NV12 are 4:2:0, YUYV is 4:2:2.
+chroma_subsampling
+JpegEncoder::effective_subsampling() const
+{
+    if (!is_yuv(buf_type) || subsampling == SUBSAMPLE_GRAY)
+        return subsampling;
+    return buf_type == BUF_YUYV ? SUBSAMPLE_422 : SUBSAMPLE_420;
+}
 
-void
-init_mem_destination (j_compress_ptr cinfo)
+// Size in pixels of one MCU: 8x8 times the luma sampling factors.
+int
+JpegEncoder::mcu_width() const
 {
-  /* no work necessary here */
+    chroma_subsampling s = effective_subsampling();
+    return s == SUBSAMPLE_420 || s == SUBSAMPLE_422 ? 16 : 8;
 }
 
-boolean
-empty_mem_output_buffer (j_compress_ptr cinfo)
+int
+JpegEncoder::mcu_height() const
 {
-  size_t nextsize;
-  JOCTET * nextbuffer;
-  my_mem_dest_ptr dest = (my_mem_dest_ptr) cinfo->dest;
+    return effective_subsampling() == SUBSAMPLE_420 ? 16 : 8;
+}
 
-  /* Try to allocate new buffer with double size */
-  nextsize = dest->bufsize * 2;
-  nextbuffer = (JOCTET *)malloc(nextsize);
+void
+jpeg_set_subsampling(j_compress_ptr cinfo, chroma_subsampling subsampling)
+{
+    // jpeg_set_defaults picks YCbCr with luma sampled 2x2, i.e. 4:2:0.
+    switch (subsampling) {
+    case SUBSAMPLE_420:
+        break;
+    case SUBSAMPLE_422:
+        cinfo->comp_info[0].v_samp_factor = 1;
+        break;
+    case SUBSAMPLE_444:
+        cinfo->comp_info[0].h_samp_factor = 1;
+        cinfo->comp_info[0].v_samp_factor = 1;
+        break;
+    case SUBSAMPLE_GRAY:
+        // libjpeg computes luma straight from the RGB(A)/BGR(A) input, with
+        // SIMD in libjpeg-turbo, and only compresses that one component.
+        jpeg_set_colorspace(cinfo, JCS_GRAYSCALE);
+        break;
+    }
+}
 
-  if (nextbuffer == NULL)
-    throw "malloc failed in empty_mem_output_buffer";
+static std::atomic<unsigned long> contexts_created(0);
+static std::atomic<unsigned long> contexts_reconfigured(0);
+static std::atomic<unsigned long> contexts_reused(0);
+static std::atomic<unsigned long> output_buffers(0);
+static std::atomic<unsigned long> output_reallocs(0);
+
+// A jpeg_compress_struct that outlives a single encode. Setting up and
+// tearing down libjpeg's memory pools and tables is a large share of the
+// work for small frames, so every thread keeps one initialized compressor
+// and only reruns jpeg_set_defaults/jpeg_set_quality when the parameters
+// that feed them change. Image dimensions are plain fields read by
+// jpeg_start_compress and never force a rebuild.
+struct compressor_context {
+    struct jpeg_compress_struct cinfo;
+    jump_error_mgr jerr;
+    bool created, configured;
 
-  memcpy(nextbuffer, dest->buffer, dest->bufsize);
+    J_COLOR_SPACE in_color_space;
+    int input_components, quality, smoothing;
+    bool restart_rows;
+    chroma_subsampling subsampling;
 
-  if (dest->newbuffer != NULL)
-    free(dest->newbuffer);
+    compressor_context() : created(false), configured(false) {}
 
-  dest->newbuffer = nextbuffer;
+    ~compressor_context() {
+        if (created)
+            jpeg_destroy_compress(&cinfo);
+    }
 
-  dest->pub.next_output_byte = nextbuffer + dest->bufsize;
-  dest->pub.free_in_buffer = dest->bufsize;
+    j_compress_ptr acquire() {
+        if (!created) {
+            cinfo.err = jpeg_jump_error(&jerr);
+            jpeg_create_compress(&cinfo);
+            created = true;
+            contexts_created++;
+        }
+        return &cinfo;
+    }
 
-  dest->buffer = nextbuffer;
-  dest->bufsize = nextsize;
+    // Brings the parameters in line with the request, returns after
+    // in_color_space and input_components have been set on cinfo.
+    void configure(int qquality, int ssmoothing, bool rrestart_rows,
+        chroma_subsampling ssubsampling)
+    {
+        if (configured
+            && in_color_space == cinfo.in_color_space
+            && input_components == cinfo.input_components
+            && quality == qquality
+            && smoothing == ssmoothing
+            && restart_rows == rrestart_rows
+            && subsampling == ssubsampling)
+        {
+            contexts_reused++;
+            return;
+        }
+
+        jpeg_set_defaults(&cinfo);
+        jpeg_set_subsampling(&cinfo, ssubsampling);
+        jpeg_set_quality(&cinfo, qquality, TRUE);
+        cinfo.smoothing_factor = ssmoothing;
+        if (rrestart_rows)
+            cinfo.restart_in_rows = 1;
+
+        configured = true;
+        in_color_space = cinfo.in_color_space;
+        input_components = cinfo.input_components;
+        quality = qquality;
+        smoothing = ssmoothing;
+        restart_rows = rrestart_rows;
+        subsampling = ssubsampling;
+        contexts_reconfigured++;
+    }
 
-  return TRUE;
+    // Returns the compressor to its idle state after a failed encode so the
+    // next one can reuse it.
+    void abort() {
+        if (created)
+            jpeg_abort_compress(&cinfo);
+    }
+};
+
+static thread_local compressor_context thread_compressor;
+
+// Feeds the YUV samples of rect r to a raw data compressor one iMCU row at
+// a time. Contiguous rows that end on a DCT block boundary are handed to
+// libjpeg in place. Interleaved samples and other rows are unpacked into
+// scratch rows first, with the edge sample repeated into the padding the
+// way libjpeg pads converted input, so nothing outside r is read. Rows past
+// the bottom repeat the last row. The scratch rows come from the image pool,
+// so a failed encode's abort frees them too.
+static void
+write_raw_rows(j_compress_ptr cinfo, const yuv_layout &yuv, int width, const Rect &r)
+{
+    int lines = cinfo->max_v_samp_factor*DCTSIZE;
+    JSAMPROW rows[MAX_COMPONENTS][2*DCTSIZE];
+    JSAMPARRAY planes[MAX_COMPONENTS];
+
+    size_t scratch_size = 0;
+    for (int ci = 0; ci < cinfo->num_components; ci++) {
+        jpeg_component_info *comp = &cinfo->comp_info[ci];
+        scratch_size += (size_t)comp->width_in_blocks*DCTSIZE*comp->v_samp_factor*DCTSIZE;
+        planes[ci] = rows[ci];
+    }
+    unsigned char *scratch = (unsigned char *)
+        (*cinfo->mem->alloc_large)((j_common_ptr)cinfo, JPOOL_IMAGE, scratch_size);
+
+    // YUYV in color is split into its three components in one pass per row.
+    bool yuyv = yuv.y_step == 2 && cinfo->num_components == 3 && r.x % 2 == 0;
+
+    for (int imcu = 0; cinfo->next_scanline < cinfo->image_height; imcu++) {
+        unsigned char *spare = scratch;
+
+        for (int i = 0; yuyv && i < DCTSIZE; i++) {
+            int row = imcu*DCTSIZE + i;
+            if (row >= r.h)
+                row = r.h - 1;
+            const unsigned char *src = yuv.y_row(r.y + row) + (size_t)r.x*2;
+
+            unsigned char *out[3];
+            for (int ci = 0; ci < 3; ci++) {
+                out[ci] = spare;
+                rows[ci][i] = spare;
+                spare += cinfo->comp_info[ci].width_in_blocks*DCTSIZE;
+            }
+            int pairs = cinfo->comp_info[1].downsampled_width;
+            for (int x = 0; x < pairs; x++, src += 4) {
+                out[0][2*x] = src[0];
+                out[1][x] = src[1];
+                out[0][2*x + 1] = src[2];
+                out[2][x] = src[3];
+            }
+            for (int ci = 0; ci < 3; ci++) {
+                jpeg_component_info *comp = &cinfo->comp_info[ci];
+                int comp_w = comp->downsampled_width;
+                memset(out[ci] + comp_w, out[ci][comp_w - 1],
+                    comp->width_in_blocks*DCTSIZE - comp_w);
+            }
+        }
+
+        for (int ci = 0; !yuyv && ci < cinfo->num_components; ci++) {
+            jpeg_component_info *comp = &cinfo->comp_info[ci];
+            int comp_w = comp->downsampled_width;
+            int comp_h = comp->downsampled_height;
+            int padded_w = comp->width_in_blocks*DCTSIZE;
+            int n = comp->v_samp_factor*DCTSIZE;
+
+            // Luma, or chroma halved horizontally.
+            bool luma = ci == 0;
+            int step = luma ? yuv.y_step : yuv.uv_step;
+            int x0 = luma ? r.x : r.x/2;
+            int plane_w = luma ? width : (width + 1)/2;
+            int row_scale = luma ? 0 : comp->v_samp_factor < cinfo->max_v_samp_factor;
+
+            for (int i = 0; i < n; i++) {
+                int row = imcu*n + i;
+                if (row >= comp_h)
+                    row = comp_h - 1;
+                // luma row of the source this component row comes from
+                int src_row = ((r.y >> row_scale) + row) << row_scale;
+                const unsigned char *src =
+                    ci == 0 ? yuv.y_row(src_row) : ci == 1 ? yuv.u_row(src_row) : yuv.v_row(src_row);
+                src += (size_t)x0*step;
+
+                if (step == 1 && comp_w == padded_w && x0 + padded_w <= plane_w) {
+                    rows[ci][i] = (JSAMPROW)src;
+                    continue;
+                }
+                for (int x = 0; x < comp_w; x++)
+                    spare[x] = src[x*step];
+                memset(spare + comp_w, spare[comp_w - 1], padded_w - comp_w);
+                rows[ci][i] = spare;
+                spare += padded_w;
+            }
+        }
+
+        jpeg_write_raw_data(cinfo, planes, lines);
+    }
 }
 
+// Compresses rectangle r of the source into a complete JPEG in *out. With
+// restart_rows a restart marker is emitted after every MCU row, which is
+// what lets encode_striped() glue independently encoded stripes together.
+// Output buffer growth steps are added to *out_reallocs. Whichever way an
+// encode fails, libjpeg error or exception from the destination, the
+// compressor is aborted so the thread can reuse it, and a const char* is
+// thrown. libjpeg messages come from jpeg_error_message(), so they stay
+// valid after a striped encode has joined its workers.
 void
-term_mem_destination (j_compress_ptr cinfo)
+JpegEncoder::compress(const Rect &r, bool restart_rows, const jpeg_margins &mmargins,
+    unsigned char **out, unsigned long *out_len, int *out_reallocs)
 {
-  my_mem_dest_ptr dest = (my_mem_dest_ptr) cinfo->dest;
+    compressor_context &ctx = thread_compressor;
 
-  *dest->outbuffer = dest->buffer;
-  *dest->outsize = dest->bufsize - dest->pub.free_in_buffer;
+    // Conversion scratch rows, freed on every way out.
+    unsigned char * volatile batch = NULL;
+
+    if (setjmp(ctx.jerr.jump)) {
+        const char *err = jpeg_error_message((j_common_ptr)&ctx.cinfo);
+        free(batch);
+        ctx.abort();
+        throw err;
+    }
+
+    j_compress_ptr cinfo = ctx.acquire();
+
+    int bpp = bytes_per_pixel(buf_type);
+    const unsigned char *src = data + (size_t)r.y*stride + r.x*bpp;
+    bool raw = is_yuv(buf_type);
+
+    // Rows are either passed to libjpeg straight from the source buffer, or
+    // converted to RGB a batch at a time through a small scratch buffer.
+    row_converter convert = NULL;
+
+    int grown = 0;
+    try {
+        if (chunk_sink)
+            jpeg_chunked_dest(cinfo, out, out_len, chunk_size, chunk_sink, chunk_arg);
+        else
+            jpeg_output_dest_framed(cinfo, out, out_len, expected_size(r), &grown, mmargins);
+
+        cinfo->image_width = r.w;
+        cinfo->image_height = r.h;
+
+        switch (buf_type) {
+        case BUF_RGB:
+            cinfo->input_components = 3;
+            cinfo->in_color_space = JCS_RGB;
+            break;
+
+    #ifdef JCS_EXTENSIONS
+        // libjpeg-turbo reads these layouts natively.
+        case BUF_BGR:
+            cinfo->input_components = 3;
+            cinfo->in_color_space = JCS_EXT_BGR;
+            break;
+
+        case BUF_RGBA:
+            cinfo->input_components = 4;
+    #ifdef JCS_ALPHA_EXTENSIONS
+            cinfo->in_color_space = JCS_EXT_RGBA;
+    #else
+            cinfo->in_color_space = JCS_EXT_RGBX;
+    #endif
+            break;
+
+        case BUF_BGRA:
+            cinfo->input_components = 4;
+    #ifdef JCS_ALPHA_EXTENSIONS
+            cinfo->in_color_space = JCS_EXT_BGRA;
+    #else
+            cinfo->in_color_space = JCS_EXT_BGRX;
+    #endif
+            break;
+    #else
+        case BUF_BGR:
+        case BUF_RGBA:
+        case BUF_BGRA:
+            cinfo->input_components = 3;
+            cinfo->in_color_space = JCS_RGB;
+            convert = rgb_row_converter(buf_type);
+            break;
+    #endif
+
+        // Already YCbCr and downsampled, fed to libjpeg as raw data.
+        case BUF_I420:
+        case BUF_NV12:
+        case BUF_YUYV:
+            cinfo->input_components = 3;
+            cinfo->in_color_space = JCS_YCbCr;
+            break;
+
+        default:
+            throw "Unexpected buf_type in JpegEncoder::encode";
+        }
+
+        ctx.configure(quality, smoothing, restart_rows, effective_subsampling());
+        cinfo->raw_data_in = raw;
+        jpeg_start_compress(cinfo, TRUE);
+
+        JSAMPROW row_pointers[SCANLINE_BATCH];
+
+        if (raw) {
+            write_raw_rows(cinfo, yuv_layout(data, height, stride, buf_type), width, r);
+        }
+        else if (!convert) {
+            while (cinfo->next_scanline < cinfo->image_height) {
+                row_pointers[0] = (JSAMPROW)&src[(size_t)cinfo->next_scanline*stride];
+                jpeg_write_scanlines(cinfo, row_pointers, 1);
+            }
+        }
+        else {
+            batch = (unsigned char *)malloc(sizeof(*batch)*r.w*3*SCANLINE_BATCH);
+            if (!batch)
+                throw "malloc failed in JpegEncoder::encode.";
+
+            while (cinfo->next_scanline < cinfo->image_height) {
+                int rows = cinfo->image_height - cinfo->next_scanline;
+                if (rows > SCANLINE_BATCH)
+                    rows = SCANLINE_BATCH;
+
+                for (int i = 0; i < rows; i++) {
+                    row_pointers[i] = &batch[i*r.w*3];
+                    convert(&src[(size_t)(cinfo->next_scanline + i)*stride], row_pointers[i], r.w);
+                }
+                jpeg_write_scanlines(cinfo, row_pointers, rows);
+            }
+        }
+
+        jpeg_finish_compress(cinfo);
+    }
+    catch (const char *err) {
+        free(batch);
+        ctx.abort();
+        throw;
+    }
+    free(batch);
+
+    *out_reallocs += grown;
+    output_buffers++;
+    output_reallocs += grown;
 }
 
-void
-jpeg_mem_dest (j_compress_ptr cinfo,
-	       unsigned char ** outbuffer, unsigned long * outsize)
-{
-  my_mem_dest_ptr dest;
-
-  /* The destination object is made permanent so that multiple JPEG images
-   * can be written to the same buffer without re-executing jpeg_mem_dest.
-   */
-  if (cinfo->dest == NULL) {	/* first time for this JPEG object? */
-    cinfo->dest = (struct jpeg_destination_mgr *)
-      (*cinfo->mem->alloc_small) ((j_common_ptr) cinfo, JPOOL_PERMANENT,
-				  sizeof(my_mem_destination_mgr));
-  }
-
-  dest = (my_mem_dest_ptr) cinfo->dest;
-  dest->pub.init_destination = init_mem_destination;
-  dest->pub.empty_output_buffer = empty_mem_output_buffer;
-  dest->pub.term_destination = term_mem_destination;
-  dest->outbuffer = outbuffer;
-  dest->outsize = outsize;
-  dest->newbuffer = NULL;
-
-  if (*outbuffer == NULL || *outsize == 0) {
-    /* Allocate initial buffer */
-    dest->newbuffer = *outbuffer = (unsigned char *)malloc(OUTPUT_BUF_SIZE);
-    if (dest->newbuffer == NULL)
-      throw "out of memory in jpeg_mem_dest (copied implementation)";
-    *outsize = OUTPUT_BUF_SIZE;
-  }
-
-  dest->pub.next_output_byte = dest->buffer = *outbuffer;
-  dest->pub.free_in_buffer = dest->bufsize = *outsize;
-}
-#endif
+struct stripe_job {
+    JpegEncoder *encoder;
+    Rect rect;
+    unsigned char *jpeg;
+    unsigned long jpeg_len;
+    int reallocs;
+    char error[JMSG_LENGTH_MAX]; // empty unless the stripe failed
+};
 
 void
-JpegEncoder::encode()
+JpegEncoder::encode_stripe(void *arg, int index)
 {
-    struct jpeg_compress_struct cinfo;
-    struct jpeg_error_mgr jerr;
+    stripe_job *job = (stripe_job *)arg + index;
+    try {
+        job->encoder->compress(job->rect, true, jpeg_margins(),
+            &job->jpeg, &job->jpeg_len, &job->reallocs);
+    }
+    catch (const char *err) {
+        strncpy(job->error, err, sizeof(job->error) - 1);
+    }
+}
 
-    cinfo.err = jpeg_std_error(&jerr);
+// Encodes r as 'stripes' horizontal stripes of whole MCU rows, each on its
+// own thread with a restart marker after every MCU row, then splices their
+// entropy-coded data into one baseline JPEG behind the first stripe's
+// headers. The result is identical to a single-threaded encode with
+// restart_in_rows = 1.
+void
+JpegEncoder::encode_striped(const Rect &r, int stripes)
+{
+    int mcu_h = mcu_height();
+    int mcu_rows = (r.h + mcu_h - 1)/mcu_h;
+
+    stripe_job *jobs = (stripe_job *)calloc(stripes, sizeof(*jobs));
+    if (!jobs) throw "calloc failed in JpegEncoder::encode.";
+
+    int row = 0;
+    for (int i = 0; i < stripes; i++) {
+        int rows = mcu_rows/stripes + (i < mcu_rows%stripes ? 1 : 0);
+        int y = row*mcu_h;
+        int h = rows*mcu_h;
+        if (y + h > r.h)
+            h = r.h - y;
+        jobs[i].encoder = this;
+        jobs[i].rect = Rect(r.x, r.y + y, r.w, h);
+        row += rows;
+    }
 
-    jpeg_create_compress(&cinfo);
-    jpeg_mem_dest(&cinfo, &jpeg, &jpeg_len);
+    parallel_for(stripes, stripes, encode_stripe, jobs);
 
-    if (offset.isNull()) {
-        cinfo.image_width = width;
-        cinfo.image_height = height;
+    const char *error = NULL;
+    size_t total = 0;
+    for (int i = 0; i < stripes; i++) {
+        if (jobs[i].error[0])
+            error = jpeg_keep_message(jobs[i].error);
+        total += jobs[i].jpeg_len + 2;
+        reallocs += jobs[i].reallocs;
     }
-    else {
-        cinfo.image_width = offset.w;
-        cinfo.image_height = offset.h;
+
+    if (!error) {
+        jpeg = (unsigned char *)malloc(margins.head + total + margins.tail);
+        if (!jpeg)
+            error = "malloc failed in JpegEncoder::encode.";
     }
-    cinfo.input_components = 3;
-    cinfo.in_color_space = JCS_RGB;
 
-    jpeg_set_defaults(&cinfo);
-    jpeg_set_quality(&cinfo, quality, TRUE);
-    cinfo.smoothing_factor = smoothing;
-    jpeg_start_compress(&cinfo, TRUE);
+    if (!error) {
+        try {
+            unsigned char *out = jpeg + margins.head;
+            size_t header_len = jpeg_scan_start(jobs[0].jpeg, jobs[0].jpeg_len);
+            memcpy(out, jobs[0].jpeg, header_len);
+            jpeg_set_height(out, header_len, r.h);
+
+            unsigned char *p = out + header_len;
+            int first_row = 0;
+            for (int i = 0; i < stripes; i++) {
+                const unsigned char *stripe = jobs[i].jpeg;
+                size_t start = jpeg_scan_start(stripe, jobs[i].jpeg_len);
+                size_t end = jpeg_scan_end(stripe, jobs[i].jpeg_len);
+                if (i > 0)
+                    p += jpeg_put_rst(p, first_row - 1);
+                p += jpeg_copy_scan(p, stripe + start, end - start, first_row);
+                first_row += (jobs[i].rect.h + mcu_h - 1)/mcu_h;
+            }
+            *p++ = 0xFF;
+            *p++ = 0xD9; // EOI
+            jpeg_len = p - out;
+        }
+        catch (const char *err) {
+            error = err;
+        }
+    }
 
-    unsigned char *rgb_data;
-    switch (buf_type) {
-    case BUF_RGBA:
-        rgb_data = rgba_to_rgb(data, width*height*4);
-        if (!rgb_data) throw "malloc failed in JpegEncoder::encode/rgba_to_rgb.";
-        break;
+    for (int i = 0; i < stripes; i++)
+        free(jobs[i].jpeg);
+    free(jobs);
 
-    case BUF_BGRA:
-        rgb_data = bgra_to_rgb(data, width*height*4);
-        if (!rgb_data) throw "malloc failed in JpegEncoder::encode/bgra_to_rgb.";
-        break;
-
-    case BUF_BGR:
-        rgb_data = bgr_to_rgb(data, width*height*3);
-        if (!rgb_data) throw "malloc failed in JpegEncoder::encode/bgr_to_rgb.";
-        break;
+    if (error) {
+        free(jpeg);
+        jpeg = NULL;
+        jpeg_len = 0;
+        throw error;
+    }
+}
 
-    case BUF_RGB:
-        rgb_data = data;
-        break;
+void
+JpegEncoder::encode()
+{
+    // jpeg_mem_dest appends to a non-NULL buffer, so drop whatever a previous
+    // encode left behind before handing it a fresh one.
+    free(jpeg);
+    jpeg = NULL;
+    jpeg_len = 0;
+    reallocs = 0;
 
-    default:
-        throw "Unexpected buf_type in JpegEncoder::encode";
+    Rect r = offset;
+    if (r.isNull()) {
+        r = Rect(0, 0, width, height);
     }
 
-    JSAMPROW row_pointer;
-    int start = 0;
-    if (!offset.isNull()) {
-        start = offset.y*width*3 + offset.x*3;
-    }
-    while (cinfo.next_scanline < cinfo.image_height) {
-        row_pointer = &rgb_data[start + cinfo.next_scanline*3*width];
-        jpeg_write_scanlines(&cinfo, &row_pointer, 1);
+    // Smoothing looks at neighbouring rows, which a stripe doesn't have, so
+    // smoothed images are always encoded in one piece. So are streamed ones,
+    // whose chunks have to come out in order as they are compressed.
+    int stripes = 1;
+    if (threads > 1 && smoothing == 0 && !chunk_sink) {
+        int mcu_rows = (r.h + mcu_height() - 1)/mcu_height();
+        stripes = mcu_rows/MIN_STRIPE_MCU_ROWS;
+        if (stripes > threads)
+            stripes = threads;
     }
 
-    jpeg_finish_compress(&cinfo);
-    jpeg_destroy_compress(&cinfo);
+    if (stripes > 1)
+        encode_striped(r, stripes);
+    else
+        compress(r, restart_rows, margins, &jpeg, &jpeg_len, &reallocs);
 
-    if (buf_type == BUF_BGR || buf_type == BUF_RGBA || buf_type == BUF_BGRA)
-        free(rgb_data);
+    // Next time around, expect about the same bytes per pixel.
+    if (r.w > 0 && r.h > 0)
+        size_hint = (double)jpeg_len/((double)r.w*r.h);
+}
+
+// Initial output buffer size for compressing r: the bytes per pixel of an
+// earlier encode with some headroom, or a guess from the quality.
+unsigned long
+JpegEncoder::expected_size(const Rect &r) const
+{
+    if (size_hint > 0)
+        return (unsigned long)(size_hint*r.w*r.h*1.1) + 1024;
+    return jpeg_predict_size(r.w, r.h, quality);
+}
+
+// Points the encoder at another, tightly packed image, keeping the
+// compression settings. Any rect set with setRect() is dropped.
+void
+JpegEncoder::set_source(unsigned char *ddata, int wwidth, int hheight, buffer_type bbuf_type)
+{
+    data = ddata;
+    width = wwidth;
+    height = hheight;
+    buf_type = bbuf_type;
+    stride = row_bytes(bbuf_type, wwidth);
+    offset = Rect(0, 0, 0, 0);
+}
+
+// Distance in bytes between the starts of two input rows, luma rows for
+// I420 and NV12. Defaults to tightly packed rows.
+void
+JpegEncoder::set_stride(int sstride)
+{
+    stride = sstride;
 }
 
 void
@@ -190,6 +591,63 @@ void JpegEncoder::set_smoothing(int ssmoothing)
     smoothing  = ssmoothing;
 }
 
+// Puts a restart marker after every MCU row, so the entropy-coded data can
+// be cut into rows (see jpeg_segments.h). Striped encodes always do this.
+void JpegEncoder::set_restart_rows(bool rrestart_rows)
+{
+    restart_rows = rrestart_rows;
+}
+
+// Changes the MCU size, see mcu_width() and mcu_height().
+void JpegEncoder::set_subsampling(chroma_subsampling ssubsampling)
+{
+    subsampling = ssubsampling;
+}
+
+// Seeds the output size prediction with the bytes per pixel of an earlier
+// encode of similar content, as returned by get_size_hint().
+void JpegEncoder::set_size_hint(double bytes_per_pixel)
+{
+    size_hint = bytes_per_pixel;
+}
+
+// Leaves room around the jpeg in the output buffer for a container to frame
+// it in place (see jpeg_margins). The jpeg then starts margins.head bytes
+// into get_jpeg() and release_jpeg(); get_jpeg_len() counts only the jpeg.
+void JpegEncoder::set_margins(const jpeg_margins &mmargins)
+{
+    margins = mmargins;
+}
+
+// Streams the output of following encodes to 'sink' in chunks of
+// cchunk_size bytes instead of collecting it (see jpeg_chunked_dest).
+// get_jpeg() is then NULL after an encode, and get_jpeg_len() the total
+// handed to the sink. margins don't apply. A NULL sink turns it off.
+void JpegEncoder::set_chunk_sink(size_t cchunk_size, jpeg_chunk_sink sink, void *arg)
+{
+    chunk_size = cchunk_size;
+    chunk_sink = sink;
+    chunk_arg = arg;
+}
+
+double JpegEncoder::get_size_hint() const
+{
+    return size_hint;
+}
+
+// Number of times the output buffer had to grow during the last encode.
+int JpegEncoder::get_reallocs() const
+{
+    return reallocs;
+}
+
+// Number of threads a single encode may be split across, 1 disables
+// striped encoding.
+void JpegEncoder::set_threads(int tthreads)
+{
+    threads = tthreads;
+}
+
 const unsigned char *
 JpegEncoder::get_jpeg() const
 {
@@ -202,9 +660,64 @@ JpegEncoder::get_jpeg_len() const
     return jpeg_len;
 }
 
+// Hands the malloc'd output buffer over to the caller, who must free() it
+// (or give it to BufferFromMalloc). get_jpeg_len() stays valid until the
+// next encode().
+unsigned char *
+JpegEncoder::release_jpeg()
+{
+    unsigned char *ret = jpeg;
+    jpeg = NULL;
+    return ret;
+}
+
+// Encodes only rect r of the source. Rows and pixels outside it are never
+// read, whatever the buffer type.
 void
 JpegEncoder::setRect(const Rect &r)
 {
     offset = r;
 }
 
+int
+JpegEncoder::get_width() const
+{
+    return width;
+}
+
+int
+JpegEncoder::get_height() const
+{
+    return height;
+}
+
+int
+JpegEncoder::get_stride() const
+{
+    return stride;
+}
+
+buffer_type
+JpegEncoder::get_buf_type() const
+{
+    return buf_type;
+}
+
+const unsigned char *
+JpegEncoder::get_data() const
+{
+    return data;
+}
+
+
+encoder_stats
+JpegEncoder::stats()
+{
+    encoder_stats st;
+    st.contexts_created = contexts_created;
+    st.contexts_reconfigured = contexts_reconfigured;
+    st.contexts_reused = contexts_reused;
+    st.output_buffers = output_buffers;
+    st.output_reallocs = output_reallocs;
+    return st;
+}
@@ -5,9 +5,28 @@
 #include <cstdlib>
 #include <jpeglib.h>
 #include "common.h"
+#include "jpeg_destination.h"
+
+// Process-wide counters of how encodes got their compressor (see
+// compressor_context in jpeg_encoder.cpp).
+struct encoder_stats {
+    unsigned long contexts_created;      // new jpeg_compress_struct
+    unsigned long contexts_reconfigured; // reused, but tables rebuilt
+    unsigned long contexts_reused;       // reused as is
+    unsigned long output_buffers;        // output buffers allocated
+    unsigned long output_reallocs;       // times one of them had to grow
+};
+
+// Sets the jpeg color space and sampling factors for 'subsampling' on a
+// compressor that jpeg_set_defaults has been run on.
+void jpeg_set_subsampling(j_compress_ptr cinfo, chroma_subsampling subsampling);
 
 class JpegEncoder {
-    int width, height, quality, smoothing;
+    int width, height, stride, quality, smoothing, threads;
+    bool restart_rows;
+    chroma_subsampling subsampling;
+    double size_hint;
+    int reallocs;
     buffer_type buf_type;
     unsigned char *data;
 
@@ -15,19 +34,52 @@ class JpegEncoder {
     long unsigned int jpeg_len;
 
     Rect offset;
+    jpeg_margins margins;
+
+    size_t chunk_size;
+    jpeg_chunk_sink chunk_sink;
+    void *chunk_arg;
+
+    chroma_subsampling effective_subsampling() const;
+    unsigned long expected_size(const Rect &r) const;
+    void compress(const Rect &r, bool restart_rows, const jpeg_margins &mmargins,
+        unsigned char **out, unsigned long *out_len, int *out_reallocs);
+    void encode_striped(const Rect &r, int stripes);
+    static void encode_stripe(void *arg, int index);
 
 public:
     JpegEncoder(unsigned char *ddata, int wwidth, int hheight,
         int qquality, buffer_type bbuf_type);
+    JpegEncoder(const JpegEncoder &other);
     ~JpegEncoder();
 
     void encode();
+    void set_source(unsigned char *ddata, int wwidth, int hheight, buffer_type bbuf_type);
+    void set_stride(int sstride);
     void set_quality(int qquality);
     void set_smoothing(int ssmoothing);
+    void set_threads(int tthreads);
+    void set_restart_rows(bool rrestart_rows);
+    void set_subsampling(chroma_subsampling ssubsampling);
+    void set_size_hint(double bytes_per_pixel);
+    void set_margins(const jpeg_margins &mmargins);
+    void set_chunk_sink(size_t cchunk_size, jpeg_chunk_sink sink, void *arg);
+    double get_size_hint() const;
+    int get_reallocs() const;
+    int get_width() const;
+    int get_height() const;
+    int get_stride() const;
+    buffer_type get_buf_type() const;
+    const unsigned char *get_data() const;
+    int mcu_width() const;
+    int mcu_height() const;
     const unsigned char *get_jpeg() const;
     unsigned int get_jpeg_len() const;
+    unsigned char *release_jpeg();
 
     void setRect(const Rect &r);
+
+    static encoder_stats stats();
 };
 
 #endif
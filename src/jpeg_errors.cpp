@@ -0,0 +1,64 @@
+#include "jpeg_errors.h"
+
+#include <set>
+#include <string>
+#include <uv.h>
+
+// Every message handed out so far. libjpeg formats a fixed table of messages
+// with a few small parameters, so the set stays small; the cap only guards
+// against a pathological stream of distinct ones.
+#define MAX_KEPT_MESSAGES 1024
+
+static std::set<std::string> *kept_messages;
+static uv_mutex_t kept_lock;
+static uv_once_t kept_once = UV_ONCE_INIT;
+
+static void
+init_kept_messages()
+{
+    kept_messages = new std::set<std::string>;
+    uv_mutex_init(&kept_lock);
+}
+
+static void
+jump_error_exit(j_common_ptr cinfo)
+{
+    longjmp(((jump_error_mgr *)cinfo->err)->jump, 1);
+}
+
+// Warnings about corrupt data are not worth a line on stderr per image.
+static void
+quiet_output_message(j_common_ptr cinfo) {}
+
+struct jpeg_error_mgr *
+jpeg_jump_error(jump_error_mgr *err)
+{
+    jpeg_std_error(&err->pub);
+    err->pub.error_exit = jump_error_exit;
+    err->pub.output_message = quiet_output_message;
+    return &err->pub;
+}
+
+const char *
+jpeg_keep_message(const char *msg)
+{
+    uv_once(&kept_once, init_kept_messages);
+
+    const char *kept = "JPEG library error (too many distinct messages)";
+    uv_mutex_lock(&kept_lock);
+    std::set<std::string>::iterator it = kept_messages->find(msg);
+    if (it != kept_messages->end())
+        kept = it->c_str();
+    else if (kept_messages->size() < MAX_KEPT_MESSAGES)
+        kept = kept_messages->insert(msg).first->c_str();
+    uv_mutex_unlock(&kept_lock);
+    return kept;
+}
+
+const char *
+jpeg_error_message(j_common_ptr cinfo)
+{
+    char buffer[JMSG_LENGTH_MAX];
+    (*cinfo->err->format_message)(cinfo, buffer);
+    return jpeg_keep_message(buffer);
+}
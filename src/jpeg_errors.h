@@ -0,0 +1,38 @@
+#ifndef JPEG_ERRORS_H
+#define JPEG_ERRORS_H
+
+#include <csetjmp>
+#include <cstdio>
+#include <jpeglib.h>
+
+/*
+ * Error manager for reading untrusted JPEGs: libjpeg errors longjmp back to
+ * the caller's setjmp(jerr.jump) instead of exiting the process, and
+ * warnings about corrupt data are dropped instead of printed.
+ *
+ *     jump_error_mgr jerr;
+ *     cinfo.err = jpeg_jump_error(&jerr);
+ *     if (setjmp(jerr.jump)) {
+ *         const char *msg = jpeg_error_message((j_common_ptr)&cinfo);
+ *         jpeg_destroy_decompress(&cinfo);
+ *         throw msg;
+ *     }
+ */
+struct jump_error_mgr {
+    struct jpeg_error_mgr pub;
+    jmp_buf jump;
+};
+
+struct jpeg_error_mgr *jpeg_jump_error(jump_error_mgr *err);
+
+// Formats the pending error into a string that lives as long as the
+// process, so the pointer can be thrown, outlives the failed object and may
+// be read on any thread, even after the one that failed has exited.
+const char *jpeg_error_message(j_common_ptr cinfo);
+
+// Returns a copy of msg with the same lifetime, for rethrowing a message that
+// was copied into a job's own buffer.
+const char *jpeg_keep_message(const char *msg);
+
+#endif
+
@@ -0,0 +1,234 @@
+#include <cstdlib>
+#include <cstring>
+
+#include "jpeg_probe.h"
+
+#define M_SOF0 0xC0
+#define M_SOF2 0xC2
+#define M_SOF15 0xCF
+#define M_DHT 0xC4
+#define M_JPG 0xC8
+#define M_DAC 0xCC
+#define M_RST0 0xD0
+#define M_RST7 0xD7
+#define M_SOI 0xD8
+#define M_EOI 0xD9
+#define M_SOS 0xDA
+#define M_DQT 0xDB
+#define M_TEM 0x01
+
+#define NUM_QUANT_TBLS 4
+
+// Position of the n-th zigzag coefficient in natural (row-major) order.
+static const int zigzag_to_natural[64] = {
+     0,  1,  8, 16,  9,  2,  3, 10,
+    17, 24, 32, 25, 18, 11,  4,  5,
+    12, 19, 26, 33, 40, 48, 41, 34,
+    27, 20, 13,  6,  7, 14, 21, 28,
+    35, 42, 49, 56, 57, 50, 43, 36,
+    29, 22, 15, 23, 30, 37, 44, 51,
+    58, 59, 52, 45, 38, 31, 39, 46,
+    53, 60, 61, 54, 47, 55, 62, 63
+};
+
+// The tables from section K.1 of the JPEG standard, in natural order, that
+// libjpeg scales by quality.
+static const int std_luminance_quant[64] = {
+    16,  11,  10,  16,  24,  40,  51,  61,
+    12,  12,  14,  19,  26,  58,  60,  55,
+    14,  13,  16,  24,  40,  57,  69,  56,
+    14,  17,  22,  29,  51,  87,  80,  62,
+    18,  22,  37,  56,  68, 109, 103,  77,
+    24,  35,  55,  64,  81, 104, 113,  92,
+    49,  64,  78,  87, 103, 121, 120, 101,
+    72,  92,  95,  98, 112, 100, 103,  99
+};
+
+static const int std_chrominance_quant[64] = {
+    17,  18,  24,  47,  99,  99,  99,  99,
+    18,  21,  26,  66,  99,  99,  99,  99,
+    24,  26,  56,  99,  99,  99,  99,  99,
+    47,  66,  99,  99,  99,  99,  99,  99,
+    99,  99,  99,  99,  99,  99,  99,  99,
+    99,  99,  99,  99,  99,  99,  99,  99,
+    99,  99,  99,  99,  99,  99,  99,  99,
+    99,  99,  99,  99,  99,  99,  99,  99
+};
+
+struct quant_table {
+    bool defined;
+    bool wide; // 16-bit entries
+    int q[64]; // natural order
+};
+
+static int read16(const unsigned char *p) {
+    return (p[0] << 8) | p[1];
+}
+
+// Sum of differences between 'table' and 'std' scaled the way
+// jpeg_set_quality scales it for 'quality'.
+static long quality_error(const quant_table *table, const int *std, int quality) {
+    long scale = quality < 50 ? 5000/quality : 200 - quality*2;
+    long max = table->wide ? 32767 : 255;
+    long error = 0;
+    for (int i = 0; i < 64; i++) {
+        long q = (std[i]*scale + 50)/100;
+        if (q < 1) q = 1;
+        if (q > max) q = max;
+        error += labs(table->q[i] - q);
+    }
+    return error;
+}
+
+// jpeg_set_quality's scaling inverted on the average ratio of 'table' to
+// 'std' (leaving out entries clamped at the maximum) gives a close guess;
+// the neighbourhood of it is then searched for the best fit, which is exact
+// for IJG tables despite the rounding.
+static int guess_quality(const quant_table *table, const int *std) {
+    long max = table->wide ? 32767 : 255;
+    long sum = 0, std_sum = 0;
+    for (int i = 0; i < 64; i++) {
+        if (table->q[i] >= max)
+            continue;
+        sum += table->q[i];
+        std_sum += std[i];
+    }
+    if (std_sum == 0) return 1;
+    long scale = (sum*100 + std_sum/2)/std_sum;
+    if (scale <= 0) return 100;
+    int quality = scale <= 100 ? (200 - scale)/2 : 5000/scale;
+    return quality < 1 ? 1 : quality > 100 ? 100 : quality;
+}
+
+#define QUALITY_SEARCH 5
+
+static int estimate_quality(const quant_table *luma, const quant_table *chroma) {
+    int guess = guess_quality(luma, std_luminance_quant);
+    int best = 0;
+    long best_error = 0;
+    for (int quality = guess - QUALITY_SEARCH; quality <= guess + QUALITY_SEARCH; quality++) {
+        if (quality < 1 || quality > 100)
+            continue;
+        long error = quality_error(luma, std_luminance_quant, quality);
+        if (chroma) error += quality_error(chroma, std_chrominance_quant, quality);
+        if (best == 0 || error < best_error) {
+            best = quality;
+            best_error = error;
+        }
+    }
+    return best;
+}
+
+static void read_dqt(const unsigned char *seg, size_t seglen, quant_table *tables) {
+    size_t pos = 0;
+    while (pos < seglen) {
+        int precision = seg[pos] >> 4;
+        int id = seg[pos] & 0x0F;
+        size_t size = precision ? 128 : 64;
+        if (id >= NUM_QUANT_TBLS || pos + 1 + size > seglen)
+            throw "Corrupt DQT marker.";
+        quant_table *t = &tables[id];
+        t->defined = true;
+        t->wide = precision != 0;
+        for (int i = 0; i < 64; i++) {
+            t->q[zigzag_to_natural[i]] = precision
+                ? read16(&seg[pos + 1 + i*2])
+                : seg[pos + 1 + i];
+        }
+        pos += 1 + size;
+    }
+}
+
+void jpeg_probe(const unsigned char *jpeg, size_t len, jpeg_probe_info *info) {
+    if (len < 2 || jpeg[0] != 0xFF || jpeg[1] != M_SOI)
+        throw "Not a JPEG stream.";
+
+    quant_table tables[NUM_QUANT_TBLS];
+    int comp_tables[4] = { 0, 0, 0, 0 };
+    bool have_sof = false;
+
+    memset(tables, 0, sizeof(tables));
+    memset(info, 0, sizeof(*info));
+
+    size_t pos = 2;
+    while (pos + 1 < len) {
+        if (jpeg[pos] != 0xFF)
+            throw "Corrupt JPEG header.";
+        unsigned char marker = jpeg[pos + 1];
+        if (marker == 0xFF) { // fill byte
+            pos++;
+            continue;
+        }
+        if (marker == M_TEM || (marker >= M_RST0 && marker <= M_RST7)) {
+            pos += 2; // no length
+            continue;
+        }
+        if (marker == M_EOI)
+            break;
+
+        if (pos + 4 > len)
+            throw "Truncated JPEG marker segment.";
+        size_t seglen = read16(&jpeg[pos + 2]);
+        if (seglen < 2 || pos + 2 + seglen > len)
+            throw "Truncated JPEG marker segment.";
+        const unsigned char *seg = &jpeg[pos + 4];
+        seglen -= 2;
+
+        if (marker >= M_SOF0 && marker <= M_SOF15
+            && marker != M_DHT && marker != M_JPG && marker != M_DAC)
+        {
+            if (seglen < 6 || seglen < 6 + (size_t)seg[5]*3)
+                throw "Corrupt SOF marker.";
+            info->height = read16(&seg[1]);
+            info->width = read16(&seg[3]);
+            info->components = seg[5];
+            // SOF2, SOF6, SOF10 and SOF14 are the progressive ones
+            info->progressive = ((marker - M_SOF0) & 3) == 2;
+            for (int i = 0; i < info->components && i < 4; i++) {
+                info->h_samp[i] = seg[6 + i*3 + 1] >> 4;
+                info->v_samp[i] = seg[6 + i*3 + 1] & 0x0F;
+                comp_tables[i] = seg[6 + i*3 + 2] & 0x03;
+            }
+            have_sof = true;
+        }
+        else if (marker == M_DQT) {
+            read_dqt(seg, seglen, tables);
+        }
+        else if (marker == M_SOS) {
+            if (!have_sof)
+                throw "No SOF marker before the first scan.";
+
+            const quant_table *luma = &tables[comp_tables[0]];
+            const quant_table *chroma = info->components > 1
+                ? &tables[comp_tables[1]] : NULL;
+            if (!luma->defined) luma = NULL;
+            if (chroma && (!chroma->defined || chroma == luma)) chroma = NULL;
+            if (luma)
+                info->quality = estimate_quality(luma, chroma);
+            return;
+        }
+
+        pos += 4 + seglen;
+    }
+    throw "No SOS marker in JPEG stream.";
+}
+
+const char *jpeg_subsampling_name(const jpeg_probe_info *info) {
+    if (info->components == 1)
+        return "gray";
+    if (info->components != 3)
+        return "other";
+    if (info->h_samp[1] != info->h_samp[2] || info->v_samp[1] != info->v_samp[2]
+        || info->h_samp[1] == 0 || info->v_samp[1] == 0
+        || info->h_samp[0] % info->h_samp[1] || info->v_samp[0] % info->v_samp[1])
+        return "other";
+
+    int h = info->h_samp[0]/info->h_samp[1];
+    int v = info->v_samp[0]/info->v_samp[1];
+    if (h == 1 && v == 1) return "4:4:4";
+    if (h == 2 && v == 1) return "4:2:2";
+    if (h == 2 && v == 2) return "4:2:0";
+    if (h == 1 && v == 2) return "4:4:0";
+    if (h == 4 && v == 1) return "4:1:1";
+    return "other";
+}
@@ -0,0 +1,32 @@
+#ifndef JPEG_PROBE_H
+#define JPEG_PROBE_H
+
+#include <cstddef>
+
+// What the markers in front of the first scan say about a JPEG.
+struct jpeg_probe_info {
+    int width, height;
+    int components;
+    int h_samp[4], v_samp[4]; // per component, up to 4 are reported
+    bool progressive;
+    int quality; // estimated from the quantization tables, 0 if there are none
+};
+
+/*
+ * Walks the marker segments of a JPEG up to its first SOS and fills 'info'
+ * from SOF and DQT, without setting up a libjpeg decompressor or touching
+ * the entropy-coded data. Throws if the stream ends or breaks off before a
+ * frame header and a scan.
+ *
+ * The quality is the IJG quality (as passed to jpeg_set_quality) whose
+ * scaled standard tables are closest to the stream's luminance and
+ * chrominance tables. For images from libjpeg and most tools built on it
+ * that's the exact setting; for others it's a rough equivalent.
+ */
+void jpeg_probe(const unsigned char *jpeg, size_t len, jpeg_probe_info *info);
+
+// "4:4:4", "4:2:2", "4:2:0", "4:4:0", "4:1:1", "gray" or "other".
+const char *jpeg_subsampling_name(const jpeg_probe_info *info);
+
+#endif
+
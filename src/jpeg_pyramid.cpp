@@ -0,0 +1,180 @@
+#include <cstdlib>
+#include <cstring>
+
+#include "jpeg_pyramid.h"
+#include "jpeg_errors.h"
+#include "parallel.h"
+
+JpegPyramid::JpegPyramid(const JpegEncoder &bbase) :
+    base(bbase), output_threads(1)
+{
+    switch (base.get_buf_type()) {
+    case BUF_BGR:
+    case BUF_BGRA:
+        level_type = BUF_BGRA;
+        break;
+    default:
+        level_type = BUF_RGBA;
+    }
+}
+
+JpegPyramid::~JpegPyramid() {
+    for (size_t i = 0; i < levels.size(); i++)
+        free(levels[i].data);
+    for (size_t i = 0; i < outputs.size(); i++)
+        free(outputs[i].jpeg);
+}
+
+void JpegPyramid::add(int shift, int quality) {
+    output o;
+    o.shift = shift;
+    o.quality = quality;
+    o.jpeg = NULL;
+    o.jpeg_len = 0;
+    memset(o.error, 0, sizeof(o.error));
+    outputs.push_back(o);
+}
+
+// Sets *row to source row y as 4 byte pixels of level_type. 4 byte sources
+// are used in place, others are converted into 'out' (width*4 bytes), YUV
+// by way of 'rgb' (width*3 bytes).
+void JpegPyramid::source_row(int y, unsigned char *rgb, unsigned char *out,
+    const unsigned char **row) const
+{
+    int w = base.get_width();
+    buffer_type buf_type = base.get_buf_type();
+    const unsigned char *data = base.get_data();
+    const unsigned char *src;
+
+    if (buf_type == BUF_RGBA || buf_type == BUF_BGRA) {
+        *row = data + (size_t)y*base.get_stride();
+        return;
+    }
+
+    if (is_yuv(buf_type)) {
+        yuv_layout yuv(data, base.get_height(), base.get_stride(), buf_type);
+        yuv_to_rgb_row(yuv.y_row(y), yuv.y_step, yuv.u_row(y), yuv.v_row(y),
+            yuv.uv_step, rgb, w);
+        src = rgb;
+    }
+    else {
+        src = data + (size_t)y*base.get_stride();
+    }
+
+    for (int x = 0; x < w; x++, src += 3) {
+        out[4*x] = src[0];
+        out[4*x + 1] = src[1];
+        out[4*x + 2] = src[2];
+        out[4*x + 3] = 0xff;
+    }
+    *row = out;
+}
+
+// Builds levels 1/2 down to 1/2^shift. An odd last row is averaged with
+// itself, like an odd last column.
+void JpegPyramid::build(int shift) {
+    int w = base.get_width();
+    int h = base.get_height();
+
+    for (int k = 0; k < shift; k++) {
+        level l;
+        l.width = (w + 1)/2;
+        l.height = (h + 1)/2;
+        l.data = NULL;
+        if (l.width > 0 && l.height > 0) {
+            l.data = (unsigned char *)malloc((size_t)l.width*l.height*4);
+            if (!l.data) throw "malloc failed in JpegPyramid::encode.";
+        }
+        levels.push_back(l);
+        w = l.width;
+        h = l.height;
+    }
+
+    if (levels.empty() || !levels[0].data)
+        return;
+
+    // the first level reads the source, two rows of it at a time
+    w = base.get_width();
+    h = base.get_height();
+    unsigned char *scratch = (unsigned char *)malloc((size_t)w*11);
+    if (!scratch) throw "malloc failed in JpegPyramid::encode.";
+
+    level &first = levels[0];
+    for (int y = 0; y < first.height; y++) {
+        const unsigned char *a, *b;
+        source_row(2*y, scratch, scratch + w*3, &a);
+        if (2*y + 1 < h)
+            source_row(2*y + 1, scratch, scratch + w*7, &b);
+        else
+            b = a;
+        halve_row(a, b, first.data + (size_t)y*first.width*4, w);
+    }
+    free(scratch);
+
+    for (size_t k = 1; k < levels.size(); k++) {
+        const level &above = levels[k - 1];
+        level &l = levels[k];
+        size_t above_row = (size_t)above.width*4;
+        for (int y = 0; y < l.height; y++) {
+            const unsigned char *a = above.data + 2*y*above_row;
+            const unsigned char *b = 2*y + 1 < above.height ? a + above_row : a;
+            halve_row(a, b, l.data + (size_t)y*l.width*4, above.width);
+        }
+    }
+}
+
+void JpegPyramid::encode_output(void *arg, int index) {
+    JpegPyramid *pyramid = (JpegPyramid *)arg;
+    output &o = pyramid->outputs[index];
+
+    try {
+        JpegEncoder encoder(pyramid->base);
+        if (o.shift > 0) {
+            level &l = pyramid->levels[o.shift - 1];
+            encoder.set_source(l.data, l.width, l.height, pyramid->level_type);
+        }
+        if (o.quality >= 0)
+            encoder.set_quality(o.quality);
+        encoder.set_threads(pyramid->output_threads);
+        encoder.encode();
+        o.jpeg_len = encoder.get_jpeg_len();
+        o.jpeg = encoder.release_jpeg();
+    }
+    catch (const char *err) {
+        strncpy(o.error, err, sizeof(o.error) - 1);
+    }
+}
+
+void JpegPyramid::encode(int threads) {
+    int shift = 0;
+    for (size_t i = 0; i < outputs.size(); i++) {
+        if (outputs[i].shift > shift)
+            shift = outputs[i].shift;
+    }
+    build(shift);
+
+    // Outputs go to separate threads first; threads left over split up
+    // each output's encode.
+    int count = outputs.size();
+    output_threads = count > 0 && threads > count ? threads/count : 1;
+    parallel_for(count, threads, encode_output, this);
+
+    for (size_t i = 0; i < outputs.size(); i++) {
+        if (outputs[i].error[0])
+            throw jpeg_keep_message(outputs[i].error);
+    }
+}
+
+size_t JpegPyramid::size() const {
+    return outputs.size();
+}
+
+unsigned long JpegPyramid::get_jpeg_len(size_t i) const {
+    return outputs[i].jpeg_len;
+}
+
+unsigned char *JpegPyramid::release_jpeg(size_t i) {
+    unsigned char *ret = outputs[i].jpeg;
+    outputs[i].jpeg = NULL;
+    return ret;
+}
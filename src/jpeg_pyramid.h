@@ -0,0 +1,69 @@
+#ifndef JPEG_PYRAMID_H
+#define JPEG_PYRAMID_H
+
+#include <vector>
+
+#include "jpeg_encoder.h"
+
+// Smallest level is 1/2^MAX_PYRAMID_SHIFT of the source size.
+#define MAX_PYRAMID_SHIFT 6
+
+/*
+ * Encodes one source at several power-of-two fractions of its size.
+ *
+ * The reduced levels are built once per encode, each by 2x2 box filtering
+ * the one above it, so the source is read and converted a single time
+ * however many outputs there are. Levels are kept as 4 byte pixels in the
+ * source's channel order (RGBA for YUV and RGB input), which libjpeg-turbo
+ * compresses without a conversion pass and which the box filter handles a
+ * whole pixel per 32 bit lane. A level's size is half the one above,
+ * rounded up.
+ *
+ * Every output is compressed with the settings of the encoder the pyramid
+ * was made from, except for its own quality; scale 1 outputs encode the
+ * source directly.
+ */
+class JpegPyramid {
+    struct level {
+        unsigned char *data;
+        int width, height;
+    };
+
+    struct output {
+        int shift, quality; // quality < 0 keeps the encoder's
+        unsigned char *jpeg;
+        unsigned long jpeg_len;
+        char error[JMSG_LENGTH_MAX]; // empty unless the output failed
+    };
+
+    JpegEncoder base;
+    buffer_type level_type;
+    std::vector<level> levels; // levels[k] is the source scaled by 1/2^(k+1)
+    std::vector<output> outputs;
+    int output_threads;
+
+    JpegPyramid(const JpegPyramid &);
+    JpegPyramid &operator=(const JpegPyramid &);
+
+    void build(int shift);
+    void source_row(int y, unsigned char *rgb, unsigned char *out, const unsigned char **row) const;
+    static void encode_output(void *arg, int index);
+
+public:
+    JpegPyramid(const JpegEncoder &bbase);
+    ~JpegPyramid();
+
+    // Requests an output at 1/2^shift of the source size.
+    void add(int shift, int quality);
+
+    // Builds the levels and compresses the outputs, spread over up to
+    // 'threads' threads. Throws the first error of any output.
+    void encode(int threads);
+
+    size_t size() const;
+    unsigned long get_jpeg_len(size_t i) const;
+    unsigned char *release_jpeg(size_t i); // see JpegEncoder::release_jpeg
+};
+
+#endif
+
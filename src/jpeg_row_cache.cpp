@@ -0,0 +1,141 @@
+#include <cstdlib>
+#include <cstring>
+
+#include "jpeg_row_cache.h"
+#include "jpeg_encoder.h"
+#include "jpeg_segments.h"
+
+JpegRowCache::JpegRowCache(int wwidth, int hheight) :
+    width(wwidth), height(hheight), quality(-1), subsampling(SUBSAMPLE_420)
+{
+    uv_mutex_init(&lock);
+}
+
+JpegRowCache::~JpegRowCache() {
+    uv_mutex_destroy(&lock);
+}
+
+// Compresses MCU rows [first, first+count) of the canvas and stores their
+// scans, tagged with 'serials' (one per MCU row).
+void JpegRowCache::refresh(unsigned char *rgb, int first, int count, int mcu_h,
+    const unsigned long *serials, int threads, double *size_hint)
+{
+    int y = first*mcu_h;
+    int h = count*mcu_h;
+    if (y + h > height)
+        h = height - y;
+
+    JpegEncoder encoder(rgb, width, height, quality, BUF_RGB);
+    encoder.set_subsampling(subsampling);
+    encoder.set_restart_rows(true);
+    encoder.set_threads(threads);
+    encoder.set_size_hint(*size_hint);
+    encoder.setRect(Rect(0, y, width, h));
+    encoder.encode();
+    *size_hint = encoder.get_size_hint();
+
+    const unsigned char *out = encoder.get_jpeg();
+    size_t len = encoder.get_jpeg_len();
+    size_t start = jpeg_scan_start(out, len);
+    size_t end = jpeg_scan_end(out, len);
+
+    // The tables only depend on quality, subsampling and width, the height
+    // is patched to the full canvas.
+    if (header.empty()) {
+        header.assign(out, out + start);
+        jpeg_set_height(&header[0], header.size(), height);
+    }
+
+    size_t pos = start;
+    for (int i = 0; i < count; i++) {
+        size_t rst = jpeg_find_rst(out, end, pos);
+        if (rst == end && i != count - 1)
+            throw "Missing restart marker in JpegRowCache::refresh.";
+
+        mcu_row &row = rows[first + i];
+        row.scan.assign(out + pos, out + rst);
+        row.serial = serials[i];
+        row.valid = true;
+        pos = rst + 2;
+    }
+}
+
+// Joins the header and all cached rows into a malloc'd JPEG.
+unsigned char *JpegRowCache::splice(const jpeg_margins &margins, unsigned long *len) const {
+
+    size_t total = header.size() + 2;
+    for (size_t i = 0; i < rows.size(); i++)
+        total += rows[i].scan.size() + 2;
+
+    unsigned char *jpeg = (unsigned char *)malloc(margins.head + total + margins.tail);
+    if (!jpeg) throw "malloc failed in JpegRowCache::encode.";
+
+    unsigned char *p = jpeg + margins.head;
+    memcpy(p, &header[0], header.size());
+    p += header.size();
+    for (size_t i = 0; i < rows.size(); i++) {
+        if (i > 0)
+            p += jpeg_put_rst(p, i - 1);
+        if (!rows[i].scan.empty()) {
+            memcpy(p, &rows[i].scan[0], rows[i].scan.size());
+            p += rows[i].scan.size();
+        }
+    }
+    *p++ = 0xFF;
+    *p++ = 0xD9; // EOI
+
+    *len = p - (jpeg + margins.head);
+    return jpeg;
+}
+
+void JpegRowCache::encode(unsigned char *rgb, const std::vector<unsigned long> &serials,
+    int qquality, chroma_subsampling ssubsampling, int threads, double *size_hint,
+    const jpeg_margins &margins, unsigned char **jpeg, unsigned long *jpeg_len)
+{
+    JpegEncoder geometry(rgb, width, height, qquality, BUF_RGB);
+    geometry.set_subsampling(ssubsampling);
+    int mcu_h = geometry.mcu_height();
+    int mcu_rows = (height + mcu_h - 1)/mcu_h;
+
+    // The serial of an MCU row is the newest serial of its pixel rows.
+    std::vector<unsigned long> row_serials(mcu_rows, 0);
+    for (int y = 0; y < height; y++) {
+        if (serials[y] > row_serials[y/mcu_h])
+            row_serials[y/mcu_h] = serials[y];
+    }
+
+    uv_mutex_lock(&lock);
+
+    try {
+        if (qquality != quality || ssubsampling != subsampling
+            || (int)rows.size() != mcu_rows)
+        {
+            quality = qquality;
+            subsampling = ssubsampling;
+            header.clear();
+            rows.assign(mcu_rows, mcu_row());
+        }
+
+        // Recompress runs of consecutive stale rows, each with one encoder.
+        for (int i = 0; i < mcu_rows; ) {
+            if (rows[i].valid && rows[i].serial == row_serials[i]) {
+                i++;
+                continue;
+            }
+            int first = i;
+            while (i < mcu_rows && !(rows[i].valid && rows[i].serial == row_serials[i]))
+                i++;
+            refresh(rgb, first, i - first, mcu_h, &row_serials[first], threads, size_hint);
+        }
+
+        *jpeg = splice(margins, jpeg_len);
+    }
+    catch (const char *err) {
+        rows.assign(mcu_rows, mcu_row());
+        header.clear();
+        uv_mutex_unlock(&lock);
+        throw;
+    }
+
+    uv_mutex_unlock(&lock);
+}
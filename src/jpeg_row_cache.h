@@ -0,0 +1,55 @@
+#ifndef JPEG_ROW_CACHE_H
+#define JPEG_ROW_CACHE_H
+
+#include <uv.h>
+
+#include <vector>
+
+#include "common.h"
+#include "jpeg_destination.h"
+
+/*
+ * Incremental encoder for a fixed size RGB canvas.
+ *
+ * The canvas is encoded with a restart marker after every MCU row and the
+ * entropy-coded data of each row is kept. The caller tags every pixel row
+ * with the serial number of the last change to it; an encode recompresses
+ * only the MCU rows whose serial differs from the cached one and splices
+ * the rest from the cache (see jpeg_segments.h). The output is the same as
+ * a full encode with restart_in_rows = 1.
+ *
+ * Serials make the result independent of the order in which concurrent
+ * encodes of different canvas snapshots run: a row is reused only if it was
+ * encoded from the very same pixels. Encodes are serialized by a mutex.
+ */
+class JpegRowCache {
+    struct mcu_row {
+        std::vector<unsigned char> scan; // entropy-coded data, no RST marker
+        unsigned long serial;
+        bool valid;
+    };
+
+    int width, height, quality;
+    chroma_subsampling subsampling;
+    std::vector<unsigned char> header; // everything up to the scan data
+    std::vector<mcu_row> rows;
+    uv_mutex_t lock;
+
+    void refresh(unsigned char *rgb, int first, int count, int mcu_h,
+        const unsigned long *serials, int threads, double *size_hint);
+    unsigned char *splice(const jpeg_margins &margins, unsigned long *len) const;
+
+public:
+    JpegRowCache(int wwidth, int hheight);
+    ~JpegRowCache();
+
+    // Encodes canvas 'rgb' (width*height*3 bytes) whose pixel row y last
+    // changed at serials[y]. Returns a malloc'd JPEG in *jpeg and *jpeg_len,
+    // with 'margins' around it.
+    void encode(unsigned char *rgb, const std::vector<unsigned long> &serials,
+        int qquality, chroma_subsampling ssubsampling, int threads, double *size_hint,
+        const jpeg_margins &margins, unsigned char **jpeg, unsigned long *jpeg_len);
+};
+
+#endif
+
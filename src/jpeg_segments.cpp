@@ -0,0 +1,101 @@
+#include <cstring>
+
+#include "jpeg_segments.h"
+
+#define M_SOF0 0xC0
+#define M_SOF15 0xCF
+#define M_DHT 0xC4
+#define M_JPG 0xC8
+#define M_DAC 0xCC
+#define M_RST0 0xD0
+#define M_RST7 0xD7
+#define M_SOI 0xD8
+#define M_EOI 0xD9
+#define M_SOS 0xDA
+
+static size_t marker_length(const unsigned char *jpeg, size_t len, size_t pos) {
+    if (pos + 4 > len)
+        throw "Truncated JPEG marker segment.";
+    return 2 + ((jpeg[pos + 2] << 8) | jpeg[pos + 3]);
+}
+
+size_t jpeg_scan_start(const unsigned char *jpeg, size_t len) {
+    if (len < 2 || jpeg[0] != 0xFF || jpeg[1] != M_SOI)
+        throw "Not a JPEG stream.";
+
+    size_t pos = 2;
+    while (pos + 1 < len) {
+        if (jpeg[pos] != 0xFF)
+            throw "Corrupt JPEG header.";
+        unsigned char marker = jpeg[pos + 1];
+        if (marker == 0xFF) { // fill byte
+            pos++;
+            continue;
+        }
+        size_t seglen = marker_length(jpeg, len, pos);
+        if (marker == M_SOS)
+            return pos + seglen;
+        pos += seglen;
+    }
+    throw "No SOS marker in JPEG stream.";
+}
+
+size_t jpeg_scan_end(const unsigned char *jpeg, size_t len) {
+    if (len >= 2 && jpeg[len - 2] == 0xFF && jpeg[len - 1] == M_EOI)
+        return len - 2;
+    throw "No EOI marker at the end of JPEG stream.";
+}
+
+void jpeg_set_height(unsigned char *header, size_t len, int height) {
+    size_t pos = 2;
+    while (pos + 1 < len) {
+        unsigned char marker = header[pos + 1];
+        if (marker >= M_SOF0 && marker <= M_SOF15
+            && marker != M_DHT && marker != M_JPG && marker != M_DAC)
+        {
+            if (pos + 7 > len)
+                throw "Truncated SOF marker.";
+            header[pos + 5] = (height >> 8) & 0xFF;
+            header[pos + 6] = height & 0xFF;
+            return;
+        }
+        pos += marker_length(header, len, pos);
+    }
+    throw "No SOF marker in JPEG header.";
+}
+
+size_t jpeg_copy_scan(unsigned char *dst, const unsigned char *scan, size_t len,
+    int rst_offset)
+{
+    memcpy(dst, scan, len);
+    rst_offset &= 7;
+    if (rst_offset == 0)
+        return len;
+
+    // 0xFF in entropy-coded data is always followed by a stuffed 0x00 or by
+    // a marker, so any 0xFF 0xD0-0xD7 pair is a restart marker.
+    for (size_t i = 0; i + 1 < len; i++) {
+        if (dst[i] == 0xFF && dst[i + 1] >= M_RST0 && dst[i + 1] <= M_RST7) {
+            dst[i + 1] = M_RST0 + ((dst[i + 1] - M_RST0 + rst_offset) & 7);
+            i++;
+        }
+    }
+    return len;
+}
+
+size_t jpeg_find_rst(const unsigned char *scan, size_t len, size_t pos) {
+    for (; pos + 1 < len; pos++) {
+        if (scan[pos] != 0xFF)
+            continue;
+        if (scan[pos + 1] >= M_RST0 && scan[pos + 1] <= M_RST7)
+            return pos;
+        pos++; // stuffed 0x00
+    }
+    return len;
+}
+
+size_t jpeg_put_rst(unsigned char *dst, int row) {
+    dst[0] = 0xFF;
+    dst[1] = M_RST0 + (row & 7);
+    return 2;
+}
@@ -0,0 +1,40 @@
+#ifndef JPEG_SEGMENTS_H
+#define JPEG_SEGMENTS_H
+
+#include <cstddef>
+
+/*
+ * Helpers for splicing baseline JPEG streams together at restart markers.
+ *
+ * A stream produced by libjpeg with a restart interval of one MCU row can be
+ * cut into "segments", the entropy-coded data between two RST markers. Since
+ * every restart resets the DC predictors, segments encoded separately (as
+ * independent JPEGs with the same tables and width) can be joined into one
+ * valid image as long as the RST markers between them are numbered in
+ * sequence.
+ */
+
+// Returns the offset of the first entropy-coded byte (right after the SOS
+// header) of a single-scan JPEG. Throws if there is no SOS marker.
+size_t jpeg_scan_start(const unsigned char *jpeg, size_t len);
+
+// Returns the offset of the EOI marker that terminates the scan.
+size_t jpeg_scan_end(const unsigned char *jpeg, size_t len);
+
+// Rewrites the image height in the SOFn marker of a JPEG header.
+void jpeg_set_height(unsigned char *header, size_t len, int height);
+
+// Copies entropy-coded data to dst adding 'rst_offset' (mod 8) to the number
+// of every RST marker in it. Returns the number of bytes written, which is
+// always 'len'.
+size_t jpeg_copy_scan(unsigned char *dst, const unsigned char *scan, size_t len,
+    int rst_offset);
+
+// Returns the offset of the first RST marker at or after 'pos' in
+// entropy-coded data, or 'len' if there is none.
+size_t jpeg_find_rst(const unsigned char *scan, size_t len, size_t pos);
+
+// Writes the RST marker that follows MCU row 'row' (0xFF, 0xD0 + row%8).
+size_t jpeg_put_rst(unsigned char *dst, int row);
+
+#endif
@@ -0,0 +1,400 @@
+#include <node.h>
+#include <node_buffer.h>
+#include <cstdlib>
+#include <cstring>
+
+#include "common.h"
+#include "jpeg_transform.h"
+#include "buffer_compat.h"
+
+using namespace v8;
+using namespace node;
+
+void JpegTransform::Initialize(v8::Handle<v8::Object> target) {
+
+    Isolate* isolate = target->GetIsolate();
+
+    Local<FunctionTemplate> tpl = FunctionTemplate::New(isolate, New);
+    tpl->SetClassName(String::NewFromUtf8(isolate, "JpegTransform"));
+    tpl->InstanceTemplate()->SetInternalFieldCount(1);
+
+    NODE_SET_PROTOTYPE_METHOD(tpl, "transform", TransformAsync);
+    NODE_SET_PROTOTYPE_METHOD(tpl, "transformSync", TransformSync);
+    NODE_SET_PROTOTYPE_METHOD(tpl, "setRotation", SetRotation);
+    NODE_SET_PROTOTYPE_METHOD(tpl, "setFlip", SetFlip);
+    NODE_SET_PROTOTYPE_METHOD(tpl, "setCrop", SetCrop);
+    NODE_SET_PROTOTYPE_METHOD(tpl, "setQuality", SetQuality);
+    NODE_SET_PROTOTYPE_METHOD(tpl, "setOptimizeCoding", SetOptimizeCoding);
+
+    target->Set(String::NewFromUtf8(isolate, "JpegTransform"), tpl->GetFunction());
+    NODE_SET_METHOD(target, "requantize", Requantize);
+
+}
+
+JpegTransform::JpegTransform(const unsigned char *jpeg, size_t jpeg_len) :
+    transformer(jpeg, jpeg_len) {}
+
+JpegTransform::~JpegTransform() {
+    jpeg_buffer.Reset();
+}
+
+Local<Value> JpegTransform::TransformSync( Isolate * isolate ) {
+
+    try {
+        transformer.transform();
+    }
+    catch (const char *err) {
+        VException( isolate, err );
+        return Local<Value>();
+    }
+
+    int jpeg_len = transformer.get_jpeg_len();
+    // the Buffer takes ownership of the transformed JPEG
+    return BufferFromMalloc(isolate, (char *)transformer.release_jpeg(), jpeg_len);
+}
+
+void JpegTransform::New(const FunctionCallbackInfo<Value>& args) {
+
+    Isolate* isolate = args.GetIsolate();
+
+    if (args.Length() != 1) {
+        VException( isolate, "One argument required - jpeg buffer" );
+        return;
+    }
+
+    if (!Buffer::HasInstance(args[0])) {
+        VException( isolate, "First argument must be Buffer." );
+        return;
+    }
+
+    Local<Object> buffer = args[0]->ToObject();
+    JpegTransform *transform = new JpegTransform(
+        (unsigned char *)Buffer::Data(buffer),
+        Buffer::Length(buffer)
+    );
+
+    transform->jpeg_buffer.Reset(isolate, buffer);
+    transform->Wrap(args.This());
+
+}
+
+void JpegTransform::TransformSync(const FunctionCallbackInfo<Value>& args) {
+
+    JpegTransform *transform = ObjectWrap::Unwrap<JpegTransform>(args.This());
+    Local<Value> jpeg = transform->TransformSync( args.GetIsolate() );
+    if (!jpeg.IsEmpty())
+        args.GetReturnValue().Set(jpeg);
+
+}
+
+void JpegTransform::SetRotation(const FunctionCallbackInfo<Value>& args) {
+
+    Isolate* isolate = args.GetIsolate();
+
+    if (args.Length() != 1) {
+        VException( isolate, "One argument required - rotation in degrees" );
+        return;
+    }
+
+    if (!args[0]->IsInt32()) {
+        VException( isolate, "First argument must be integer degrees." );
+        return;
+    }
+
+    int degrees = args[0]->Int32Value();
+
+    if (degrees != 0 && degrees != 90 && degrees != 180 && degrees != 270) {
+        VException( isolate, "Rotation must be 0, 90, 180 or 270 degrees." );
+        return;
+    }
+
+    JpegTransform *transform = ObjectWrap::Unwrap<JpegTransform>(args.This());
+    transform->transformer.set_rotation(degrees);
+
+    Undefined( isolate );
+
+}
+
+void JpegTransform::SetFlip(const FunctionCallbackInfo<Value>& args) {
+
+    Isolate* isolate = args.GetIsolate();
+
+    if (args.Length() != 2) {
+        VException( isolate, "Two arguments required - flip horizontally and flip vertically" );
+        return;
+    }
+
+    if (!args[0]->IsBoolean() || !args[1]->IsBoolean()) {
+        VException( isolate, "Both arguments must be booleans." );
+        return;
+    }
+
+    JpegTransform *transform = ObjectWrap::Unwrap<JpegTransform>(args.This());
+    transform->transformer.set_flip(args[0]->BooleanValue(), args[1]->BooleanValue());
+
+    Undefined( isolate );
+
+}
+
+// setCrop(x, y, w, h) crops before flipping and rotating, setCrop() undoes it.
+void JpegTransform::SetCrop(const FunctionCallbackInfo<Value>& args) {
+
+    Isolate* isolate = args.GetIsolate();
+    JpegTransform *transform = ObjectWrap::Unwrap<JpegTransform>(args.This());
+
+    if (args.Length() == 0) {
+        transform->transformer.set_crop(Rect(0, 0, 0, 0));
+        Undefined( isolate );
+        return;
+    }
+
+    if (args.Length() != 4) {
+        VException( isolate, "Four arguments required - x, y, w, h" );
+        return;
+    }
+
+    if (!args[0]->IsInt32() || !args[1]->IsInt32() ||
+        !args[2]->IsInt32() || !args[3]->IsInt32())
+    {
+        VException( isolate, "Crop rectangle must be given as integers." );
+        return;
+    }
+
+    int x = args[0]->Int32Value();
+    int y = args[1]->Int32Value();
+    int w = args[2]->Int32Value();
+    int h = args[3]->Int32Value();
+
+    if (x < 0 || y < 0) {
+        VException( isolate, "Coordinates x and y must be >= 0." );
+        return;
+    }
+
+    if (w <= 0 || h <= 0) {
+        VException( isolate, "Width and height must be > 0." );
+        return;
+    }
+
+    transform->transformer.set_crop(Rect(x, y, w, h));
+
+    Undefined( isolate );
+
+}
+
+// setQuality(q) requantizes to libjpeg's tables for quality q, 0 keeps the
+// source's tables.
+void JpegTransform::SetQuality(const FunctionCallbackInfo<Value>& args) {
+
+    Isolate* isolate = args.GetIsolate();
+
+    if (args.Length() != 1) {
+        VException( isolate, "One argument required - quality" );
+        return;
+    }
+
+    if (!args[0]->IsInt32()) {
+        VException( isolate, "First argument must be integer quality" );
+        return;
+    }
+
+    int q = args[0]->Int32Value();
+
+    if (q < 0) {
+        VException( isolate, "Quality must be greater or equal to 0." );
+        return;
+    }
+
+    if (q > 100) {
+        VException( isolate, "Quality must be less than or equal to 100." );
+        return;
+    }
+
+    JpegTransform *transform = ObjectWrap::Unwrap<JpegTransform>(args.This());
+    transform->transformer.set_quality(q);
+
+    Undefined( isolate );
+
+}
+
+void JpegTransform::SetOptimizeCoding(const FunctionCallbackInfo<Value>& args) {
+
+    Isolate* isolate = args.GetIsolate();
+
+    if (args.Length() != 1 || !args[0]->IsBoolean()) {
+        VException( isolate, "One boolean argument required - optimize coding" );
+        return;
+    }
+
+    JpegTransform *transform = ObjectWrap::Unwrap<JpegTransform>(args.This());
+    transform->transformer.set_optimize_coding(args[0]->BooleanValue());
+
+    Undefined( isolate );
+
+}
+
+void JpegTransform::UV_Transform(uv_work_t *req) {
+
+    transform_request *tr_req = (transform_request *)req->data;
+
+    try {
+        tr_req->transformer.transform();
+    }
+    catch (const char *err) {
+        tr_req->error = strdup(err);
+    }
+}
+
+void JpegTransform::UV_TransformAfter(uv_work_t *req) {
+
+    transform_request *tr_req = (transform_request *)req->data;
+    Isolate *isolate = tr_req->isolate;
+    HandleScope scope(isolate);
+    delete req;
+
+    JpegTransform *transform = (JpegTransform *)tr_req->transform_obj;
+
+    Handle<Value> argv[3];
+
+    if (tr_req->error) {
+        argv[0] = Undefined( isolate );
+        argv[1] = Undefined( isolate );
+        argv[2] = ErrorException( isolate, tr_req->error );
+    }
+    else {
+        int jpeg_len = tr_req->transformer.get_jpeg_len();
+        argv[0] = BufferFromMalloc(isolate,
+            (char *)tr_req->transformer.release_jpeg(), jpeg_len);
+
+        Local<Object> dim = Object::New(isolate);
+        dim->Set(String::NewFromUtf8(isolate, "width"),
+            Integer::New(isolate, tr_req->transformer.get_width()));
+        dim->Set(String::NewFromUtf8(isolate, "height"),
+            Integer::New(isolate, tr_req->transformer.get_height()));
+        argv[1] = dim;
+        argv[2] = Undefined( isolate );
+    }
+
+    TryCatch try_catch( isolate );
+
+    Local<Function>::New(isolate, tr_req->callback)->Call( Null( isolate ), 3, argv );
+
+    if (try_catch.HasCaught()) {
+        FatalException( isolate, try_catch );
+    }
+
+    tr_req->callback.Reset();
+    tr_req->source.Reset();
+    free(tr_req->error);
+
+    if (transform)
+        transform->Unref();
+    delete tr_req;
+}
+
+// transform.transform(callback) - callback(jpeg, dims, error)
+void JpegTransform::TransformAsync(const FunctionCallbackInfo<Value>& args) {
+
+    Isolate* isolate = args.GetIsolate();
+
+    if (args.Length() != 1) {
+        VException( isolate, "One argument required - callback function." );
+        return;
+    }
+
+    if (!args[0]->IsFunction()) {
+        VException( isolate, "First argument must be a function." );
+        return;
+    }
+
+    Local<Function> callback = Local<Function>::Cast(args[0]);
+    JpegTransform *transform = ObjectWrap::Unwrap<JpegTransform>(args.This());
+
+    transform_request *tr_req = new transform_request(transform->transformer);
+
+    tr_req->callback.Reset(isolate, callback);
+    tr_req->isolate = isolate;
+    tr_req->transform_obj = transform;
+    tr_req->error = NULL;
+
+    uv_work_t* req = new uv_work_t;
+    req->data = tr_req;
+    uv_queue_work(uv_default_loop(), req, UV_Transform, (uv_after_work_cb)UV_TransformAfter);
+
+    transform->Ref();
+
+    Undefined( isolate );
+
+}
+
+// requantize(buffer, quality, [optimize], [callback]) - the jpeg with its
+// coefficients requantized for 'quality'. With a callback it runs on the
+// threadpool and calls callback(jpeg, dims, error).
+void JpegTransform::Requantize(const FunctionCallbackInfo<Value>& args) {
+
+    Isolate* isolate = args.GetIsolate();
+
+    int argc = args.Length();
+    Local<Function> callback;
+    if (argc > 0 && args[argc - 1]->IsFunction()) {
+        callback = Local<Function>::Cast(args[argc - 1]);
+        argc--;
+    }
+
+    if (argc < 2 || argc > 3) {
+        VException( isolate, "Two or three arguments required - jpeg buffer, quality, [optimize coding] and [callback]" );
+        return;
+    }
+
+    if (!Buffer::HasInstance(args[0])) {
+        VException( isolate, "First argument must be Buffer." );
+        return;
+    }
+
+    if (!args[1]->IsInt32() || args[1]->Int32Value() < 1 || args[1]->Int32Value() > 100) {
+        VException( isolate, "Quality must be an integer from 1 to 100." );
+        return;
+    }
+
+    if (argc == 3 && !args[2]->IsBoolean()) {
+        VException( isolate, "Third argument must be boolean optimize coding." );
+        return;
+    }
+
+    Local<Object> buffer = args[0]->ToObject();
+    JpegTransformer transformer(
+        (unsigned char *)Buffer::Data(buffer),
+        Buffer::Length(buffer)
+    );
+    transformer.set_quality(args[1]->Int32Value());
+    transformer.set_optimize_coding(argc == 3 && args[2]->BooleanValue());
+
+    if (callback.IsEmpty()) {
+        try {
+            transformer.transform();
+        }
+        catch (const char *err) {
+            VException( isolate, err );
+            return;
+        }
+
+        int jpeg_len = transformer.get_jpeg_len();
+        args.GetReturnValue().Set(
+            BufferFromMalloc(isolate, (char *)transformer.release_jpeg(), jpeg_len));
+        return;
+    }
+
+    transform_request *tr_req = new transform_request(transformer);
+
+    tr_req->callback.Reset(isolate, callback);
+    tr_req->source.Reset(isolate, buffer);
+    tr_req->isolate = isolate;
+    tr_req->transform_obj = NULL;
+    tr_req->error = NULL;
+
+    uv_work_t* req = new uv_work_t;
+    req->data = tr_req;
+    uv_queue_work(uv_default_loop(), req, UV_Transform, (uv_after_work_cb)UV_TransformAfter);
+
+    Undefined( isolate );
+
+}
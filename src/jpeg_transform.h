@@ -0,0 +1,57 @@
+#ifndef JPEG_TRANSFORM_H
+#define JPEG_TRANSFORM_H
+
+#include <node.h>
+#include <node_buffer.h>
+#include <node_object_wrap.h>
+
+#include <uv.h>
+
+#include "common.h"
+#include "jpeg_transformer.h"
+
+using v8::Function;
+using v8::FunctionCallbackInfo;
+using v8::FunctionTemplate;
+using v8::Isolate;
+using v8::Value;
+
+struct transform_request {
+    v8::Persistent<v8::Function> callback;
+    v8::Isolate * isolate;
+    void *transform_obj;           // NULL for requantize()
+    v8::Persistent<v8::Object> source; // jpeg buffer of requantize()
+    JpegTransformer transformer; // settings as of the transform call
+    char *error;
+
+    transform_request(const JpegTransformer &t) : transformer(t) {}
+};
+
+class JpegTransform : public node::ObjectWrap {
+    JpegTransformer transformer;
+    v8::Persistent<v8::Object> jpeg_buffer; // keeps the source JPEG alive
+
+    static void UV_Transform(uv_work_t *req);
+    static void UV_TransformAfter(uv_work_t *req);
+
+public:
+    static void Initialize(v8::Handle<v8::Object> target);
+
+    JpegTransform(const unsigned char *jpeg, size_t jpeg_len);
+    ~JpegTransform();
+
+    v8::Local<v8::Value> TransformSync( Isolate * isolate );
+
+    static void New(const FunctionCallbackInfo<Value>& args);
+    static void TransformSync(const FunctionCallbackInfo<Value>& args);
+    static void TransformAsync(const FunctionCallbackInfo<Value>& args);
+    static void SetRotation(const FunctionCallbackInfo<Value>& args);
+    static void SetFlip(const FunctionCallbackInfo<Value>& args);
+    static void SetCrop(const FunctionCallbackInfo<Value>& args);
+    static void SetQuality(const FunctionCallbackInfo<Value>& args);
+    static void SetOptimizeCoding(const FunctionCallbackInfo<Value>& args);
+    static void Requantize(const FunctionCallbackInfo<Value>& args);
+};
+
+#endif
+
@@ -0,0 +1,356 @@
+#include <cstdlib>
+#include <cstring>
+
+#include "jpeg_transformer.h"
+#include "jpeg_destination.h"
+#include "jpeg_errors.h"
+
+// A transform of the block grid and of every block in it: transpose first,
+// then mirror horizontally and/or vertically. All eight rotations and flips
+// of a rectangle can be written this way.
+struct block_transform {
+    bool transpose, hflip, vflip;
+};
+
+// Returns 'second' applied after 'first'. Transposing turns a horizontal
+// flip that came before it into a vertical one and vice versa.
+static block_transform
+compose(const block_transform &first, const block_transform &second)
+{
+    block_transform r;
+    r.transpose = first.transpose != second.transpose;
+    r.hflip = second.hflip != (second.transpose ? first.vflip : first.hflip);
+    r.vflip = second.vflip != (second.transpose ? first.hflip : first.vflip);
+    return r;
+}
+
+// Where each coefficient of a transformed block comes from. Coefficients are
+// in natural order, coefficient (u, v) at [v*DCTSIZE + u]. Mirroring a block
+// negates its odd horizontal (or vertical) frequencies.
+struct coef_map {
+    int index[DCTSIZE2];
+    int sign[DCTSIZE2];
+};
+
+static void
+build_coef_map(const block_transform &t, coef_map *map)
+{
+    for (int v = 0; v < DCTSIZE; v++) {
+        for (int u = 0; u < DCTSIZE; u++) {
+            int i = v*DCTSIZE + u;
+            map->index[i] = t.transpose ? u*DCTSIZE + v : i;
+            map->sign[i] = ((t.hflip && (u & 1)) != (t.vflip && (v & 1))) ? -1 : 1;
+        }
+    }
+}
+
+static void
+transform_block(const JCOEF *src, JCOEF *dst, const coef_map &map)
+{
+    for (int i = 0; i < DCTSIZE2; i++)
+        dst[i] = (JCOEF)(src[map.index[i]]*map.sign[i]);
+}
+
+static void
+transpose_quant_table(JQUANT_TBL *table)
+{
+    for (int v = 0; v < DCTSIZE; v++) {
+        for (int u = v + 1; u < DCTSIZE; u++) {
+            UINT16 q = table->quantval[v*DCTSIZE + u];
+            table->quantval[v*DCTSIZE + u] = table->quantval[u*DCTSIZE + v];
+            table->quantval[u*DCTSIZE + v] = q;
+        }
+    }
+}
+
+// Rescales quantized coefficients by old quantizer / new quantizer, rounding
+// to nearest.
+static void
+requantize_block(JCOEF *block, const float *ratio)
+{
+    for (int i = 0; i < DCTSIZE2; i++) {
+        float c = block[i]*ratio[i];
+        block[i] = (JCOEF)(c >= 0 ? c + 0.5f : c - 0.5f);
+    }
+}
+
+JpegTransformer::JpegTransformer(const unsigned char *jjpeg, size_t jjpeg_len) :
+    jpeg(jjpeg), jpeg_len(jjpeg_len),
+    rotation(0), flip_h(false), flip_v(false), crop(0, 0, 0, 0),
+    quality(0), optimize_coding(false),
+    out(NULL), out_len(0), out_width(0), out_height(0) {}
+
+// Copies the source and the settings, not the output.
+JpegTransformer::JpegTransformer(const JpegTransformer &other) :
+    jpeg(other.jpeg), jpeg_len(other.jpeg_len),
+    rotation(other.rotation), flip_h(other.flip_h), flip_v(other.flip_v),
+    crop(other.crop), quality(other.quality), optimize_coding(other.optimize_coding),
+    out(NULL), out_len(0), out_width(0), out_height(0) {}
+
+JpegTransformer::~JpegTransformer() {
+    free(out);
+}
+
+void JpegTransformer::set_rotation(int degrees) {
+    rotation = degrees;
+}
+
+void JpegTransformer::set_flip(bool horizontal, bool vertical) {
+    flip_h = horizontal;
+    flip_v = vertical;
+}
+
+void JpegTransformer::set_crop(const Rect &r) {
+    crop = r;
+}
+
+void JpegTransformer::set_quality(int qquality) {
+    quality = qquality;
+}
+
+void JpegTransformer::set_optimize_coding(bool optimize) {
+    optimize_coding = optimize;
+}
+
+unsigned char *JpegTransformer::release_jpeg() {
+    unsigned char *ret = out;
+    out = NULL;
+    return ret;
+}
+
+void JpegTransformer::transform() {
+
+    free(out);
+    out = NULL;
+    out_len = 0;
+
+    block_transform flip = { false, flip_h, flip_v };
+    block_transform rotate = { false, false, false };
+    switch (rotation) {
+    case 0: break;
+    case 90: rotate.transpose = true; rotate.hflip = true; break;
+    case 180: rotate.hflip = true; rotate.vflip = true; break;
+    case 270: rotate.transpose = true; rotate.vflip = true; break;
+    default: throw "Rotation must be 0, 90, 180 or 270 degrees.";
+    }
+    block_transform t = compose(flip, rotate);
+
+    struct jpeg_decompress_struct dinfo;
+    struct jpeg_compress_struct cinfo;
+    jump_error_mgr jerr;
+
+    // Zeroed so that destroying a struct that was never created is a no-op.
+    memset(&dinfo, 0, sizeof(dinfo));
+    memset(&cinfo, 0, sizeof(cinfo));
+    dinfo.err = jpeg_jump_error(&jerr);
+    cinfo.err = &jerr.pub;
+
+    const char *error = NULL;
+
+    if (setjmp(jerr.jump)) {
+        error = jpeg_error_message((j_common_ptr)&dinfo);
+    }
+    else {
+        try {
+            jpeg_create_decompress(&dinfo);
+            jpeg_create_compress(&cinfo);
+
+            jpeg_mem_src(&dinfo, (unsigned char *)jpeg, jpeg_len);
+            jpeg_read_header(&dinfo, TRUE);
+            jvirt_barray_ptr *src = jpeg_read_coefficients(&dinfo);
+
+            int width = dinfo.image_width, height = dinfo.image_height;
+            int imcu_w = dinfo.max_h_samp_factor*DCTSIZE;
+            int imcu_h = dinfo.max_v_samp_factor*DCTSIZE;
+
+            // Source region, its origin on the MCU grid.
+            int x0 = 0, y0 = 0, w = width, h = height;
+            if (!crop.isNull()) {
+                if (crop.x >= width || crop.y >= height || crop.w <= 0 || crop.h <= 0)
+                    throw "Crop rectangle is outside the image.";
+                x0 = crop.x/imcu_w*imcu_w;
+                y0 = crop.y/imcu_h*imcu_h;
+                w = (crop.x + crop.w < width ? crop.x + crop.w : width) - x0;
+                h = (crop.y + crop.h < height ? crop.y + crop.h : height) - y0;
+            }
+
+            // Trim the partial MCU off source axes that end up mirrored.
+            if (t.hflip) {
+                if (t.transpose) h = h/imcu_h*imcu_h;
+                else w = w/imcu_w*imcu_w;
+            }
+            if (t.vflip) {
+                if (t.transpose) w = w/imcu_w*imcu_w;
+                else h = h/imcu_h*imcu_h;
+            }
+            if (w == 0 || h == 0)
+                throw "Image is too small to transform losslessly.";
+
+            out_width = t.transpose ? h : w;
+            out_height = t.transpose ? w : h;
+
+            jpeg_copy_critical_parameters(&dinfo, &cinfo);
+            cinfo.image_width = out_width;
+            cinfo.image_height = out_height;
+
+            // Transposed coefficients need transposed quantization tables.
+            if (t.transpose) {
+                for (int i = 0; i < NUM_QUANT_TBLS; i++) {
+                    if (cinfo.quant_tbl_ptrs[i])
+                        transpose_quant_table(cinfo.quant_tbl_ptrs[i]);
+                }
+            }
+
+            // Requantizing keeps the source tables (as they are now, maybe
+            // transposed) to rescale the coefficients from.
+            UINT16 old_tables[NUM_QUANT_TBLS][DCTSIZE2];
+            bool have_old[NUM_QUANT_TBLS];
+            for (int i = 0; i < NUM_QUANT_TBLS; i++) {
+                have_old[i] = quality > 0 && cinfo.quant_tbl_ptrs[i];
+                if (have_old[i])
+                    memcpy(old_tables[i], cinfo.quant_tbl_ptrs[i]->quantval, sizeof(old_tables[i]));
+            }
+            if (quality > 0) {
+                jpeg_set_quality(&cinfo, quality, TRUE);
+                for (int i = 0; i < NUM_QUANT_TBLS; i++) {
+                    if (!have_old[i])
+                        continue;
+                    UINT16 *q = cinfo.quant_tbl_ptrs[i]->quantval;
+                    for (int k = 0; k < DCTSIZE2; k++) {
+                        if (q[k] < old_tables[i][k])
+                            q[k] = old_tables[i][k];
+                    }
+                }
+            }
+            cinfo.optimize_coding = optimize_coding ? TRUE : FALSE;
+
+            int max_h = 1, max_v = 1;
+            for (int ci = 0; ci < cinfo.num_components; ci++) {
+                jpeg_component_info *comp = &cinfo.comp_info[ci];
+                if (t.transpose) {
+                    int s = comp->h_samp_factor;
+                    comp->h_samp_factor = comp->v_samp_factor;
+                    comp->v_samp_factor = s;
+                }
+                if (comp->h_samp_factor > max_h) max_h = comp->h_samp_factor;
+                if (comp->v_samp_factor > max_v) max_v = comp->v_samp_factor;
+            }
+
+            // Blocks that stay where they are are written straight from the
+            // source arrays, requantized in place if at all.
+            bool in_place = !t.transpose && !t.hflip && !t.vflip && x0 == 0 && y0 == 0;
+
+            // Destination block grids: exact size for the flip arithmetic,
+            // allocated up to whole MCUs like libjpeg does.
+            int blocks_w[MAX_COMPONENTS], blocks_h[MAX_COMPONENTS];
+            jvirt_barray_ptr dst[MAX_COMPONENTS];
+            for (int ci = 0; ci < cinfo.num_components; ci++) {
+                jpeg_component_info *comp = &cinfo.comp_info[ci];
+                blocks_w[ci] = (out_width*comp->h_samp_factor + max_h*DCTSIZE - 1)/(max_h*DCTSIZE);
+                blocks_h[ci] = (out_height*comp->v_samp_factor + max_v*DCTSIZE - 1)/(max_v*DCTSIZE);
+                dst[ci] = in_place ? src[ci] : (*cinfo.mem->request_virt_barray)(
+                    (j_common_ptr)&cinfo, JPOOL_IMAGE, FALSE,
+                    (blocks_w[ci] + comp->h_samp_factor - 1)/comp->h_samp_factor*comp->h_samp_factor,
+                    (blocks_h[ci] + comp->v_samp_factor - 1)/comp->v_samp_factor*comp->v_samp_factor,
+                    comp->v_samp_factor);
+            }
+
+            unsigned long expected =
+                (unsigned long)((double)jpeg_len*out_width*out_height/((double)width*height)) + 1024;
+            jpeg_output_dest(&cinfo, &out, &out_len, expected, NULL);
+
+            jpeg_write_coefficients(&cinfo, dst);
+
+            coef_map map;
+            build_coef_map(t, &map);
+
+            for (int ci = 0; ci < cinfo.num_components; ci++) {
+                jpeg_component_info *scomp = &dinfo.comp_info[ci];
+                jpeg_component_info *dcomp = &cinfo.comp_info[ci];
+                int src_w = (scomp->width_in_blocks + scomp->h_samp_factor - 1)
+                    /scomp->h_samp_factor*scomp->h_samp_factor;
+                int src_h = (scomp->height_in_blocks + scomp->v_samp_factor - 1)
+                    /scomp->v_samp_factor*scomp->v_samp_factor;
+                int off_x = x0/imcu_w*scomp->h_samp_factor;
+                int off_y = y0/imcu_h*scomp->v_samp_factor;
+                int rows = (blocks_h[ci] + dcomp->v_samp_factor - 1)/dcomp->v_samp_factor*dcomp->v_samp_factor;
+                int cols = (blocks_w[ci] + dcomp->h_samp_factor - 1)/dcomp->h_samp_factor*dcomp->h_samp_factor;
+
+                float ratio[DCTSIZE2];
+                bool requantize = false;
+                if (have_old[dcomp->quant_tbl_no]) {
+                    const UINT16 *from = old_tables[dcomp->quant_tbl_no];
+                    const UINT16 *to = cinfo.quant_tbl_ptrs[dcomp->quant_tbl_no]->quantval;
+                    for (int k = 0; k < DCTSIZE2; k++) {
+                        ratio[k] = (float)from[k]/to[k];
+                        if (from[k] != to[k])
+                            requantize = true;
+                    }
+                }
+
+                if (in_place) {
+                    if (!requantize)
+                        continue;
+                    for (int dy = 0; dy < rows; dy++) {
+                        JBLOCKROW row = (*dinfo.mem->access_virt_barray)(
+                            (j_common_ptr)&dinfo, src[ci], dy, 1, TRUE)[0];
+                        for (int dx = 0; dx < cols; dx++)
+                            requantize_block(row[dx], ratio);
+                    }
+                    continue;
+                }
+
+                for (int dy = 0; dy < rows; dy++) {
+                    JBLOCKROW drow = (*cinfo.mem->access_virt_barray)(
+                        (j_common_ptr)&cinfo, dst[ci], dy, 1, TRUE)[0];
+                    int yp = t.vflip ? blocks_h[ci] - 1 - dy : dy;
+
+                    // Without a transpose the whole row comes from one
+                    // source row.
+                    JBLOCKROW srow = NULL;
+                    if (!t.transpose && yp >= 0 && yp + off_y < src_h) {
+                        srow = (*dinfo.mem->access_virt_barray)(
+                            (j_common_ptr)&dinfo, src[ci], yp + off_y, 1, FALSE)[0];
+                    }
+
+                    for (int dx = 0; dx < cols; dx++) {
+                        int xp = t.hflip ? blocks_w[ci] - 1 - dx : dx;
+                        int sx = (t.transpose ? yp : xp) + off_x;
+                        int sy = (t.transpose ? xp : yp) + off_y;
+
+                        // Padding blocks past a mirrored edge; libjpeg
+                        // replaces them with its own dummy blocks anyway.
+                        if (xp < 0 || yp < 0 || sx >= src_w || sy >= src_h) {
+                            memset(drow[dx], 0, sizeof(JBLOCK));
+                            continue;
+                        }
+
+                        if (t.transpose) {
+                            srow = (*dinfo.mem->access_virt_barray)(
+                                (j_common_ptr)&dinfo, src[ci], sy, 1, FALSE)[0];
+                        }
+                        transform_block(srow[sx], drow[dx], map);
+                        if (requantize)
+                            requantize_block(drow[dx], ratio);
+                    }
+                }
+            }
+
+            jpeg_finish_compress(&cinfo);
+            jpeg_finish_decompress(&dinfo);
+        }
+        catch (const char *err) {
+            error = err;
+        }
+    }
+
+    jpeg_destroy_compress(&cinfo);
+    jpeg_destroy_decompress(&dinfo);
+
+    if (error) {
+        free(out);
+        out = NULL;
+        out_len = 0;
+        throw error;
+    }
+}
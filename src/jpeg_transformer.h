@@ -0,0 +1,64 @@
+#ifndef JPEG_TRANSFORMER_H
+#define JPEG_TRANSFORMER_H
+
+#include <cstdio>
+#include <cstddef>
+#include <jpeglib.h>
+#include "common.h"
+
+/*
+ * Lossless jpegtran-style transforms of a JPEG held in memory.
+ *
+ * The quantized DCT coefficients are read with jpeg_read_coefficients,
+ * rearranged block by block and written with jpeg_write_coefficients, so
+ * nothing is decoded to pixels and no quality is lost. The transform is an
+ * optional crop (in source pixels, x and y rounded down to the MCU grid),
+ * then an optional flip, then a rotation by a multiple of 90 degrees.
+ *
+ * Flipping an axis is only lossless if it's a whole number of MCUs long, so
+ * a partial MCU at the far edge of a flipped axis is trimmed, like
+ * jpegtran -trim. Markers other than the image data (EXIF, ICC, comments)
+ * are not copied.
+ *
+ * With set_quality() the coefficients are also requantized to libjpeg's
+ * tables for that quality, which shrinks the JPEG without decoding it or
+ * adding another round of pixel-domain loss. No quantizer ends up finer
+ * than the source's, since that would cost bytes and add nothing.
+ */
+class JpegTransformer {
+    const unsigned char *jpeg;
+    size_t jpeg_len;
+
+    int rotation; // 0, 90, 180 or 270 degrees clockwise
+    bool flip_h, flip_v;
+    Rect crop;    // isNull() for the whole image
+    int quality;  // 0 keeps the source's quantization tables
+    bool optimize_coding;
+
+    unsigned char *out;
+    unsigned long out_len;
+    int out_width, out_height;
+
+public:
+    JpegTransformer(const unsigned char *jjpeg, size_t jjpeg_len);
+    JpegTransformer(const JpegTransformer &other);
+    ~JpegTransformer();
+
+    void set_rotation(int degrees);
+    void set_flip(bool horizontal, bool vertical);
+    void set_crop(const Rect &r);
+    void set_quality(int qquality);
+    void set_optimize_coding(bool optimize);
+
+    // Throws on invalid or unsupported JPEGs and when trimming leaves
+    // nothing of the image.
+    void transform();
+
+    int get_width() const { return out_width; }
+    int get_height() const { return out_height; }
+    unsigned int get_jpeg_len() const { return out_len; }
+    unsigned char *release_jpeg();
+};
+
+#endif
+
@@ -0,0 +1,267 @@
+#include <cctype>
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+
+#include "mjpeg_container.h"
+
+// RIFF, hdrl list (avih, strl list with strh and strf) and the movi list
+// header, everything in front of the first chunk.
+#define AVI_HEADER_SIZE 224
+#define AVI_HDRL_SIZE 192
+#define AVI_STRL_SIZE 116
+#define AVI_CHUNK_HEADER 8
+#define AVI_INDEX_ENTRY 16
+
+#define AVIF_HASINDEX 0x10
+#define AVIIF_KEYFRAME 0x10
+
+// Frame rate written to AVIs without one.
+#define AVI_DEFAULT_FPS 25
+
+// AVI 1.0 readers commonly stop at 1 GB; stop taking frames before that.
+#define AVI_MAX_MOVI (1u << 30)
+
+// Content-Length is written as this many characters, right aligned, so the
+// part header is the same length before and after the jpeg is compressed.
+#define CONTENT_LENGTH_DIGITS 10
+
+static unsigned char *put_u32(unsigned char *p, uint32_t v) {
+    p[0] = v & 0xff;
+    p[1] = (v >> 8) & 0xff;
+    p[2] = (v >> 16) & 0xff;
+    p[3] = (v >> 24) & 0xff;
+    return p + 4;
+}
+
+static unsigned char *put_u16(unsigned char *p, uint16_t v) {
+    p[0] = v & 0xff;
+    p[1] = (v >> 8) & 0xff;
+    return p + 2;
+}
+
+static unsigned char *put_fourcc(unsigned char *p, const char *fourcc) {
+    memcpy(p, fourcc, 4);
+    return p + 4;
+}
+
+MjpegContainer::MjpegContainer(mjpeg_format fformat, int wwidth, int hheight,
+    double ffps, const std::string &bboundary) :
+    format(fformat), width(wwidth), height(hheight), fps(ffps), boundary(bboundary),
+    start(0), last_slot(-1), skipped(0),
+    movi_size(4), max_chunk(0) {}
+
+bool MjpegContainer::admit(uint64_t now) {
+    if (format == MJPEG_AVI && movi_size >= AVI_MAX_MOVI)
+        throw "AVI stream reached its size limit.";
+
+    if (fps <= 0) {
+        last_slot++;
+        return true;
+    }
+
+    if (last_slot < 0) {
+        start = now;
+        last_slot = 0;
+        return true;
+    }
+
+    long slot = (long)floor((double)(now - start)*fps/1e9);
+    if (slot <= last_slot)
+        return false;
+
+    if (format == MJPEG_AVI)
+        skipped += slot - last_slot - 1;
+    last_slot = slot;
+    return true;
+}
+
+void MjpegContainer::skip() {
+    if (format == MJPEG_AVI)
+        skipped++;
+}
+
+std::string MjpegContainer::part_header(unsigned long jpeg_len) const {
+    char length[32];
+    snprintf(length, sizeof(length), "%*lu", CONTENT_LENGTH_DIGITS, jpeg_len);
+    return "--" + boundary + "\r\n"
+        "Content-Type: image/jpeg\r\n"
+        "Content-Length: " + length + "\r\n"
+        "\r\n";
+}
+
+jpeg_margins MjpegContainer::margins() const {
+    if (format == MJPEG_MULTIPART)
+        return jpeg_margins(part_header(0).size(), 2);
+
+    size_t head = (skipped + 1)*AVI_CHUNK_HEADER;
+    if (index.empty())
+        head += AVI_HEADER_SIZE;
+    return jpeg_margins(head, 1); // chunks are padded to even sizes
+}
+
+size_t MjpegContainer::frame(unsigned char *buf, unsigned long jpeg_len) const {
+    jpeg_margins m = margins();
+    unsigned char *p = buf;
+
+    if (format == MJPEG_MULTIPART) {
+        std::string h = part_header(jpeg_len);
+        memcpy(p, h.data(), h.size());
+        p += m.head + jpeg_len;
+        *p++ = '\r';
+        *p++ = '\n';
+        return p - buf;
+    }
+
+    if (index.empty()) {
+        std::vector<unsigned char> h = header();
+        memcpy(p, &h[0], h.size());
+        p += h.size();
+    }
+    for (int i = 0; i < skipped; i++) {
+        p = put_fourcc(p, "00dc");
+        p = put_u32(p, 0);
+    }
+    p = put_fourcc(p, "00dc");
+    p = put_u32(p, jpeg_len);
+    p += jpeg_len;
+    if (jpeg_len & 1)
+        *p++ = 0;
+    return p - buf;
+}
+
+void MjpegContainer::record(unsigned long jpeg_len) {
+    if (format == MJPEG_MULTIPART)
+        return;
+
+    for (; skipped > 0; skipped--) {
+        index_entry e = { 0, movi_size, 0 };
+        index.push_back(e);
+        movi_size += AVI_CHUNK_HEADER;
+    }
+
+    index_entry e = { AVIIF_KEYFRAME, movi_size, (uint32_t)jpeg_len };
+    index.push_back(e);
+    movi_size += AVI_CHUNK_HEADER + jpeg_len + (jpeg_len & 1);
+    if (jpeg_len > max_chunk)
+        max_chunk = jpeg_len;
+}
+
+std::vector<unsigned char> MjpegContainer::header() const {
+    std::vector<unsigned char> h;
+    if (format == MJPEG_MULTIPART)
+        return h;
+
+    double rate = fps > 0 ? fps : AVI_DEFAULT_FPS;
+    uint32_t frames = index.size();
+    uint32_t index_size = AVI_INDEX_ENTRY*frames;
+
+    h.resize(AVI_HEADER_SIZE);
+    unsigned char *p = &h[0];
+
+    p = put_fourcc(p, "RIFF");
+    p = put_u32(p, 4 + (AVI_CHUNK_HEADER + AVI_HDRL_SIZE)
+        + (AVI_CHUNK_HEADER + movi_size) + (AVI_CHUNK_HEADER + index_size));
+    p = put_fourcc(p, "AVI ");
+
+    p = put_fourcc(p, "LIST");
+    p = put_u32(p, AVI_HDRL_SIZE);
+    p = put_fourcc(p, "hdrl");
+
+    p = put_fourcc(p, "avih");
+    p = put_u32(p, 56);
+    p = put_u32(p, (uint32_t)(1e6/rate + 0.5)); // dwMicroSecPerFrame
+    p = put_u32(p, (uint32_t)(max_chunk*rate)); // dwMaxBytesPerSec
+    p = put_u32(p, 0);                          // dwPaddingGranularity
+    p = put_u32(p, AVIF_HASINDEX);
+    p = put_u32(p, frames);                     // dwTotalFrames
+    p = put_u32(p, 0);                          // dwInitialFrames
+    p = put_u32(p, 1);                          // dwStreams
+    p = put_u32(p, max_chunk);                  // dwSuggestedBufferSize
+    p = put_u32(p, width);
+    p = put_u32(p, height);
+    for (int i = 0; i < 4; i++)
+        p = put_u32(p, 0);                      // dwReserved
+
+    p = put_fourcc(p, "LIST");
+    p = put_u32(p, AVI_STRL_SIZE);
+    p = put_fourcc(p, "strl");
+
+    p = put_fourcc(p, "strh");
+    p = put_u32(p, 56);
+    p = put_fourcc(p, "vids");
+    p = put_fourcc(p, "MJPG");
+    p = put_u32(p, 0);                          // dwFlags
+    p = put_u16(p, 0);                          // wPriority
+    p = put_u16(p, 0);                          // wLanguage
+    p = put_u32(p, 0);                          // dwInitialFrames
+    p = put_u32(p, 1000);                       // dwScale
+    p = put_u32(p, (uint32_t)(rate*1000 + 0.5)); // dwRate, frames per 1000 s
+    p = put_u32(p, 0);                          // dwStart
+    p = put_u32(p, frames);                     // dwLength
+    p = put_u32(p, max_chunk);                  // dwSuggestedBufferSize
+    p = put_u32(p, 0xffffffff);                 // dwQuality, default
+    p = put_u32(p, 0);                          // dwSampleSize
+    p = put_u16(p, 0);                          // rcFrame
+    p = put_u16(p, 0);
+    p = put_u16(p, width);
+    p = put_u16(p, height);
+
+    p = put_fourcc(p, "strf");
+    p = put_u32(p, 40);                         // BITMAPINFOHEADER
+    p = put_u32(p, 40);                         // biSize
+    p = put_u32(p, width);
+    p = put_u32(p, height);
+    p = put_u16(p, 1);                          // biPlanes
+    p = put_u16(p, 24);                         // biBitCount
+    p = put_fourcc(p, "MJPG");
+    p = put_u32(p, width*height*3);             // biSizeImage
+    for (int i = 0; i < 4; i++)
+        p = put_u32(p, 0);                      // resolution, palette
+
+    p = put_fourcc(p, "LIST");
+    p = put_u32(p, movi_size);
+    p = put_fourcc(p, "movi");
+
+    return h;
+}
+
+std::vector<unsigned char> MjpegContainer::trailer() const {
+    std::vector<unsigned char> t;
+
+    if (format == MJPEG_MULTIPART) {
+        std::string end = "--" + boundary + "--\r\n";
+        t.assign(end.begin(), end.end());
+        return t;
+    }
+
+    t.resize(AVI_CHUNK_HEADER + AVI_INDEX_ENTRY*index.size());
+    unsigned char *p = &t[0];
+    p = put_fourcc(p, "idx1");
+    p = put_u32(p, AVI_INDEX_ENTRY*index.size());
+    for (size_t i = 0; i < index.size(); i++) {
+        p = put_fourcc(p, "00dc");
+        p = put_u32(p, index[i].flags);
+        p = put_u32(p, index[i].offset);
+        p = put_u32(p, index[i].size);
+    }
+    return t;
+}
+
+std::string MjpegContainer::content_type() const {
+    if (format == MJPEG_MULTIPART)
+        return "multipart/x-mixed-replace; boundary=" + boundary;
+    return "video/x-msvideo";
+}
+
+bool MjpegContainer::valid_boundary(const std::string &b) {
+    static const char *extra = "'()+_,-./:=? ";
+    if (b.empty() || b.size() > 70 || b[b.size() - 1] == ' ')
+        return false;
+    for (size_t i = 0; i < b.size(); i++) {
+        unsigned char c = b[i];
+        if (!isalnum(c) && (c == 0 || !strchr(extra, c)))
+            return false;
+    }
+    return true;
+}
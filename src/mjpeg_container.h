@@ -0,0 +1,89 @@
+#ifndef MJPEG_CONTAINER_H
+#define MJPEG_CONTAINER_H
+
+#include <stdint.h>
+
+#include <string>
+#include <vector>
+
+#include "jpeg_destination.h"
+
+typedef enum { MJPEG_MULTIPART, MJPEG_AVI } mjpeg_format;
+
+/*
+ * Framing of a Motion-JPEG stream as multipart/x-mixed-replace parts or as
+ * an AVI file.
+ *
+ * Every frame becomes one chunk of output: the container's bytes in front
+ * of the jpeg (the part boundary and headers, or an AVI '00dc' chunk header
+ * preceded by the file header for the first frame) and the few bytes after
+ * it. Encoders leave margins() around the jpeg in their output buffer and
+ * frame() fills them in, so a frame is never copied to be framed.
+ *
+ * With a frame rate, frames are placed on a fixed clock: one arriving in
+ * the same slot as the previous frame is dropped, and AVI output fills the
+ * slots nobody encoded with empty chunks, which players show as repeats of
+ * the previous frame, so playback keeps real time.
+ *
+ * Only admit(), skip() and record() change the state. frame() may run on a
+ * worker thread as long as none of them runs at the same time.
+ */
+class MjpegContainer {
+    struct index_entry {
+        uint32_t flags, offset, size;
+    };
+
+    mjpeg_format format;
+    int width, height;
+    double fps; // 0 takes every frame
+    std::string boundary;
+
+    uint64_t start; // uv_hrtime() of slot 0
+    long last_slot; // -1 before the first frame
+    int skipped;    // empty slots to write before the next frame
+
+    std::vector<index_entry> index;
+    uint32_t movi_size; // size of the movi list, its fourcc included
+    uint32_t max_chunk;
+
+    std::string part_header(unsigned long jpeg_len) const;
+
+public:
+    MjpegContainer(mjpeg_format fformat, int wwidth, int hheight, double ffps,
+        const std::string &bboundary);
+
+    // Decides whether a frame arriving at 'now' (uv_hrtime() nanoseconds)
+    // gets encoded. Throws once an AVI nears the format's size limit.
+    bool admit(uint64_t now);
+
+    // The last admitted frame failed to encode; its slot stays empty.
+    void skip();
+
+    // Space to leave around the next frame's jpeg.
+    jpeg_margins margins() const;
+
+    // Fills in the margins around a jpeg_len byte jpeg at
+    // buf + margins().head and returns the length of the whole chunk, which
+    // starts at buf.
+    size_t frame(unsigned char *buf, unsigned long jpeg_len) const;
+
+    // Accounts for a chunk made by frame().
+    void record(unsigned long jpeg_len);
+
+    // AVI file header for the frames so far: written in front of the first
+    // frame, and worth writing over it again after trailer(), since only
+    // then are its totals final. Empty for multipart.
+    std::vector<unsigned char> header() const;
+
+    // Bytes that close the stream: the final boundary, or the AVI index.
+    std::vector<unsigned char> trailer() const;
+
+    std::string content_type() const;
+
+    // Characters allowed in a multipart boundary (RFC 2046), 1 to 70 of
+    // them, not ending in a space.
+    static bool valid_boundary(const std::string &b);
+};
+
+#endif
+
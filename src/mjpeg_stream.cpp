@@ -0,0 +1,638 @@
+#include <node.h>
+#include <node_buffer.h>
+#include <cstdlib>
+#include <cstring>
+
+#include "common.h"
+#include "mjpeg_stream.h"
+#include "buffer_compat.h"
+
+using namespace v8;
+using namespace node;
+
+static Local<Value> BufferFromBytes(Isolate *isolate, const std::vector<unsigned char> &bytes) {
+    char *data = (char *)malloc(bytes.size() + 1);
+    if (!bytes.empty())
+        memcpy(data, &bytes[0], bytes.size());
+    return BufferFromMalloc(isolate, data, bytes.size());
+}
+
+void MjpegStream::Initialize(v8::Handle<v8::Object> target) {
+
+    Isolate* isolate = target->GetIsolate();
+
+    Local<FunctionTemplate> tpl = FunctionTemplate::New(isolate, New);
+    tpl->SetClassName(String::NewFromUtf8(isolate, "MjpegStream"));
+    tpl->InstanceTemplate()->SetInternalFieldCount(1);
+
+    NODE_SET_PROTOTYPE_METHOD(tpl, "writeFrame", WriteFrameAsync);
+    NODE_SET_PROTOTYPE_METHOD(tpl, "writeFrameSync", WriteFrameSync);
+    NODE_SET_PROTOTYPE_METHOD(tpl, "writeStack", WriteStackAsync);
+    NODE_SET_PROTOTYPE_METHOD(tpl, "writeStackSync", WriteStackSync);
+    NODE_SET_PROTOTYPE_METHOD(tpl, "finish", Finish);
+    NODE_SET_PROTOTYPE_METHOD(tpl, "header", Header);
+    NODE_SET_PROTOTYPE_METHOD(tpl, "contentType", ContentType);
+    NODE_SET_PROTOTYPE_METHOD(tpl, "stats", Stats);
+    NODE_SET_PROTOTYPE_METHOD(tpl, "setQuality", SetQuality);
+    NODE_SET_PROTOTYPE_METHOD(tpl, "setSubsampling", SetSubsampling);
+
+    target->Set(String::NewFromUtf8(isolate, "MjpegStream"), tpl->GetFunction());
+
+}
+
+MjpegStream::MjpegStream(int wwidth, int hheight, buffer_type bbuf_type,
+    mjpeg_format format, double fps, const std::string &boundary) :
+    width(wwidth), height(hheight), quality(60), subsampling(SUBSAMPLE_420),
+    buf_type(bbuf_type), size_hint(0),
+    container(format, wwidth, hheight, fps, boundary),
+    busy(false), finished(false), frames(0), dropped(0), bytes(0) {}
+
+// Starts a frame from 'data' or, if 'stack' isn't NULL, from a snapshot of
+// the stack. Returns NULL if the frame is dropped: while an async frame is
+// still being encoded, and when the frame rate says so. Throws on a
+// finished stream.
+mjpeg_frame_request *MjpegStream::admit(unsigned char *data, int stride,
+    FixedJpegStack *stack)
+{
+    if (finished)
+        throw "The stream is finished.";
+
+    if (busy || !container.admit(uv_hrtime())) {
+        dropped++;
+        return NULL;
+    }
+
+    mjpeg_frame_request *req = new mjpeg_frame_request(data, width, height, quality, buf_type);
+    req->stream = this;
+    req->stack = stack;
+    req->margins = container.margins();
+    req->jpeg_obj = this;
+    req->canvas = NULL;
+    req->jpeg = NULL;
+    req->jpeg_len = 0;
+    req->error = NULL;
+
+    if (stack) {
+        try {
+            stack->snapshot(req);
+        }
+        catch (const char *err) {
+            container.skip();
+            delete req;
+            throw;
+        }
+    }
+    else {
+        req->encoder.set_stride(stride);
+        req->encoder.set_subsampling(subsampling);
+        req->encoder.set_size_hint(size_hint);
+        req->encoder.set_margins(req->margins);
+    }
+
+    return req;
+}
+
+// Compresses the frame straight into the buffer that gets framed and handed
+// out. May run on a worker thread.
+void MjpegStream::encode_frame(mjpeg_frame_request *req) {
+
+    try {
+        unsigned char *out;
+        unsigned long out_len;
+        if (req->stack) {
+            req->stack->encode_snapshot(req, req->margins, &out, &out_len);
+        }
+        else {
+            req->encoder.encode();
+            out_len = req->encoder.get_jpeg_len();
+            out = req->encoder.release_jpeg();
+        }
+        req->image_len = out_len;
+        req->jpeg_len = container.frame(out, out_len);
+        req->jpeg = (char *)out;
+    }
+    catch (const char *err) {
+        req->error = strdup(err);
+    }
+
+}
+
+void MjpegStream::finish_frame(mjpeg_frame_request *req) {
+
+    if (req->stack)
+        req->stack->release_snapshot(req);
+
+    if (req->error) {
+        container.skip();
+        return;
+    }
+
+    container.record(req->image_len);
+    frames++;
+    bytes += req->jpeg_len;
+    if (!req->stack)
+        size_hint = req->encoder.get_size_hint();
+
+}
+
+// Hands the framed chunk over to a Buffer without copying it.
+Local<Value> MjpegStream::frame_result(Isolate *isolate, mjpeg_frame_request *req) {
+
+    Local<Value> chunk = BufferFromMalloc(isolate, req->jpeg, req->jpeg_len);
+    req->jpeg = NULL;
+    return chunk;
+
+}
+
+void MjpegStream::UV_EncodeFrame(uv_work_t *req) {
+    mjpeg_frame_request *frame_req = (mjpeg_frame_request *)req->data;
+    frame_req->stream->encode_frame(frame_req);
+}
+
+void MjpegStream::UV_EncodeFrameAfter(uv_work_t *req) {
+
+    mjpeg_frame_request *frame_req = (mjpeg_frame_request *)req->data;
+    MjpegStream *stream = frame_req->stream;
+    HandleScope scope(frame_req->isolate);
+    delete req;
+
+    stream->finish_frame(frame_req);
+    stream->busy = false;
+
+    Handle<Value> argv[2];
+
+    if (frame_req->error) {
+        argv[0] = Undefined( frame_req->isolate );
+        argv[1] = ErrorException( frame_req->isolate, frame_req->error );
+    } else {
+        argv[0] = stream->frame_result(frame_req->isolate, frame_req);
+        argv[1] = Undefined( frame_req->isolate );
+    }
+
+    TryCatch try_catch( frame_req->isolate );
+
+    Local<Function>::New(frame_req->isolate, frame_req->callback)->Call( Null( frame_req->isolate ), 2, argv );
+
+    if (try_catch.HasCaught()) {
+        FatalException( frame_req->isolate, try_catch );
+    }
+
+    frame_req->callback.Reset();
+    frame_req->buffer.Reset();
+    free(frame_req->jpeg);
+    free(frame_req->error);
+
+    stream->Unref();
+    delete frame_req;
+}
+
+void MjpegStream::queue_frame(Isolate *isolate, mjpeg_frame_request *req,
+    Local<Function> callback)
+{
+    req->isolate = isolate;
+    req->callback.Reset(isolate, callback);
+
+    uv_work_t* work = new uv_work_t;
+    work->data = req;
+    uv_queue_work(uv_default_loop(), work, UV_EncodeFrame, (uv_after_work_cb)UV_EncodeFrameAfter);
+
+    busy = true;
+    Ref();
+}
+
+// Reads the frame Buffer and the optional stride among the first argc
+// arguments. Throws a JS exception and returns false if they're malformed.
+bool MjpegStream::parse_frame(const FunctionCallbackInfo<Value>& args, int argc,
+    unsigned char **data, int *stride)
+{
+    Isolate* isolate = args.GetIsolate();
+
+    if (!Buffer::HasInstance(args[0])) {
+        VException( isolate, "First argument must be Buffer." );
+        return false;
+    }
+
+    *stride = row_bytes(buf_type, width);
+
+    if (argc > 1) {
+        if (!args[1]->IsInt32()) {
+            VException( isolate, "Second argument must be integer stride." );
+            return false;
+        }
+        if (args[1]->Int32Value() < *stride) {
+            VException( isolate, "Stride is smaller than a row of pixels." );
+            return false;
+        }
+        *stride = args[1]->Int32Value();
+    }
+
+    Local<Object> buffer = args[0]->ToObject();
+
+    if (Buffer::Length(buffer) < image_bytes(buf_type, width, height, *stride)) {
+        VException( isolate, "Buffer is smaller than width*height pixels." );
+        return false;
+    }
+
+    *data = (unsigned char *)Buffer::Data(buffer);
+    return true;
+}
+
+bool MjpegStream::parse_stack(const FunctionCallbackInfo<Value>& args, FixedJpegStack **stack) {
+
+    Isolate* isolate = args.GetIsolate();
+
+    if (!FixedJpegStack::HasInstance(isolate, args[0])) {
+        VException( isolate, "First argument must be a FixedJpegStack." );
+        return false;
+    }
+
+    *stack = ObjectWrap::Unwrap<FixedJpegStack>(args[0]->ToObject());
+
+    if ((*stack)->get_width() != width || (*stack)->get_height() != height) {
+        VException( isolate, "FixedJpegStack's dimensions differ from the stream's." );
+        return false;
+    }
+
+    return true;
+}
+
+// new MjpegStream(width, height, [buffer_type], [{format, fps, boundary}])
+void MjpegStream::New(const FunctionCallbackInfo<Value>& args) {
+
+    Isolate* isolate = args.GetIsolate();
+
+    if (args.Length() < 2) {
+        VException( isolate, "At least two arguments required - width, height, [buffer type, and options]" );
+        return;
+    }
+
+    if (!args[0]->IsInt32()) {
+        VException( isolate, "First argument must be integer width." );
+        return;
+    }
+
+    if (!args[1]->IsInt32()) {
+        VException( isolate, "Second argument must be integer height." );
+        return;
+    }
+
+    int w = args[0]->Int32Value();
+    int h = args[1]->Int32Value();
+
+    if (w <= 0 || h <= 0 || w > JPEG_MAX_DIMENSION || h > JPEG_MAX_DIMENSION) {
+        VException( isolate, "Width and height must be integers from 1 to 65500." );
+        return;
+    }
+
+    buffer_type buf_type = BUF_RGB;
+
+    if (args.Length() >= 3 && !args[2]->IsUndefined()) {
+        String::Utf8Value str(args[2]);
+        if (!args[2]->IsString() || !parse_buffer_type(*str, &buf_type)) {
+            VException( isolate, "Buffer type must be 'rgb', 'bgr', 'rgba', 'bgra', 'i420', 'nv12' or 'yuyv'." );
+            return;
+        }
+    }
+
+    mjpeg_format format = MJPEG_MULTIPART;
+    double fps = 0;
+    std::string boundary = "jpegframe";
+
+    if (args.Length() >= 4 && !args[3]->IsUndefined()) {
+        if (!args[3]->IsObject()) {
+            VException( isolate, "Fourth argument must be an options object - {format, fps, boundary}." );
+            return;
+        }
+        Local<Object> options = args[3]->ToObject();
+        Local<Value> format_opt = options->Get(String::NewFromUtf8(isolate, "format"));
+        Local<Value> fps_opt = options->Get(String::NewFromUtf8(isolate, "fps"));
+        Local<Value> boundary_opt = options->Get(String::NewFromUtf8(isolate, "boundary"));
+
+        if (!format_opt->IsUndefined()) {
+            String::Utf8Value str(format_opt);
+            if (format_opt->IsString() && str_eq(*str, "multipart"))
+                format = MJPEG_MULTIPART;
+            else if (format_opt->IsString() && str_eq(*str, "avi"))
+                format = MJPEG_AVI;
+            else {
+                VException( isolate, "Format must be 'multipart' or 'avi'." );
+                return;
+            }
+        }
+
+        if (!fps_opt->IsUndefined()) {
+            if (!fps_opt->IsNumber() || !(fps_opt->NumberValue() >= 0)
+                || fps_opt->NumberValue() > 1000)
+            {
+                VException( isolate, "Fps must be a number between 0 and 1000." );
+                return;
+            }
+            fps = fps_opt->NumberValue();
+        }
+
+        if (!boundary_opt->IsUndefined()) {
+            String::Utf8Value str(boundary_opt);
+            if (!boundary_opt->IsString() || !MjpegContainer::valid_boundary(*str)) {
+                VException( isolate, "Boundary must be 1 to 70 letters, digits or '()+_,-./:=? characters." );
+                return;
+            }
+            boundary = *str;
+        }
+    }
+
+    MjpegStream *stream = new MjpegStream(w, h, buf_type, format, fps, boundary);
+    stream->Wrap(args.This());
+
+}
+
+// stream.writeFrameSync(buffer, [stride]) - the framed chunk, or null if the
+// frame was dropped.
+void MjpegStream::WriteFrameSync(const FunctionCallbackInfo<Value>& args) {
+
+    Isolate* isolate = args.GetIsolate();
+
+    if (args.Length() < 1 || args.Length() > 2) {
+        VException( isolate, "One or two arguments required - buffer, [stride]." );
+        return;
+    }
+
+    MjpegStream *stream = ObjectWrap::Unwrap<MjpegStream>(args.This());
+    unsigned char *data;
+    int stride;
+    if (!stream->parse_frame(args, args.Length(), &data, &stride))
+        return;
+
+    mjpeg_frame_request *req;
+    try {
+        req = stream->admit(data, stride, NULL);
+    }
+    catch (const char *err) {
+        VException( isolate, err );
+        return;
+    }
+
+    if (!req) {
+        args.GetReturnValue().Set(Null( isolate ));
+        return;
+    }
+
+    stream->encode_frame(req);
+    stream->finish_frame(req);
+
+    if (req->error)
+        VException( isolate, req->error );
+    else
+        args.GetReturnValue().Set(stream->frame_result(isolate, req));
+
+    free(req->error);
+    delete req;
+
+}
+
+// stream.writeFrame(buffer, [stride], callback) - true if the frame was
+// taken, false if it was dropped, in which case the callback isn't called.
+void MjpegStream::WriteFrameAsync(const FunctionCallbackInfo<Value>& args) {
+
+    Isolate* isolate = args.GetIsolate();
+
+    if (args.Length() < 2 || args.Length() > 3) {
+        VException( isolate, "Two or three arguments required - buffer, [stride], and callback function." );
+        return;
+    }
+
+    if (!args[args.Length() - 1]->IsFunction()) {
+        VException( isolate, "Last argument must be a function." );
+        return;
+    }
+
+    MjpegStream *stream = ObjectWrap::Unwrap<MjpegStream>(args.This());
+    unsigned char *data;
+    int stride;
+    if (!stream->parse_frame(args, args.Length() - 1, &data, &stride))
+        return;
+
+    mjpeg_frame_request *req;
+    try {
+        req = stream->admit(data, stride, NULL);
+    }
+    catch (const char *err) {
+        VException( isolate, err );
+        return;
+    }
+
+    if (!req) {
+        args.GetReturnValue().Set(False( isolate ));
+        return;
+    }
+
+    req->buffer.Reset(isolate, args[0]->ToObject());
+    stream->queue_frame(isolate, req, Local<Function>::Cast(args[args.Length() - 1]));
+
+    args.GetReturnValue().Set(True( isolate ));
+
+}
+
+// stream.writeStackSync(stack) - like writeFrameSync, with a snapshot of a
+// FixedJpegStack's canvas as the frame.
+void MjpegStream::WriteStackSync(const FunctionCallbackInfo<Value>& args) {
+
+    Isolate* isolate = args.GetIsolate();
+
+    if (args.Length() != 1) {
+        VException( isolate, "One argument required - FixedJpegStack." );
+        return;
+    }
+
+    MjpegStream *stream = ObjectWrap::Unwrap<MjpegStream>(args.This());
+    FixedJpegStack *stack;
+    if (!stream->parse_stack(args, &stack))
+        return;
+
+    mjpeg_frame_request *req;
+    try {
+        req = stream->admit(NULL, 0, stack);
+    }
+    catch (const char *err) {
+        VException( isolate, err );
+        return;
+    }
+
+    if (!req) {
+        args.GetReturnValue().Set(Null( isolate ));
+        return;
+    }
+
+    stream->encode_frame(req);
+    stream->finish_frame(req);
+
+    if (req->error)
+        VException( isolate, req->error );
+    else
+        args.GetReturnValue().Set(stream->frame_result(isolate, req));
+
+    free(req->error);
+    delete req;
+
+}
+
+// stream.writeStack(stack, callback) - like writeFrame. The stack can take
+// pushes for the next frame while this one is encoded.
+void MjpegStream::WriteStackAsync(const FunctionCallbackInfo<Value>& args) {
+
+    Isolate* isolate = args.GetIsolate();
+
+    if (args.Length() != 2) {
+        VException( isolate, "Two arguments required - FixedJpegStack and callback function." );
+        return;
+    }
+
+    if (!args[1]->IsFunction()) {
+        VException( isolate, "Second argument must be a function." );
+        return;
+    }
+
+    MjpegStream *stream = ObjectWrap::Unwrap<MjpegStream>(args.This());
+    FixedJpegStack *stack;
+    if (!stream->parse_stack(args, &stack))
+        return;
+
+    mjpeg_frame_request *req;
+    try {
+        req = stream->admit(NULL, 0, stack);
+    }
+    catch (const char *err) {
+        VException( isolate, err );
+        return;
+    }
+
+    if (!req) {
+        args.GetReturnValue().Set(False( isolate ));
+        return;
+    }
+
+    stream->queue_frame(isolate, req, Local<Function>::Cast(args[1]));
+
+    args.GetReturnValue().Set(True( isolate ));
+
+}
+
+// stream.finish() - the bytes that end the stream: the closing boundary, or
+// the AVI index. No frames can be written afterwards.
+void MjpegStream::Finish(const FunctionCallbackInfo<Value>& args) {
+
+    Isolate* isolate = args.GetIsolate();
+    MjpegStream *stream = ObjectWrap::Unwrap<MjpegStream>(args.This());
+
+    if (stream->busy) {
+        VException( isolate, "A frame is still being encoded." );
+        return;
+    }
+
+    if (stream->finished) {
+        VException( isolate, "The stream is finished." );
+        return;
+    }
+
+    std::vector<unsigned char> trailer = stream->container.trailer();
+    stream->finished = true;
+    stream->bytes += trailer.size();
+
+    args.GetReturnValue().Set(BufferFromBytes(isolate, trailer));
+
+}
+
+// stream.header() - the AVI header for the frames so far, the same size as
+// the one in front of the first frame. After finish() its totals are final.
+void MjpegStream::Header(const FunctionCallbackInfo<Value>& args) {
+
+    Isolate* isolate = args.GetIsolate();
+    MjpegStream *stream = ObjectWrap::Unwrap<MjpegStream>(args.This());
+
+    if (stream->busy) {
+        VException( isolate, "A frame is still being encoded." );
+        return;
+    }
+
+    args.GetReturnValue().Set(BufferFromBytes(isolate, stream->container.header()));
+
+}
+
+void MjpegStream::ContentType(const FunctionCallbackInfo<Value>& args) {
+
+    Isolate* isolate = args.GetIsolate();
+    MjpegStream *stream = ObjectWrap::Unwrap<MjpegStream>(args.This());
+
+    args.GetReturnValue().Set(String::NewFromUtf8(isolate, stream->container.content_type().c_str()));
+
+}
+
+// stream.stats() - frames written, frames dropped and bytes of output.
+void MjpegStream::Stats(const FunctionCallbackInfo<Value>& args) {
+
+    Isolate* isolate = args.GetIsolate();
+    MjpegStream *stream = ObjectWrap::Unwrap<MjpegStream>(args.This());
+
+    Local<Object> stats = Object::New(isolate);
+    stats->Set(String::NewFromUtf8(isolate, "frames"), Number::New(isolate, stream->frames));
+    stats->Set(String::NewFromUtf8(isolate, "dropped"), Number::New(isolate, stream->dropped));
+    stats->Set(String::NewFromUtf8(isolate, "bytes"), Number::New(isolate, stream->bytes));
+
+    args.GetReturnValue().Set(stats);
+
+}
+
+void MjpegStream::SetQuality(const FunctionCallbackInfo<Value>& args) {
+
+    Isolate* isolate = args.GetIsolate();
+
+    if (args.Length() != 1) {
+        VException( isolate, "One argument required - quality" );
+        return;
+    }
+
+    if (!args[0]->IsInt32()) {
+        VException( isolate, "First argument must be integer quality" );
+        return;
+    }
+
+    int q = args[0]->Int32Value();
+
+    if (q < 0) {
+        VException( isolate, "Quality must be greater or equal to 0." );
+        return;
+    }
+
+    if (q > 100) {
+        VException( isolate, "Quality must be less than or equal to 100." );
+        return;
+    }
+
+    MjpegStream *stream = ObjectWrap::Unwrap<MjpegStream>(args.This());
+    stream->quality = q;
+
+    Undefined( isolate );
+
+}
+
+void MjpegStream::SetSubsampling(const FunctionCallbackInfo<Value>& args) {
+
+    Isolate* isolate = args.GetIsolate();
+
+    if (args.Length() != 1) {
+        VException( isolate, "One argument required - subsampling" );
+        return;
+    }
+
+    chroma_subsampling s;
+    String::Utf8Value str(args[0]);
+    if (!args[0]->IsString() || !parse_subsampling(*str, &s)) {
+        VException( isolate, "Subsampling must be '4:4:4', '4:2:2', '4:2:0' or 'gray'." );
+        return;
+    }
+
+    MjpegStream *stream = ObjectWrap::Unwrap<MjpegStream>(args.This());
+    stream->subsampling = s;
+
+    Undefined( isolate );
+
+}
@@ -0,0 +1,83 @@
+#ifndef MJPEG_STREAM_H
+#define MJPEG_STREAM_H
+
+#include <node.h>
+#include <node_buffer.h>
+#include <node_object_wrap.h>
+
+#include <uv.h>
+
+#include "common.h"
+#include "jpeg_encoder.h"
+#include "mjpeg_container.h"
+#include "fixed_jpeg_stack.h"
+
+using v8::Function;
+using v8::FunctionCallbackInfo;
+using v8::FunctionTemplate;
+using v8::Isolate;
+using v8::Value;
+
+class MjpegStream;
+
+// One frame on its way into the stream, from a Buffer ('encoder') or a
+// FixedJpegStack snapshot ('stack', with the snapshot in the base).
+struct mjpeg_frame_request : stack_encode_request {
+    MjpegStream *stream;
+    FixedJpegStack *stack;
+    JpegEncoder encoder;
+    v8::Persistent<v8::Object> buffer; // keeps the frame's pixels alive
+    jpeg_margins margins;
+    unsigned long image_len; // the jpeg alone, without the framing
+
+    mjpeg_frame_request(unsigned char *data, int width, int height,
+        int quality, buffer_type buf_type) :
+        stream(NULL), stack(NULL), encoder(data, width, height, quality, buf_type),
+        image_len(0) {}
+};
+
+class MjpegStream : public node::ObjectWrap {
+    int width, height, quality;
+    chroma_subsampling subsampling;
+    buffer_type buf_type;
+    double size_hint;
+
+    MjpegContainer container;
+    bool busy;     // an async frame is being encoded
+    bool finished;
+    unsigned long frames, dropped;
+    double bytes;
+
+    bool parse_frame(const FunctionCallbackInfo<Value>& args, int argc,
+        unsigned char **data, int *stride);
+    bool parse_stack(const FunctionCallbackInfo<Value>& args, FixedJpegStack **stack);
+    mjpeg_frame_request *admit(unsigned char *data, int stride, FixedJpegStack *stack);
+    void encode_frame(mjpeg_frame_request *req);
+    void finish_frame(mjpeg_frame_request *req);
+    void queue_frame(Isolate *isolate, mjpeg_frame_request *req,
+        v8::Local<v8::Function> callback);
+    v8::Local<v8::Value> frame_result(Isolate *isolate, mjpeg_frame_request *req);
+
+    static void UV_EncodeFrame(uv_work_t *req);
+    static void UV_EncodeFrameAfter(uv_work_t *req);
+
+public:
+    static void Initialize(v8::Handle<v8::Object> target);
+    MjpegStream(int wwidth, int hheight, buffer_type bbuf_type, mjpeg_format format,
+        double fps, const std::string &boundary);
+
+    static void New(const FunctionCallbackInfo<Value>& args);
+    static void WriteFrameSync(const FunctionCallbackInfo<Value>& args);
+    static void WriteFrameAsync(const FunctionCallbackInfo<Value>& args);
+    static void WriteStackSync(const FunctionCallbackInfo<Value>& args);
+    static void WriteStackAsync(const FunctionCallbackInfo<Value>& args);
+    static void Finish(const FunctionCallbackInfo<Value>& args);
+    static void Header(const FunctionCallbackInfo<Value>& args);
+    static void ContentType(const FunctionCallbackInfo<Value>& args);
+    static void Stats(const FunctionCallbackInfo<Value>& args);
+    static void SetQuality(const FunctionCallbackInfo<Value>& args);
+    static void SetSubsampling(const FunctionCallbackInfo<Value>& args);
+};
+
+#endif
+
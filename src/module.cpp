@@ -1,18 +1,70 @@
 #include <node.h>
+#include <node_buffer.h>
 
+#include "common.h"
+#include "jpeg_probe.h"
 #include "jpeg.h"
+#include "jpeg_decoder.h"
+#include "jpeg_transform.h"
 #include "fixed_jpeg_stack.h"
 #include "dynamic_jpeg_stack.h"
+#include "mjpeg_stream.h"
 
 using namespace v8;
+using namespace node;
+
+// probe(buffer) - dimensions and encoding parameters from the jpeg's
+// headers, without decoding it.
+static void
+Probe(const FunctionCallbackInfo<Value>& args)
+{
+    Isolate* isolate = args.GetIsolate();
+
+    if (args.Length() != 1) {
+        VException( isolate, "One argument required - jpeg buffer" );
+        return;
+    }
+
+    if (!Buffer::HasInstance(args[0])) {
+        VException( isolate, "First argument must be Buffer." );
+        return;
+    }
+
+    Local<Object> buffer = args[0]->ToObject();
+    jpeg_probe_info info;
+
+    try {
+        jpeg_probe((unsigned char *)Buffer::Data(buffer), Buffer::Length(buffer), &info);
+    }
+    catch (const char *err) {
+        VException( isolate, err );
+        return;
+    }
+
+    Local<Object> result = Object::New(isolate);
+    result->Set(String::NewFromUtf8(isolate, "width"), Integer::New(isolate, info.width));
+    result->Set(String::NewFromUtf8(isolate, "height"), Integer::New(isolate, info.height));
+    result->Set(String::NewFromUtf8(isolate, "components"), Integer::New(isolate, info.components));
+    result->Set(String::NewFromUtf8(isolate, "subsampling"),
+        String::NewFromUtf8(isolate, jpeg_subsampling_name(&info)));
+    result->Set(String::NewFromUtf8(isolate, "progressive"), Boolean::New(isolate, info.progressive));
+    result->Set(String::NewFromUtf8(isolate, "quality"), Integer::New(isolate, info.quality));
+
+    args.GetReturnValue().Set(result);
+}
 
 extern "C" void
 init(Handle<Object> target)
 {
-    HandleScope scope;
+    HandleScope scope(target->GetIsolate());
+    init_pixel_kernels();
     Jpeg::Initialize(target);
+    JpegDecoder::Initialize(target);
+    JpegTransform::Initialize(target);
     FixedJpegStack::Initialize(target);
     DynamicJpegStack::Initialize(target);
+    MjpegStream::Initialize(target);
+    NODE_SET_METHOD(target, "probe", Probe);
 }
 NODE_MODULE(jpeg, init)
 
@@ -0,0 +1,59 @@
+#include <uv.h>
+#include <cstdlib>
+
+#include "parallel.h"
+
+struct parallel_job {
+    parallel_fn fn;
+    void *arg;
+    int count;
+    int next;
+    uv_mutex_t lock;
+};
+
+static void parallel_worker(void *p) {
+    parallel_job *job = (parallel_job *)p;
+    for (;;) {
+        uv_mutex_lock(&job->lock);
+        int i = job->next++;
+        uv_mutex_unlock(&job->lock);
+        if (i >= job->count)
+            break;
+        job->fn(job->arg, i);
+    }
+}
+
+void parallel_for(int count, int threads, parallel_fn fn, void *arg) {
+    if (threads > count)
+        threads = count;
+
+    parallel_job job;
+    job.fn = fn;
+    job.arg = arg;
+    job.count = count;
+    job.next = 0;
+
+    if (threads <= 1 || uv_mutex_init(&job.lock) != 0) {
+        for (int i = 0; i < count; i++)
+            fn(arg, i);
+        return;
+    }
+
+    uv_thread_t *workers = (uv_thread_t *)malloc(sizeof(*workers)*(threads - 1));
+    int started = 0;
+    if (workers) {
+        for (; started < threads - 1; started++) {
+            if (uv_thread_create(&workers[started], parallel_worker, &job) != 0)
+                break;
+        }
+    }
+
+    // The calling thread takes items too, and picks up whatever is left if
+    // some of the threads couldn't be started.
+    parallel_worker(&job);
+
+    for (int i = 0; i < started; i++)
+        uv_thread_join(&workers[i]);
+    free(workers);
+    uv_mutex_destroy(&job.lock);
+}
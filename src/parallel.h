@@ -0,0 +1,11 @@
+#ifndef PARALLEL_H
+#define PARALLEL_H
+
+typedef void (*parallel_fn)(void *arg, int index);
+
+// Calls fn(arg, i) for every i in [0, count), spread over up to 'threads'
+// threads. The calling thread is one of them, so threads <= 1 simply runs
+// the loop in place. Returns once every call has finished. fn must not throw.
+void parallel_for(int count, int threads, parallel_fn fn, void *arg);
+
+#endif
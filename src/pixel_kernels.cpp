@@ -0,0 +1,319 @@
+#include "pixel_kernels.h"
+
+/*
+ * Pixel swizzle kernels.
+ *
+ * Every kernel converts one row of 'pixels' pixels to packed RGB and is safe
+ * to call in place (rgb == source), since each step loads its input before it
+ * stores output at or behind that position. The scalar versions are always
+ * built, the SSSE3/AVX2 ones are compiled with per-function target attributes
+ * so the rest of the module needs no special flags, and init_pixel_kernels()
+ * picks the best set the CPU supports once at module load.
+ */
+
+static void rgba_to_rgb_row_c(const unsigned char *rgba, unsigned char *rgb, int pixels) {
+    for (int i=0; i<pixels; i++, rgba+=4, rgb+=3) {
+        rgb[0] = rgba[0];
+        rgb[1] = rgba[1];
+        rgb[2] = rgba[2];
+    }
+}
+
+static void bgra_to_rgb_row_c(const unsigned char *bgra, unsigned char *rgb, int pixels) {
+    for (int i=0; i<pixels; i++, bgra+=4, rgb+=3) {
+        unsigned char b = bgra[0];
+        rgb[0] = bgra[2];
+        rgb[1] = bgra[1];
+        rgb[2] = b;
+    }
+}
+
+static void bgr_to_rgb_row_c(const unsigned char *bgr, unsigned char *rgb, int pixels) {
+    for (int i=0; i<pixels; i++, bgr+=3, rgb+=3) {
+        unsigned char b = bgr[0];
+        rgb[0] = bgr[2];
+        rgb[1] = bgr[1];
+        rgb[2] = b;
+    }
+}
+
+// The box filter kernels take two rows of 'pixels' 4 byte pixels and write
+// (pixels + 1)/2 pixels, each the rounded mean of a 2x2 block. An odd last
+// column is averaged with itself. Channels are treated alike, so any 4 byte
+// order works.
+static void halve_row_c(const unsigned char *a, const unsigned char *b, unsigned char *out, int pixels) {
+    for (int i=0; i<pixels; i+=2, a+=8, b+=8, out+=4) {
+        int next = i + 1 < pixels ? 4 : 0;
+        for (int c=0; c<4; c++)
+            out[c] = (a[c] + a[c+next] + b[c] + b[c+next] + 2) >> 2;
+    }
+}
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define PIXEL_KERNELS_X86
+#define TARGET_SSSE3 __attribute__((target("ssse3")))
+#define TARGET_AVX2 __attribute__((target("avx2")))
+#include <immintrin.h>
+#elif defined(_MSC_VER) && (defined(_M_X64) || defined(_M_IX86))
+#define PIXEL_KERNELS_X86
+#define TARGET_SSSE3
+#define TARGET_AVX2
+#include <intrin.h>
+#include <immintrin.h>
+#elif (defined(__ARM_NEON) || defined(__ARM_NEON__)) && defined(PIXEL_KERNELS_ENABLE_NEON)
+// Not yet built and checked against the scalar kernels on ARM hardware, so
+// only compiled in on request until test/pixel_kernels.cpp has passed there.
+#define PIXEL_KERNELS_NEON
+#include <arm_neon.h>
+#endif
+
+#ifdef PIXEL_KERNELS_X86
+
+// 16 pixels per iteration: four 4-pixel loads are packed down to 12 bytes
+// each and stitched into three 16 byte stores.
+static TARGET_SSSE3 void
+four_to_rgb_row_ssse3(const unsigned char *src, unsigned char *rgb, int pixels,
+    const __m128i mask, row_converter tail)
+{
+    int i = 0;
+    for (; i + 16 <= pixels; i += 16, src += 64, rgb += 48) {
+        __m128i a = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)src), mask);
+        __m128i b = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)(src + 16)), mask);
+        __m128i c = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)(src + 32)), mask);
+        __m128i d = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)(src + 48)), mask);
+        _mm_storeu_si128((__m128i *)rgb,
+            _mm_or_si128(a, _mm_slli_si128(b, 12)));
+        _mm_storeu_si128((__m128i *)(rgb + 16),
+            _mm_or_si128(_mm_srli_si128(b, 4), _mm_slli_si128(c, 8)));
+        _mm_storeu_si128((__m128i *)(rgb + 32),
+            _mm_or_si128(_mm_srli_si128(c, 8), _mm_slli_si128(d, 4)));
+    }
+    tail(src, rgb, pixels - i);
+}
+
+static TARGET_SSSE3 void rgba_to_rgb_row_ssse3(const unsigned char *rgba, unsigned char *rgb, int pixels) {
+    const __m128i mask = _mm_setr_epi8(0, 1, 2, 4, 5, 6, 8, 9, 10, 12, 13, 14, -1, -1, -1, -1);
+    four_to_rgb_row_ssse3(rgba, rgb, pixels, mask, rgba_to_rgb_row_c);
+}
+
+static TARGET_SSSE3 void bgra_to_rgb_row_ssse3(const unsigned char *bgra, unsigned char *rgb, int pixels) {
+    const __m128i mask = _mm_setr_epi8(2, 1, 0, 6, 5, 4, 10, 9, 8, 14, 13, 12, -1, -1, -1, -1);
+    four_to_rgb_row_ssse3(bgra, rgb, pixels, mask, bgra_to_rgb_row_c);
+}
+
+// Swaps 5 pixels per 16 byte window; the 16th byte is passed through and
+// rewritten by the next window, so at least 6 pixels must remain.
+static TARGET_SSSE3 void bgr_to_rgb_row_ssse3(const unsigned char *bgr, unsigned char *rgb, int pixels) {
+    const __m128i mask = _mm_setr_epi8(2, 1, 0, 5, 4, 3, 8, 7, 6, 11, 10, 9, 14, 13, 12, 15);
+    int i = 0;
+    for (; i + 6 <= pixels; i += 5, bgr += 15, rgb += 15) {
+        __m128i v = _mm_loadu_si128((const __m128i *)bgr);
+        _mm_storeu_si128((__m128i *)rgb, _mm_shuffle_epi8(v, mask));
+    }
+    bgr_to_rgb_row_c(bgr, rgb, pixels - i);
+}
+
+// 8 pixels per iteration: pshufb packs each 128 bit lane to 12 bytes and a
+// cross-lane permute closes the gap between them.
+static TARGET_AVX2 void
+four_to_rgb_row_avx2(const unsigned char *src, unsigned char *rgb, int pixels,
+    const __m256i mask, row_converter tail)
+{
+    const __m256i pack = _mm256_setr_epi32(0, 1, 2, 4, 5, 6, 3, 7);
+    int i = 0;
+    for (; i + 8 <= pixels; i += 8, src += 32, rgb += 24) {
+        __m256i v = _mm256_shuffle_epi8(_mm256_loadu_si256((const __m256i *)src), mask);
+        v = _mm256_permutevar8x32_epi32(v, pack);
+        _mm_storeu_si128((__m128i *)rgb, _mm256_castsi256_si128(v));
+        _mm_storel_epi64((__m128i *)(rgb + 16), _mm256_extracti128_si256(v, 1));
+    }
+    tail(src, rgb, pixels - i);
+}
+
+static TARGET_AVX2 void rgba_to_rgb_row_avx2(const unsigned char *rgba, unsigned char *rgb, int pixels) {
+    const __m256i mask = _mm256_setr_epi8(
+        0, 1, 2, 4, 5, 6, 8, 9, 10, 12, 13, 14, -1, -1, -1, -1,
+        0, 1, 2, 4, 5, 6, 8, 9, 10, 12, 13, 14, -1, -1, -1, -1);
+    four_to_rgb_row_avx2(rgba, rgb, pixels, mask, rgba_to_rgb_row_c);
+}
+
+static TARGET_AVX2 void bgra_to_rgb_row_avx2(const unsigned char *bgra, unsigned char *rgb, int pixels) {
+    const __m256i mask = _mm256_setr_epi8(
+        2, 1, 0, 6, 5, 4, 10, 9, 8, 14, 13, 12, -1, -1, -1, -1,
+        2, 1, 0, 6, 5, 4, 10, 9, 8, 14, 13, 12, -1, -1, -1, -1);
+    four_to_rgb_row_avx2(bgra, rgb, pixels, mask, bgra_to_rgb_row_c);
+}
+
+// 8 pixels in, 4 out per iteration: both rows are widened to 16 bits and
+// summed, then unpacking the 64 bit halves lines every pixel up with its
+// right neighbour. Only needs SSE2, which every SSSE3 CPU has.
+static TARGET_SSSE3 void halve_row_sse2(const unsigned char *a, const unsigned char *b, unsigned char *out, int pixels) {
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i two = _mm_set1_epi16(2);
+    int i = 0;
+    for (; i + 8 <= pixels; i += 8, a += 32, b += 32, out += 16) {
+        __m128i a0 = _mm_loadu_si128((const __m128i *)a);
+        __m128i a1 = _mm_loadu_si128((const __m128i *)(a + 16));
+        __m128i b0 = _mm_loadu_si128((const __m128i *)b);
+        __m128i b1 = _mm_loadu_si128((const __m128i *)(b + 16));
+        __m128i s0 = _mm_add_epi16(_mm_unpacklo_epi8(a0, zero), _mm_unpacklo_epi8(b0, zero));
+        __m128i s1 = _mm_add_epi16(_mm_unpackhi_epi8(a0, zero), _mm_unpackhi_epi8(b0, zero));
+        __m128i s2 = _mm_add_epi16(_mm_unpacklo_epi8(a1, zero), _mm_unpacklo_epi8(b1, zero));
+        __m128i s3 = _mm_add_epi16(_mm_unpackhi_epi8(a1, zero), _mm_unpackhi_epi8(b1, zero));
+        __m128i lo = _mm_add_epi16(_mm_unpacklo_epi64(s0, s1), _mm_unpackhi_epi64(s0, s1));
+        __m128i hi = _mm_add_epi16(_mm_unpacklo_epi64(s2, s3), _mm_unpackhi_epi64(s2, s3));
+        lo = _mm_srli_epi16(_mm_add_epi16(lo, two), 2);
+        hi = _mm_srli_epi16(_mm_add_epi16(hi, two), 2);
+        _mm_storeu_si128((__m128i *)out, _mm_packus_epi16(lo, hi));
+    }
+    halve_row_c(a, b, out, pixels - i);
+}
+
+static void cpu_features(bool *ssse3, bool *avx2) {
+#if defined(_MSC_VER)
+    int regs[4];
+    __cpuid(regs, 0);
+    int max_leaf = regs[0];
+    __cpuid(regs, 1);
+    *ssse3 = (regs[2] & (1 << 9)) != 0;
+    bool osxsave = (regs[2] & (1 << 27)) != 0;
+    *avx2 = false;
+    if (max_leaf >= 7 && osxsave && (_xgetbv(0) & 6) == 6) {
+        __cpuidex(regs, 7, 0);
+        *avx2 = (regs[1] & (1 << 5)) != 0;
+    }
+#else
+    __builtin_cpu_init();
+    *ssse3 = __builtin_cpu_supports("ssse3") != 0;
+    *avx2 = __builtin_cpu_supports("avx2") != 0;
+#endif
+}
+
+#endif // PIXEL_KERNELS_X86
+
+#ifdef PIXEL_KERNELS_NEON
+
+static void rgba_to_rgb_row_neon(const unsigned char *rgba, unsigned char *rgb, int pixels) {
+    int i = 0;
+    for (; i + 16 <= pixels; i += 16, rgba += 64, rgb += 48) {
+        uint8x16x4_t v = vld4q_u8(rgba);
+        uint8x16x3_t o;
+        o.val[0] = v.val[0];
+        o.val[1] = v.val[1];
+        o.val[2] = v.val[2];
+        vst3q_u8(rgb, o);
+    }
+    rgba_to_rgb_row_c(rgba, rgb, pixels - i);
+}
+
+static void bgra_to_rgb_row_neon(const unsigned char *bgra, unsigned char *rgb, int pixels) {
+    int i = 0;
+    for (; i + 16 <= pixels; i += 16, bgra += 64, rgb += 48) {
+        uint8x16x4_t v = vld4q_u8(bgra);
+        uint8x16x3_t o;
+        o.val[0] = v.val[2];
+        o.val[1] = v.val[1];
+        o.val[2] = v.val[0];
+        vst3q_u8(rgb, o);
+    }
+    bgra_to_rgb_row_c(bgra, rgb, pixels - i);
+}
+
+static void bgr_to_rgb_row_neon(const unsigned char *bgr, unsigned char *rgb, int pixels) {
+    int i = 0;
+    for (; i + 16 <= pixels; i += 16, bgr += 48, rgb += 48) {
+        uint8x16x3_t v = vld3q_u8(bgr);
+        uint8x16_t b = v.val[0];
+        v.val[0] = v.val[2];
+        v.val[2] = b;
+        vst3q_u8(rgb, v);
+    }
+    bgr_to_rgb_row_c(bgr, rgb, pixels - i);
+}
+
+// 16 pixels in, 8 out per iteration: pairwise widening adds within each
+// deinterleaved channel, a rounding narrow of the two rows' sum.
+static void halve_row_neon(const unsigned char *a, const unsigned char *b, unsigned char *out, int pixels) {
+    int i = 0;
+    for (; i + 16 <= pixels; i += 16, a += 64, b += 64, out += 32) {
+        uint8x16x4_t va = vld4q_u8(a);
+        uint8x16x4_t vb = vld4q_u8(b);
+        uint8x8x4_t o;
+        for (int c = 0; c < 4; c++)
+            o.val[c] = vrshrn_n_u16(vaddq_u16(vpaddlq_u8(va.val[c]), vpaddlq_u8(vb.val[c])), 2);
+        vst4_u8(out, o);
+    }
+    halve_row_c(a, b, out, pixels - i);
+}
+
+#endif // PIXEL_KERNELS_NEON
+
+static std::vector<pixel_kernel_set> kernel_sets() {
+    std::vector<pixel_kernel_set> sets;
+
+    pixel_kernel_set c = {
+        "c", rgba_to_rgb_row_c, bgra_to_rgb_row_c, bgr_to_rgb_row_c, halve_row_c
+    };
+    sets.push_back(c);
+
+#if defined(PIXEL_KERNELS_X86)
+    bool ssse3, avx2;
+    cpu_features(&ssse3, &avx2);
+    if (ssse3) {
+        pixel_kernel_set s = {
+            "ssse3", rgba_to_rgb_row_ssse3, bgra_to_rgb_row_ssse3, bgr_to_rgb_row_ssse3,
+            halve_row_sse2
+        };
+        sets.push_back(s);
+    }
+    if (ssse3 && avx2) {
+        // 3 byte pixels straddle the 128 bit lanes that AVX2 shuffles are
+        // confined to, so BGR keeps the SSSE3 kernel.
+        pixel_kernel_set s = {
+            "avx2", rgba_to_rgb_row_avx2, bgra_to_rgb_row_avx2, bgr_to_rgb_row_ssse3,
+            halve_row_sse2
+        };
+        sets.push_back(s);
+    }
+#elif defined(PIXEL_KERNELS_NEON)
+    pixel_kernel_set n = {
+        "neon", rgba_to_rgb_row_neon, bgra_to_rgb_row_neon, bgr_to_rgb_row_neon,
+        halve_row_neon
+    };
+    sets.push_back(n);
+#endif
+
+    return sets;
+}
+
+static pixel_kernel_set pixel_kernels = {
+    "c", rgba_to_rgb_row_c, bgra_to_rgb_row_c, bgr_to_rgb_row_c, halve_row_c
+};
+
+void init_pixel_kernels() {
+    pixel_kernels = kernel_sets().back();
+}
+
+const pixel_kernel_set &active_pixel_kernels() {
+    return pixel_kernels;
+}
+
+std::vector<pixel_kernel_set> supported_pixel_kernels() {
+    return kernel_sets();
+}
+
+void rgba_to_rgb_row(const unsigned char *rgba, unsigned char *rgb, int pixels) {
+    pixel_kernels.rgba_to_rgb(rgba, rgb, pixels);
+}
+
+void bgra_to_rgb_row(const unsigned char *bgra, unsigned char *rgb, int pixels) {
+    pixel_kernels.bgra_to_rgb(bgra, rgb, pixels);
+}
+
+void bgr_to_rgb_row(const unsigned char *bgr, unsigned char *rgb, int pixels) {
+    pixel_kernels.bgr_to_rgb(bgr, rgb, pixels);
+}
+
+void halve_row(const unsigned char *a, const unsigned char *b, unsigned char *out, int pixels) {
+    pixel_kernels.halve(a, b, out, pixels);
+}
@@ -0,0 +1,41 @@
+#ifndef PIXEL_KERNELS_H
+#define PIXEL_KERNELS_H
+
+#include <vector>
+
+typedef void (*row_converter)(const unsigned char *src, unsigned char *rgb, int pixels);
+typedef void (*row_halver)(const unsigned char *a, const unsigned char *b,
+    unsigned char *out, int pixels);
+
+// One implementation of every pixel kernel: scalar, or one instruction set.
+struct pixel_kernel_set {
+    const char *name;
+    row_converter rgba_to_rgb;
+    row_converter bgra_to_rgb;
+    row_converter bgr_to_rgb;
+    row_halver halve;
+};
+
+// Picks the best kernel set the CPU supports. Called once at module load.
+void init_pixel_kernels();
+
+// The set picked by init_pixel_kernels().
+const pixel_kernel_set &active_pixel_kernels();
+
+// Every set built in that the CPU supports, scalar first and the one
+// init_pixel_kernels() picks last. For checking them against each other.
+std::vector<pixel_kernel_set> supported_pixel_kernels();
+
+// Single-row converters, 'pixels' is the number of pixels in the row. They
+// may be called in place (rgb pointing at the source row) and dispatch to the
+// SIMD kernels selected by init_pixel_kernels().
+void rgba_to_rgb_row(const unsigned char *rgba, unsigned char *rgb, int pixels);
+void bgra_to_rgb_row(const unsigned char *bgra, unsigned char *rgb, int pixels);
+void bgr_to_rgb_row(const unsigned char *bgr, unsigned char *rgb, int pixels);
+
+// 2x2 box filter: two rows of 'pixels' 4 byte pixels (any channel order)
+// become one row of (pixels + 1)/2, an odd last column being averaged with
+// itself. Also dispatched by init_pixel_kernels().
+void halve_row(const unsigned char *a, const unsigned char *b, unsigned char *out, int pixels);
+
+#endif
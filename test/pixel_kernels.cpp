@@ -0,0 +1,132 @@
+// Checks every SIMD pixel kernel set the CPU supports against the scalar
+// kernels, byte for byte: row lengths 0 to 299, every alignment of source and
+// destination within 32 bytes, out of place and in place. Bytes around the
+// output must stay untouched. Exits non-zero if any kernel differs.
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <vector>
+
+#include "pixel_kernels.h"
+
+#define MAX_PIXELS 300
+#define ALIGNMENTS 32
+#define GUARD 64
+
+static unsigned int seed = 12345;
+
+static void fill_random(unsigned char *p, size_t len) {
+    for (size_t i = 0; i < len; i++) {
+        seed = seed*1103515245 + 12345;
+        p[i] = seed >> 16;
+    }
+}
+
+// Room for a row of 'pixels' 4 byte pixels at any alignment, plus guards.
+struct row_buffer {
+    std::vector<unsigned char> bytes;
+    row_buffer() : bytes(GUARD + ALIGNMENTS + MAX_PIXELS*4 + GUARD) {}
+    unsigned char *at(int align) { return &bytes[GUARD + align]; }
+};
+
+static int failures = 0;
+
+static void fail(const char *set, const char *kernel, const char *mode,
+    int pixels, int src_align, int dst_align)
+{
+    fprintf(stderr, "%s %s %s: mismatch at %d pixels, src +%d, dst +%d\n",
+        set, kernel, mode, pixels, src_align, dst_align);
+    failures++;
+}
+
+static void check_converter(const char *set, const char *kernel,
+    row_converter simd, row_converter ref)
+{
+    row_buffer src, dst, got, want;
+
+    for (int pixels = 0; pixels < MAX_PIXELS; pixels++) {
+        fill_random(&src.bytes[0], src.bytes.size());
+        fill_random(&dst.bytes[0], dst.bytes.size());
+
+        for (int sa = 0; sa < ALIGNMENTS; sa++) {
+            for (int da = 0; da < ALIGNMENTS; da++) {
+                got.bytes = dst.bytes;
+                want.bytes = dst.bytes;
+
+                simd(src.at(sa), got.at(da), pixels);
+                ref(src.at(sa), want.at(da), pixels);
+                if (got.bytes != want.bytes) {
+                    fail(set, kernel, "out of place", pixels, sa, da);
+                    return;
+                }
+            }
+
+            // In place, the rgb output over the source row.
+            got.bytes = src.bytes;
+            want.bytes = src.bytes;
+            simd(got.at(sa), got.at(sa), pixels);
+            ref(want.at(sa), want.at(sa), pixels);
+            if (got.bytes != want.bytes) {
+                fail(set, kernel, "in place", pixels, sa, sa);
+                return;
+            }
+        }
+    }
+}
+
+static void check_halver(const char *set, row_halver simd, row_halver ref)
+{
+    row_buffer a, b, dst, got, want;
+
+    for (int pixels = 0; pixels < MAX_PIXELS; pixels++) {
+        fill_random(&a.bytes[0], a.bytes.size());
+        fill_random(&b.bytes[0], b.bytes.size());
+        fill_random(&dst.bytes[0], dst.bytes.size());
+
+        for (int aa = 0; aa < ALIGNMENTS; aa++) {
+            int ba = ALIGNMENTS - 1 - aa;
+            for (int da = 0; da < ALIGNMENTS; da++) {
+                got.bytes = dst.bytes;
+                want.bytes = dst.bytes;
+
+                simd(a.at(aa), b.at(ba), got.at(da), pixels);
+                ref(a.at(aa), b.at(ba), want.at(da), pixels);
+                if (got.bytes != want.bytes) {
+                    fail(set, "halve", "out of place", pixels, aa, da);
+                    return;
+                }
+            }
+
+            // In place, the output over the first row.
+            got.bytes = a.bytes;
+            want.bytes = a.bytes;
+            simd(got.at(aa), b.at(ba), got.at(aa), pixels);
+            ref(want.at(aa), b.at(ba), want.at(aa), pixels);
+            if (got.bytes != want.bytes) {
+                fail(set, "halve", "in place", pixels, aa, aa);
+                return;
+            }
+        }
+    }
+}
+
+int main() {
+    std::vector<pixel_kernel_set> sets = supported_pixel_kernels();
+    const pixel_kernel_set &c = sets[0];
+
+    for (size_t i = 1; i < sets.size(); i++) {
+        const pixel_kernel_set &s = sets[i];
+        int before = failures;
+        check_converter(s.name, "rgba_to_rgb", s.rgba_to_rgb, c.rgba_to_rgb);
+        check_converter(s.name, "bgra_to_rgb", s.bgra_to_rgb, c.bgra_to_rgb);
+        check_converter(s.name, "bgr_to_rgb", s.bgr_to_rgb, c.bgr_to_rgb);
+        check_halver(s.name, s.halve, c.halve);
+        printf("%s: %s\n", s.name, failures > before ? "FAILED" : "ok");
+    }
+
+    init_pixel_kernels();
+    printf("dispatching to %s\n", active_pixel_kernels().name);
+
+    return failures ? 1 : 0;
+}